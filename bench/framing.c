@@ -0,0 +1,141 @@
+#include "frame.h"
+#include "protocol.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures how many messages per second go through a pipe from a writer thread
+// to a reader, sent as whole packet_t structs ("fixed", how the pipes used to
+// work) and as frames ("framed"), for a few message sizes.
+//
+// usage: framing [messages]
+
+#define DEFAULT_MESSAGES 200000
+
+static size_t const message_sizes[] = {10, 100, 1000};
+
+static size_t n_messages;
+static size_t message_size;
+static int write_fd;
+static bool framed;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "framing: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.opcode = PUBLISH_MESSAGE;
+    memset(packet.payload.message_data.message, 'x', message_size - 1);
+
+    char frame[FRAME_MAX_SIZE];
+    for (size_t i = 0; i < n_messages; i++) {
+        ssize_t written;
+        if (framed) {
+            size_t size = frame_encode(&packet, frame);
+            written = write(write_fd, frame, size) - (ssize_t)size;
+        } else {
+            written = write(write_fd, &packet, sizeof(packet)) -
+                      (ssize_t)sizeof(packet);
+        }
+        if (written != 0) {
+            fail("write");
+        }
+    }
+    close(write_fd);
+    return NULL;
+}
+
+/**
+ * Reads packets until the writer closes the pipe.
+ *
+ * Returns the number of messages read.
+ */
+static size_t read_all(int fd) {
+    size_t count = 0;
+    packet_t packet;
+    if (framed) {
+        frame_reader_t reader;
+        frame_reader_init(&reader, fd);
+        int ret;
+        while ((ret = frame_read(&reader, &packet)) == 1) {
+            count++;
+        }
+        if (ret == -1) {
+            fail("frame_read");
+        }
+        return count;
+    }
+
+    // Fixed-size packets may still arrive split across reads
+    size_t done = 0;
+    while (true) {
+        ssize_t bytes_read =
+            read(fd, (char *)&packet + done, sizeof(packet) - done);
+        if (bytes_read == 0) {
+            return count;
+        }
+        if (bytes_read < 0) {
+            fail("read");
+        }
+        done += (size_t)bytes_read;
+        if (done == sizeof(packet)) {
+            count++;
+            done = 0;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    n_messages = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+
+    printf("encoding,message_size,messages,msgs_per_sec,bytes_per_msg\n");
+    for (int f = 0; f <= 1; f++) {
+        framed = f;
+        for (size_t s = 0; s < sizeof(message_sizes) / sizeof(size_t); s++) {
+            message_size = message_sizes[s];
+
+            int fds[2];
+            if (pipe(fds) == -1) {
+                fail("pipe");
+            }
+            write_fd = fds[1];
+
+            uint64_t start = now_ns();
+            pthread_t thread;
+            pthread_create(&thread, NULL, writer, NULL);
+            size_t count = read_all(fds[0]);
+            pthread_join(thread, NULL);
+            double secs = (double)(now_ns() - start) / 1e9;
+            close(fds[0]);
+
+            if (count != n_messages) {
+                fprintf(stderr, "framing: read %zu of %zu messages\n", count,
+                        n_messages);
+                return EXIT_FAILURE;
+            }
+
+            // Bytes through the pipe per message (the '\0' is not sent)
+            size_t bytes = framed ? sizeof(frame_header_t) + message_size - 1
+                                  : sizeof(packet_t);
+            printf("%s,%zu,%zu,%.0f,%zu\n", framed ? "framed" : "fixed",
+                   message_size, n_messages, (double)n_messages / secs,
+                   bytes);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,628 @@
+#define _GNU_SOURCE // pipe2
+#include "histogram.h"
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end load generator: starts mbroker, creates a box per publisher with
+// manager, and runs the real pub and sub binaries over their FIFOs (or
+// connections to mbroker's socket, with --transport socket), with mbroker
+// serving sessions on the given I/O engine (see --io-engine there). Each
+// publisher is fed messages of the given size at the given rate (0: as fast as
+// it takes them) through its stdin; subscribers are spread over the boxes, and
+// their stdout read back here. Every message carries its send time, so the
+// latency measured is from a line reaching a publisher to it leaving a
+// subscriber.
+//
+// Prints a CSV line with the throughput, latency percentiles, and the CPU time
+// mbroker used.
+//
+// usage: loadgen [--bin <dir with the mbroker, manager, publisher and
+//                subscriber directories>] [--publishers N] [--subscribers M]
+//                [--messages <per publisher>] [--size <bytes>]
+//                [--rate <msgs/s per publisher>] [--batch <pub batch>]
+//                [--shm <ring KB>] [--transport fifo|socket]
+//                [--io-engine epoll|uring]
+
+#define DEFAULT_PUBLISHERS 2
+#define DEFAULT_SUBSCRIBERS 4
+#define DEFAULT_MESSAGES 20000
+#define DEFAULT_SIZE 64
+// Smallest message: the send time, a space and the sequence number
+#define MIN_SIZE 32
+// Bytes of messages handed to a publisher at once, when not rate limited
+#define WRITE_CHUNK (64 * 1024)
+// Give up waiting for deliveries after this long without any
+#define IDLE_TIMEOUT_MS 10000
+// Give up waiting for mbroker to start or subscribers to attach after this
+#define SETUP_TIMEOUT_MS 10000
+
+typedef struct {
+    char const *bin;
+    size_t publishers;
+    size_t subscribers;
+    size_t messages;
+    size_t size;
+    size_t rate;
+    char const *batch;
+    // Ring size (KB) of clients using shared memory instead of their pipe
+    char const *shm;
+    bool socket;
+    char const *engine;
+} options_t;
+
+typedef struct {
+    size_t id;
+    int fd;
+    // When the publisher was handed its last message
+    uint64_t done;
+} publisher_t;
+
+typedef struct {
+    pid_t pid;
+    int fd;
+    // Partial line carried over between reads
+    char line[MESSAGE_SIZE + 1];
+    size_t line_len;
+    size_t received;
+} subscriber_t;
+
+static options_t options = {
+    .bin = ".",
+    .publishers = DEFAULT_PUBLISHERS,
+    .subscribers = DEFAULT_SUBSCRIBERS,
+    .messages = DEFAULT_MESSAGES,
+    .size = DEFAULT_SIZE,
+    .rate = 0,
+    .batch = NULL,
+    .shm = NULL,
+    .socket = false,
+    .engine = NULL,
+};
+
+static char work_dir[] = "/tmp/loadgen.XXXXXX";
+static char register_pipe[PIPE_NAME_SIZE];
+static char register_socket[PIPE_NAME_SIZE];
+// What the clients register through: the register pipe or the socket
+static char *register_name = register_pipe;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "loadgen: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: loadgen [--bin <dir>] [--publishers N] [--subscribers M] "
+            "[--messages <per publisher>] [--size <bytes>] "
+            "[--rate <msgs/s per publisher>] [--batch <pub batch>] "
+            "[--shm <ring KB>] [--transport fifo|socket] "
+            "[--io-engine epoll|uring]\n");
+    exit(EXIT_FAILURE);
+}
+
+static size_t parse_size(char const *value) {
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        usage();
+    }
+    return parsed;
+}
+
+static void parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        char const *name = argv[i];
+        char const *value = argv[i + 1];
+        if (strcmp(name, "--bin") == 0) {
+            options.bin = value;
+        } else if (strcmp(name, "--publishers") == 0) {
+            options.publishers = parse_size(value);
+        } else if (strcmp(name, "--subscribers") == 0) {
+            options.subscribers = parse_size(value);
+        } else if (strcmp(name, "--messages") == 0) {
+            options.messages = parse_size(value);
+        } else if (strcmp(name, "--size") == 0) {
+            options.size = parse_size(value);
+        } else if (strcmp(name, "--rate") == 0) {
+            options.rate = parse_size(value);
+        } else if (strcmp(name, "--batch") == 0) {
+            parse_size(value);
+            options.batch = value;
+        } else if (strcmp(name, "--shm") == 0) {
+            parse_size(value);
+            options.shm = value;
+        } else if (strcmp(name, "--transport") == 0) {
+            if (strcmp(value, "fifo") != 0 && strcmp(value, "socket") != 0) {
+                usage();
+            }
+            options.socket = strcmp(value, "socket") == 0;
+        } else if (strcmp(name, "--io-engine") == 0) {
+            if (strcmp(value, "epoll") != 0 && strcmp(value, "uring") != 0) {
+                usage();
+            }
+            options.engine = value;
+        } else {
+            usage();
+        }
+    }
+
+    if (options.publishers == 0 || options.size < MIN_SIZE ||
+        options.size >= MESSAGE_SIZE) {
+        fprintf(stderr, "loadgen: need a publisher and a size from %d to %d\n",
+                MIN_SIZE, MESSAGE_SIZE - 1);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Returns the CPU time (user and system) a running process used so far, or -1
+ * if it can't be read.
+ */
+static double cpu_secs(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    char stat[1024];
+    size_t size = fread(stat, 1, sizeof(stat) - 1, file);
+    fclose(file);
+    stat[size] = '\0';
+
+    // utime and stime are the 12th and 13th fields after the command name,
+    // which ends with the last ')'
+    unsigned long utime, stime;
+    char const *fields = strrchr(stat, ')');
+    if (fields == NULL ||
+        sscanf(fields + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+               &stime) != 2) {
+        return -1;
+    }
+    return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Runs one of the project's binaries, with stdin and stdout redirected (if
+ * not -1) and stderr (its logging) discarded.
+ *
+ * Returns its pid.
+ */
+static pid_t spawn(char const *binary, char **args, int in, int out) {
+    char path[PIPE_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s/%s", options.bin, binary);
+    args[0] = path;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        fail("fork");
+    }
+    if (pid == 0) {
+        // Every other descriptor of ours is close-on-exec, so the children
+        // don't keep each other's pipes open
+        if (in != -1) {
+            dup2(in, STDIN_FILENO);
+        }
+        if (out != -1) {
+            dup2(out, STDOUT_FILENO);
+        }
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        execv(path, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Runs manager and waits for it.
+ *
+ * Input:
+ *   - op: manager operation (create, remove or list)
+ *   - box: box to create or remove (NULL to list)
+ *   - out: where manager's output goes (-1: discarded)
+ */
+static void run_manager(char const *op, char const *box, int out) {
+    static size_t requests;
+    char pipe[PIPE_NAME_SIZE];
+    snprintf(pipe, sizeof(pipe), "%s/manager%zu", work_dir, requests++);
+    char *args[] = {NULL,        register_name, pipe, (char *)op,
+                    (char *)box, NULL};
+
+    int null = -1;
+    if (out == -1) {
+        null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        out = null;
+    }
+    pid_t pid = spawn("manager/manager", args, -1, out);
+    int status;
+    waitpid(pid, &status, 0);
+    if (null != -1) {
+        close(null);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "loadgen: manager %s failed\n", op);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void box_name(char *name, size_t id) {
+    snprintf(name, BOX_NAME_SIZE, "loadgen%zu", id);
+}
+
+/**
+ * Waits until as many subscribers as started are attached to the boxes (as
+ * listed by manager), so the latency of the first messages doesn't include
+ * subscribing.
+ */
+static void wait_for_subscribers() {
+    uint64_t deadline = now_ns() + (uint64_t)SETUP_TIMEOUT_MS * 1000000;
+    while (now_ns() < deadline) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            fail("pipe");
+        }
+        run_manager("list", NULL, fds[1]);
+        close(fds[1]);
+
+        // Lines are "<box> <size> <publishers> <subscribers>"
+        FILE *list = fdopen(fds[0], "r");
+        size_t attached = 0;
+        char name[BOX_NAME_SIZE + 1];
+        size_t size, publishers, subscribers;
+        while (fscanf(list, "%32s %zu %zu %zu", name, &size, &publishers,
+                      &subscribers) == 4) {
+            attached += subscribers;
+        }
+        fclose(list);
+
+        if (attached >= options.subscribers) {
+            return;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "loadgen: subscribers did not attach\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Sleeps until the given time (of now_ns).
+ */
+static void sleep_until(uint64_t when) {
+    struct timespec ts = {
+        .tv_sec = (time_t)(when / 1000000000),
+        .tv_nsec = (long)(when % 1000000000),
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR) {
+    }
+}
+
+/**
+ * Formats message i (with its send time) as a line of options.size
+ * characters plus the newline.
+ */
+static size_t format_message(char *line, size_t i) {
+    int len = snprintf(line, options.size + 1, "%" PRIu64 " %zu ", now_ns(), i);
+    if (len < 0 || (size_t)len > options.size) {
+        len = (int)options.size;
+    }
+    memset(line + len, 'x', options.size - (size_t)len);
+    line[options.size] = '\n';
+    return options.size + 1;
+}
+
+static void write_all(int fd, char const *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("write to publisher");
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+}
+
+/**
+ * Feeds a publisher its messages, paced to options.rate, and closes its stdin.
+ */
+static void *feed_publisher(void *arg) {
+    publisher_t *publisher = arg;
+    char *chunk = malloc(WRITE_CHUNK);
+    size_t per_chunk = WRITE_CHUNK / (options.size + 1);
+
+    uint64_t start = now_ns();
+    size_t i = 0;
+    while (i < options.messages) {
+        size_t n = options.messages - i;
+        if (options.rate > 0) {
+            // Send whatever is due by now (at least the next message)
+            uint64_t next = start + i * 1000000000 / options.rate;
+            sleep_until(next);
+            uint64_t due = (now_ns() - start) * options.rate / 1000000000 + 1;
+            n = due > i ? due - i : 1;
+        }
+        if (n > per_chunk) {
+            n = per_chunk;
+        }
+        if (n > options.messages - i) {
+            n = options.messages - i;
+        }
+
+        size_t size = 0;
+        for (size_t j = 0; j < n; j++) {
+            size += format_message(chunk + size, i + j);
+        }
+        write_all(publisher->fd, chunk, size);
+        i += n;
+    }
+
+    publisher->done = now_ns();
+    close(publisher->fd);
+    free(chunk);
+    return NULL;
+}
+
+/**
+ * Reads what a subscriber wrote, recording the latency of every complete
+ * message line.
+ *
+ * Returns the number of bytes read (0 if the subscriber closed its stdout).
+ */
+static ssize_t read_subscriber(subscriber_t *sub, histogram_t *latencies) {
+    char buffer[WRITE_CHUNK];
+    ssize_t bytes_read = read(sub->fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+
+    uint64_t now = now_ns();
+    for (ssize_t i = 0; i < bytes_read; i++) {
+        if (buffer[i] != '\n') {
+            if (sub->line_len < MESSAGE_SIZE) {
+                sub->line[sub->line_len++] = buffer[i];
+            }
+            continue;
+        }
+
+        // Only the messages start with a digit ("Received ..." doesn't)
+        sub->line[sub->line_len] = '\0';
+        if (sub->line[0] >= '0' && sub->line[0] <= '9') {
+            uint64_t sent = strtoull(sub->line, NULL, 10);
+            histogram_record(latencies, now > sent ? now - sent : 0);
+            sub->received++;
+        }
+        sub->line_len = 0;
+    }
+    return bytes_read;
+}
+
+static void stop(pid_t pid, int sig) {
+    kill(pid, sig);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+    signal(SIGPIPE, SIG_IGN);
+
+    // One pipe per client in mbroker, plus ours
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (mkdtemp(work_dir) == NULL) {
+        fail("mkdtemp");
+    }
+    snprintf(register_pipe, sizeof(register_pipe), "%s/register", work_dir);
+
+    // Enough workers for every registration to be handled at once
+    char sessions[32];
+    snprintf(sessions, sizeof(sessions), "%zu",
+             options.publishers + options.subscribers + 1);
+    snprintf(register_socket, sizeof(register_socket), "%s/register.sock",
+             work_dir);
+    char *broker_args[8] = {NULL, register_pipe, sessions};
+    size_t n_broker_args = 3;
+    if (options.socket) {
+        broker_args[n_broker_args++] = "--socket";
+        broker_args[n_broker_args++] = register_socket;
+        register_name = register_socket;
+    }
+    if (options.engine != NULL) {
+        broker_args[n_broker_args++] = "--io-engine";
+        broker_args[n_broker_args++] = (char *)options.engine;
+    }
+    pid_t broker = spawn("mbroker/mbroker", broker_args, -1, -1);
+
+    uint64_t deadline = now_ns() + (uint64_t)SETUP_TIMEOUT_MS * 1000000;
+    while (access(register_pipe, F_OK) == -1) {
+        if (now_ns() > deadline || waitpid(broker, NULL, WNOHANG) != 0) {
+            fprintf(stderr, "loadgen: mbroker did not start\n");
+            return EXIT_FAILURE;
+        }
+        usleep(1000);
+    }
+
+    char box[BOX_NAME_SIZE];
+    for (size_t i = 0; i < options.publishers; i++) {
+        box_name(box, i);
+        run_manager("create", box, -1);
+    }
+
+    // Subscriber i follows box i % publishers
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    subscriber_t *subs = calloc(options.subscribers, sizeof(subscriber_t));
+    for (size_t i = 0; i < options.subscribers; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            fail("pipe");
+        }
+        char pipe[PIPE_NAME_SIZE];
+        snprintf(pipe, sizeof(pipe), "%s/sub%zu", work_dir, i);
+        box_name(box, i % options.publishers);
+        // Without --shm, the list ends where it would be
+        char *args[] = {NULL, register_name, pipe, box,
+                        options.shm != NULL ? "--shm" : NULL,
+                        (char *)options.shm, NULL};
+        subs[i].pid = spawn("subscriber/sub", args, -1, fds[1]);
+        subs[i].fd = fds[0];
+        close(fds[1]);
+
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = i};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, subs[i].fd, &event) == -1) {
+            fail("epoll_ctl");
+        }
+    }
+    wait_for_subscribers();
+
+    pid_t *pub_pids = malloc(sizeof(pid_t) * options.publishers);
+    publisher_t *pubs = calloc(options.publishers, sizeof(publisher_t));
+    for (size_t i = 0; i < options.publishers; i++) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            fail("pipe");
+        }
+        char pipe[PIPE_NAME_SIZE];
+        snprintf(pipe, sizeof(pipe), "%s/pub%zu", work_dir, i);
+        box_name(box, i);
+        char *args[9] = {NULL, register_name, pipe, box};
+        size_t n_args = 4;
+        if (options.batch != NULL) {
+            args[n_args++] = "--batch";
+            args[n_args++] = (char *)options.batch;
+        }
+        if (options.shm != NULL) {
+            args[n_args++] = "--shm";
+            args[n_args++] = (char *)options.shm;
+        }
+        pub_pids[i] = spawn("publisher/pub", args, fds[0], -1);
+        close(fds[0]);
+        pubs[i].id = i;
+        pubs[i].fd = fds[1];
+    }
+
+    pthread_t *feeders = malloc(sizeof(pthread_t) * options.publishers);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < options.publishers; i++) {
+        pthread_create(&feeders[i], NULL, feed_publisher, &pubs[i]);
+    }
+
+    // Every subscriber gets every message of its box
+    static histogram_t latencies;
+    histogram_init(&latencies);
+    size_t expected = options.subscribers * options.messages;
+    size_t delivered = 0;
+    uint64_t last_delivery = start;
+    struct epoll_event events[64];
+    while (delivered < expected) {
+        int n = epoll_wait(epoll_fd, events, 64, IDLE_TIMEOUT_MS);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "loadgen: timed out with %zu of %zu messages "
+                            "delivered\n",
+                    delivered, expected);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            subscriber_t *sub = &subs[events[i].data.u64];
+            size_t before = sub->received;
+            if (read_subscriber(sub, &latencies) <= 0) {
+                // The subscriber is gone
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+            }
+            delivered += sub->received - before;
+        }
+        last_delivery = now_ns();
+    }
+
+    uint64_t published_end = start;
+    for (size_t i = 0; i < options.publishers; i++) {
+        pthread_join(feeders[i], NULL);
+        if (pubs[i].done > published_end) {
+            published_end = pubs[i].done;
+        }
+    }
+    double publish_secs = (double)(published_end - start) / 1e9;
+    double delivery_secs = (double)(last_delivery - start) / 1e9;
+
+    printf("publishers,subscribers,message_size,rate,messages,"
+           "published_per_sec,delivered,delivered_per_sec,p50_us,p99_us,"
+           "p999_us,max_us,broker_cpu_secs\n");
+    printf("%zu,%zu,%zu,%zu,%zu,%.0f,%zu,%.0f,%.1f,%.1f,%.1f,%.1f,%.2f\n",
+           options.publishers, options.subscribers, options.size, options.rate,
+           options.messages,
+           (double)(options.publishers * options.messages) / publish_secs,
+           delivered, (double)delivered / delivery_secs,
+           (double)histogram_quantile(&latencies, 0.5) / 1e3,
+           (double)histogram_quantile(&latencies, 0.99) / 1e3,
+           (double)histogram_quantile(&latencies, 0.999) / 1e3,
+           (double)latencies.max / 1e3, cpu_secs(broker));
+
+    // Publishers leave once their stdin is closed, subscribers and mbroker
+    // are interrupted
+    for (size_t i = 0; i < options.publishers; i++) {
+        waitpid(pub_pids[i], NULL, 0);
+    }
+    for (size_t i = 0; i < options.subscribers; i++) {
+        stop(subs[i].pid, SIGINT);
+        close(subs[i].fd);
+    }
+    for (size_t i = 0; i < options.publishers; i++) {
+        box_name(box, i);
+        run_manager("remove", box, -1);
+    }
+    stop(broker, SIGINT);
+
+    char path[PIPE_NAME_SIZE + 16];
+    for (size_t i = 0; i < options.subscribers; i++) {
+        snprintf(path, sizeof(path), "%s/sub%zu", work_dir, i);
+        unlink(path);
+    }
+    for (size_t i = 0; i < options.publishers; i++) {
+        snprintf(path, sizeof(path), "%s/pub%zu", work_dir, i);
+        unlink(path);
+    }
+    unlink(register_pipe);
+    unlink(register_socket);
+    rmdir(work_dir);
+
+    free(feeders);
+    free(pubs);
+    free(pub_pids);
+    free(subs);
+    close(epoll_fd);
+    return delivered == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
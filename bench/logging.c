@@ -0,0 +1,80 @@
+#include "logging.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Measures how many log messages per second threads can emit through LOG
+// (queued, formatted by a background thread) and through a synchronous
+// fprintf to stderr like LOG used to do, from 1..N threads. Run it with stderr
+// redirected (e.g. 2>/dev/null or to a file).
+//
+// usage: logging [messages per thread] [max threads]
+
+#define DEFAULT_MESSAGES 200000
+#define DEFAULT_MAX_THREADS 4
+
+// How LOG used to write every message
+#define SYNC_LOG(...)                                                          \
+    do {                                                                       \
+        char buf[2048];                                                        \
+        snprintf(buf, 2048, __VA_ARGS__);                                      \
+        fprintf(stderr, "[LOG]:   %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
+                __func__, buf);                                                \
+    } while (0);
+
+static size_t n_messages;
+static int sync_mode;
+
+static void *logger(void *arg) {
+    size_t id = (size_t)(uintptr_t)arg;
+    for (size_t i = 0; i < n_messages; i++) {
+        // A typical message: a name and a couple of numbers
+        if (sync_mode) {
+            SYNC_LOG("Sent message %zu of box%zu (%d bytes)", i, id, 42);
+        } else {
+            LOG("Sent message %zu of box%zu (%d bytes)", i, id, 42);
+        }
+    }
+    return NULL;
+}
+
+static double elapsed(struct timespec const *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) +
+           (double)(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    n_messages = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MESSAGES;
+    size_t max_threads =
+        argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_MAX_THREADS;
+
+    printf("logger,threads,messages,emit_msgs_per_sec,total_msgs_per_sec\n");
+    for (sync_mode = 1; sync_mode >= 0; sync_mode--) {
+        for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+            pthread_t threads[n_threads];
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (size_t i = 0; i < n_threads; i++) {
+                pthread_create(&threads[i], NULL, logger,
+                               (void *)(uintptr_t)i);
+            }
+            for (size_t i = 0; i < n_threads; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            // Until the threads are done, and until every message is out
+            double emit_secs = elapsed(&start);
+            log_flush();
+            double total_secs = elapsed(&start);
+
+            double total = (double)(n_threads * n_messages);
+            printf("%s,%zu,%zu,%.0f,%.0f\n", sync_mode ? "sync" : "async",
+                   n_threads, n_messages, total / emit_secs,
+                   total / total_secs);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,314 @@
+#include "frame.h"
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Load test for a running mbroker: attaches thousands of subscribers, most of
+// them to boxes nobody publishes to, plus a handful of publishers sending as
+// fast as they can to their own (hot) boxes, each followed by a few
+// subscribers. Reports how long subscribing took, the publishing rate and the
+// publish-to-delivery latency seen by the hot subscribers.
+//
+// usage: mbroker_load <register_pipe> [subscribers] [publishers] [messages]
+
+#define DEFAULT_SUBSCRIBERS 5000
+#define DEFAULT_PUBLISHERS 4
+#define DEFAULT_MESSAGES 2000
+// Subscribers of each hot box; the rest are spread over the cold boxes
+#define HOT_SUBSCRIBERS 8
+#define COLD_BOXES 16
+// Give up waiting for deliveries after this long without any
+#define IDLE_TIMEOUT_MS 10000
+
+static int register_pipe;
+static char work_dir[] = "/tmp/mbroker_load.XXXXXX";
+static size_t n_messages;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "mbroker_load: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Creates a fresh client pipe in the work directory, named after kind and id.
+ */
+static void client_pipe(char *path, char const *kind, size_t id) {
+    snprintf(path, PIPE_NAME_SIZE, "%s/%s%zu", work_dir, kind, id);
+    if (mkfifo(path, 0666) == -1) {
+        fail("mkfifo");
+    }
+}
+
+static void send_request(uint8_t opcode, char const *pipe, char const *box) {
+    packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.opcode = opcode;
+    snprintf(packet.payload.registration_data.client_pipe, PIPE_NAME_SIZE,
+             "%s", pipe);
+    snprintf(packet.payload.registration_data.box_name, BOX_NAME_SIZE, "%s",
+             box);
+
+    // Frames fit in PIPE_BUF, so concurrent requests don't interleave
+    char frame[FRAME_MAX_SIZE];
+    size_t size = frame_encode(&packet, frame);
+    if (write(register_pipe, frame, size) != (ssize_t)size) {
+        fail("write register pipe");
+    }
+}
+
+/**
+ * Sends a manager request (creating or removing a box) and waits for the
+ * answer.
+ */
+static void manage_box(uint8_t opcode, char const *box) {
+    static size_t requests;
+    char path[PIPE_NAME_SIZE];
+    client_pipe(path, "manager", requests++);
+    send_request(opcode, path, box);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fail("open manager pipe");
+    }
+    frame_reader_t reader;
+    frame_reader_init(&reader, fd);
+    packet_t answer;
+    if (frame_read(&reader, &answer) != 1) {
+        fail("read manager answer");
+    }
+    if (answer.payload.answer_data.return_code != 0) {
+        fprintf(stderr, "mbroker_load: request %d for box %s failed: %s\n",
+                opcode, box, answer.payload.answer_data.error_message);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    unlink(path);
+}
+
+static void box_name(char *name, char const *kind, size_t id) {
+    snprintf(name, BOX_NAME_SIZE, "load%d_%s%zu", (int)getpid(), kind, id);
+}
+
+static void *publisher(void *arg) {
+    size_t id = (size_t)(uintptr_t)arg;
+    char box[BOX_NAME_SIZE];
+    box_name(box, "hot", id);
+
+    char path[PIPE_NAME_SIZE];
+    client_pipe(path, "pub", id);
+    send_request(REGISTER_PUBLISHER, path, box);
+    int fd = open(path, O_WRONLY);
+    if (fd == -1) {
+        fail("open publisher pipe");
+    }
+
+    packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.opcode = PUBLISH_MESSAGE;
+    char frame[FRAME_MAX_SIZE];
+    for (size_t i = 0; i < n_messages; i++) {
+        // The send time travels in the message, for the latency
+        snprintf(packet.payload.message_data.message, MESSAGE_SIZE,
+                 "%" PRIu64 " %zu", now_ns(), i);
+        size_t size = frame_encode(&packet, frame);
+        if (write(fd, frame, size) != (ssize_t)size) {
+            fail("write publisher pipe");
+        }
+    }
+
+    close(fd);
+    unlink(path);
+    return NULL;
+}
+
+static int compare_u64(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: mbroker_load <register_pipe> [subscribers] "
+                        "[publishers] [messages]\n");
+        return EXIT_FAILURE;
+    }
+    register_pipe = open(argv[1], O_WRONLY);
+    if (register_pipe == -1) {
+        fail("open register pipe");
+    }
+    size_t n_subscribers =
+        argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_SUBSCRIBERS;
+    size_t n_publishers =
+        argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_PUBLISHERS;
+    n_messages = argc > 4 ? strtoul(argv[4], NULL, 10) : DEFAULT_MESSAGES;
+
+    size_t n_hot = n_publishers * HOT_SUBSCRIBERS;
+    if (n_publishers == 0 || n_subscribers < n_hot) {
+        fprintf(stderr, "need at least %d subscribers per publisher\n",
+                HOT_SUBSCRIBERS);
+        return EXIT_FAILURE;
+    }
+
+    // One pipe per subscriber
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (mkdtemp(work_dir) == NULL) {
+        fail("mkdtemp");
+    }
+
+    char box[BOX_NAME_SIZE];
+    for (size_t i = 0; i < n_publishers; i++) {
+        box_name(box, "hot", i);
+        manage_box(CREATE_MAILBOX, box);
+    }
+    for (size_t i = 0; i < COLD_BOXES; i++) {
+        box_name(box, "cold", i);
+        manage_box(CREATE_MAILBOX, box);
+    }
+
+    // Subscribers [0, n_hot) follow the hot boxes, the rest the cold ones
+    int epoll_fd = epoll_create1(0);
+    int *subscribers = malloc(sizeof(int) * n_subscribers);
+    // Only the hot subscribers' messages are decoded
+    frame_reader_t *readers = malloc(sizeof(frame_reader_t) * n_hot);
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_subscribers; i++) {
+        if (i < n_hot) {
+            box_name(box, "hot", i / HOT_SUBSCRIBERS);
+        } else {
+            box_name(box, "cold", i % COLD_BOXES);
+        }
+
+        char path[PIPE_NAME_SIZE];
+        client_pipe(path, "sub", i);
+        send_request(REGISTER_SUBSCRIBER, path, box);
+        // Non-blocking, so this doesn't wait for mbroker to open its end
+        subscribers[i] = open(path, O_RDONLY | O_NONBLOCK);
+        if (subscribers[i] == -1) {
+            fail("open subscriber pipe");
+        }
+        if (i < n_hot) {
+            frame_reader_init(&readers[i], subscribers[i]);
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = i};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, subscribers[i], &event) == -1) {
+            fail("epoll_ctl");
+        }
+    }
+    double subscribe_secs = (double)(now_ns() - start) / 1e9;
+
+    pthread_t *publishers = malloc(sizeof(pthread_t) * n_publishers);
+    start = now_ns();
+    for (size_t i = 0; i < n_publishers; i++) {
+        pthread_create(&publishers[i], NULL, publisher, (void *)(uintptr_t)i);
+    }
+
+    // Collect the deliveries to the hot subscribers
+    size_t expected = n_hot * n_messages;
+    uint64_t *latencies = malloc(sizeof(uint64_t) * expected);
+    size_t delivered = 0;
+    size_t stray = 0;
+    struct epoll_event events[64];
+    while (delivered < expected) {
+        int n = epoll_wait(epoll_fd, events, 64, IDLE_TIMEOUT_MS);
+        if (n == 0) {
+            fprintf(stderr, "timed out with %zu of %zu messages delivered\n",
+                    delivered, expected);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            size_t sub = (size_t)events[i].data.u64;
+            int ret;
+            if (sub >= n_hot) {
+                char discard[FRAME_READER_BUFFER];
+                ssize_t bytes_read;
+                while ((bytes_read = read(subscribers[sub], discard,
+                                          sizeof(discard))) > 0) {
+                    stray++;
+                }
+                ret = (int)bytes_read;
+            } else {
+                packet_t packet;
+                while ((ret = frame_read(&readers[sub], &packet)) == 1) {
+                    uint64_t sent_ns = strtoull(
+                        packet.payload.message_data.message, NULL, 10);
+                    if (delivered < expected) {
+                        latencies[delivered++] = now_ns() - sent_ns;
+                    }
+                }
+            }
+            if (ret == 0) {
+                // mbroker ended the session
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscribers[sub], NULL);
+            }
+        }
+    }
+    double delivery_secs = (double)(now_ns() - start) / 1e9;
+
+    for (size_t i = 0; i < n_publishers; i++) {
+        pthread_join(publishers[i], NULL);
+    }
+
+    qsort(latencies, delivered, sizeof(uint64_t), compare_u64);
+    printf("subscribers,publishers,messages,subscribe_secs,"
+           "published_per_sec,delivered,delivered_per_sec,p50_us,p99_us,"
+           "max_us\n");
+    printf("%zu,%zu,%zu,%.3f,%.0f,%zu,%.0f,%.1f,%.1f,%.1f\n", n_subscribers,
+           n_publishers, n_messages, subscribe_secs,
+           (double)(n_publishers * n_messages) / delivery_secs, delivered,
+           (double)delivered / delivery_secs,
+           delivered ? (double)latencies[delivered / 2] / 1e3 : 0.0,
+           delivered ? (double)latencies[delivered * 99 / 100] / 1e3 : 0.0,
+           delivered ? (double)latencies[delivered - 1] / 1e3 : 0.0);
+    if (stray > 0) {
+        fprintf(stderr, "%zu reads from cold box subscribers\n", stray);
+    }
+
+    // Hang up the subscribers and remove the boxes
+    for (size_t i = 0; i < n_subscribers; i++) {
+        close(subscribers[i]);
+        char path[PIPE_NAME_SIZE];
+        snprintf(path, PIPE_NAME_SIZE, "%s/sub%zu", work_dir, i);
+        unlink(path);
+    }
+    for (size_t i = 0; i < n_publishers; i++) {
+        box_name(box, "hot", i);
+        manage_box(REMOVE_MAILBOX, box);
+    }
+    for (size_t i = 0; i < COLD_BOXES; i++) {
+        box_name(box, "cold", i);
+        manage_box(REMOVE_MAILBOX, box);
+    }
+    rmdir(work_dir);
+
+    free(latencies);
+    free(publishers);
+    free(readers);
+    free(subscribers);
+    close(epoll_fd);
+    close(register_pipe);
+    return delivered == expected ? EXIT_SUCCESS : EXIT_FAILURE;
+}
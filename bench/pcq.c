@@ -0,0 +1,155 @@
+#include "producer-consumer.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Measures producer-consumer queue throughput (enqueue + dequeue pairs per
+// second) for 1..N producers and 1..N consumers, moving elements one at a time
+// and in batches of 8 and 64 (pcq_enqueue_many/pcq_dequeue_many).
+
+#define DEFAULT_MAX_THREADS 4
+#define DEFAULT_ITEMS 1000000
+#define QUEUE_CAPACITY 64
+#define MAX_BATCH 64
+
+static size_t const batch_sizes[] = {1, 8, 64};
+
+#ifdef PCQ_LOCK_FREE
+#define PCQ_IMPL "lockfree"
+#else
+#define PCQ_IMPL "mutex"
+#endif
+
+// Tells a consumer to stop
+static char stop_marker;
+
+static pc_queue_t queue;
+static size_t items_per_producer;
+static size_t batch_size;
+
+static void *producer(void *arg) {
+    (void)arg;
+    void *batch[MAX_BATCH];
+    for (size_t i = 1; i <= items_per_producer; i += batch_size) {
+        size_t n = 0;
+        while (n < batch_size && i + n <= items_per_producer) {
+            batch[n] = (void *)(uintptr_t)(i + n);
+            n++;
+        }
+
+        if (batch_size == 1) {
+            pcq_enqueue(&queue, batch[0]);
+        } else {
+            pcq_enqueue_many(&queue, batch, n);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    size_t *consumed = (size_t *)arg;
+    void *batch[MAX_BATCH];
+    while (true) {
+        size_t n;
+        if (batch_size == 1) {
+            batch[0] = pcq_dequeue(&queue);
+            n = 1;
+        } else {
+            n = pcq_dequeue_many(&queue, batch, batch_size);
+        }
+
+        size_t markers = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (batch[i] == &stop_marker) {
+                markers++;
+            } else {
+                (*consumed)++;
+            }
+        }
+
+        if (markers > 0) {
+            // Hand back the markers meant for other consumers
+            for (size_t i = 1; i < markers; i++) {
+                pcq_enqueue(&queue, &stop_marker);
+            }
+            return NULL;
+        }
+    }
+}
+
+static double run(int n_producers, int n_consumers, size_t n_items) {
+    pcq_create(&queue, QUEUE_CAPACITY);
+    items_per_producer = n_items / (size_t)n_producers;
+
+    pthread_t producers[n_producers];
+    pthread_t consumers[n_consumers];
+    size_t consumed[n_consumers];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < n_consumers; i++) {
+        consumed[i] = 0;
+        pthread_create(&consumers[i], NULL, consumer, &consumed[i]);
+    }
+    for (int i = 0; i < n_producers; i++) {
+        pthread_create(&producers[i], NULL, producer, NULL);
+    }
+    for (int i = 0; i < n_producers; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    for (int i = 0; i < n_consumers; i++) {
+        pcq_enqueue(&queue, &stop_marker);
+    }
+
+    size_t total = 0;
+    for (int i = 0; i < n_consumers; i++) {
+        pthread_join(consumers[i], NULL);
+        total += consumed[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pcq_destroy(&queue);
+
+    if (total != items_per_producer * (size_t)n_producers) {
+        fprintf(stderr, "lost items: %zu of %zu\n", total,
+                items_per_producer * (size_t)n_producers);
+        exit(EXIT_FAILURE);
+    }
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+                  (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)total / secs;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = DEFAULT_MAX_THREADS;
+    size_t n_items = DEFAULT_ITEMS;
+
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        n_items = strtoul(argv[2], NULL, 10);
+    }
+    if (max_threads < 1) {
+        fprintf(stderr, "usage: pcq [max_threads] [items]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("impl,batch,producers,consumers,ops_per_sec\n");
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+        batch_size = batch_sizes[b];
+        for (int p = 1; p <= max_threads; p *= 2) {
+            for (int c = 1; c <= max_threads; c *= 2) {
+                printf("%s,%zu,%d,%d,%.0f\n", PCQ_IMPL, batch_size, p, c,
+                       run(p, c, n_items));
+            }
+        }
+    }
+
+    return 0;
+}
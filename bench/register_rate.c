@@ -0,0 +1,139 @@
+#define _DEFAULT_SOURCE // usleep
+#include "frame.h"
+#include "pipes.h"
+#include "protocol.h"
+#include "sockets.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures how many requests mbroker takes per second through its register
+// pipe (each client creating, opening and removing a pipe of its own) and
+// through its socket (each client connecting): starts mbroker with both, then
+// has 1 up to the given number of threads send LIST_MAILBOXES requests (to no
+// boxes, so each answer is a single frame) back to back, like managers.
+//
+// usage: register_rate [mbroker binary] [requests per run] [max threads]
+
+#define DEFAULT_REQUESTS 20000
+#define DEFAULT_MAX_THREADS 16
+// Workers started in mbroker
+#define WORKERS "16"
+// Give up waiting for mbroker to start after this
+#define SETUP_TIMEOUT_MS 10000
+
+static char work_dir[] = "/tmp/register_rate.XXXXXX";
+static char register_pipe[PIPE_NAME_SIZE];
+static char register_socket[PIPE_NAME_SIZE];
+static char *register_name;
+static size_t n_requests;
+
+static double seconds_since(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *client(void *arg) {
+    size_t id = (size_t)arg;
+    static _Thread_local frame_reader_t reader;
+
+    packet_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.opcode = LIST_MAILBOXES;
+    snprintf(packet.payload.list_box_data.client_pipe, PIPE_NAME_SIZE,
+             "%s/client%zu", work_dir, id);
+
+    for (size_t i = 0; i < n_requests; i++) {
+        int register_fd;
+        int fd = socket_register_client(
+            register_name, packet.payload.list_box_data.client_pipe, &packet,
+            O_RDONLY, &register_fd);
+
+        frame_reader_init(&reader, fd);
+        packet_t answer;
+        if (frame_read(&reader, &answer) != 1 ||
+            answer.opcode != LIST_MAILBOXES_ANSWER) {
+            fprintf(stderr, "register_rate: no answer from mbroker\n");
+            exit(EXIT_FAILURE);
+        }
+
+        pipe_close(fd);
+        if (register_fd != -1) {
+            pipe_close(register_fd);
+            pipe_destroy(packet.payload.list_box_data.client_pipe);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char *broker = argc > 1 ? argv[1] : "mbroker/mbroker";
+    size_t total = argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_REQUESTS;
+    size_t max_threads =
+        argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_MAX_THREADS;
+
+    if (mkdtemp(work_dir) == NULL) {
+        perror("register_rate: mkdtemp");
+        return EXIT_FAILURE;
+    }
+    snprintf(register_pipe, sizeof(register_pipe), "%s/register", work_dir);
+    snprintf(register_socket, sizeof(register_socket), "%s/register.sock",
+             work_dir);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        execl(broker, broker, register_pipe, WORKERS, "--socket",
+              register_socket, (char *)NULL);
+        _exit(127);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (access(register_pipe, F_OK) == -1) {
+        if (seconds_since(&start) * 1000 > SETUP_TIMEOUT_MS ||
+            waitpid(pid, NULL, WNOHANG) != 0) {
+            fprintf(stderr, "register_rate: mbroker did not start\n");
+            return EXIT_FAILURE;
+        }
+        usleep(1000);
+    }
+
+    printf("transport,threads,requests,requests_per_sec,us_per_request\n");
+    pthread_t *threads = malloc(sizeof(pthread_t) * max_threads);
+    for (size_t n = 1; n <= max_threads; n *= 2) {
+        for (int use_socket = 0; use_socket <= 1; use_socket++) {
+            register_name = use_socket ? register_socket : register_pipe;
+            n_requests = total / n;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (size_t i = 0; i < n; i++) {
+                pthread_create(&threads[i], NULL, client, (void *)i);
+            }
+            for (size_t i = 0; i < n; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            double secs = seconds_since(&start);
+
+            size_t done = n_requests * n;
+            printf("%s,%zu,%zu,%.0f,%.1f\n", use_socket ? "socket" : "fifo", n,
+                   done, (double)done / secs, secs * 1e6 / (double)done);
+        }
+    }
+    free(threads);
+
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    rmdir(work_dir);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+#include "list.h"
+#include "registry.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Measures box lookups per second (what every registration does) in the
+// linked List mbroker used to keep its boxes in and in the box registry, as
+// the number of boxes grows, from 1 and from several threads.
+//
+// usage: registry [lookups per thread] [max threads]
+
+#define DEFAULT_LOOKUPS 200000
+#define DEFAULT_MAX_THREADS 4
+// The list is only measured up to this many boxes (it gets too slow)
+#define MAX_LIST_BOXES 10000
+
+static size_t const box_counts[] = {100, 1000, 10000, 50000};
+
+static List list;
+static box_registry_t registry;
+static bool use_registry;
+static size_t n_boxes;
+static size_t n_lookups;
+
+static void box_name(char *name, size_t id) {
+    snprintf(name, BOX_NAME_SIZE, "box%zu", id);
+}
+
+static void *lookups(void *arg) {
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    char name[BOX_NAME_SIZE];
+    for (size_t i = 0; i < n_lookups; i++) {
+        box_name(name, (size_t)rand_r(&seed) % n_boxes);
+        if (use_registry) {
+            box_node_t *node = registry_acquire(&registry, name);
+            if (node == NULL) {
+                fprintf(stderr, "registry: %s not found\n", name);
+                exit(EXIT_FAILURE);
+            }
+            registry_release(&registry, node);
+        } else if (search_node(&list, name) == NULL) {
+            fprintf(stderr, "registry: %s not found\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return NULL;
+}
+
+static double run(size_t n_threads) {
+    pthread_t threads[n_threads];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, lookups, (void *)(uintptr_t)(i + 1));
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+                  (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)(n_threads * n_lookups) / secs;
+}
+
+int main(int argc, char **argv) {
+    n_lookups = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_LOOKUPS;
+    size_t max_threads =
+        argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_MAX_THREADS;
+
+    printf("structure,boxes,threads,lookups_per_sec\n");
+    for (size_t b = 0; b < sizeof(box_counts) / sizeof(size_t); b++) {
+        n_boxes = box_counts[b];
+
+        tfs_file file;
+        memset(&file, 0, sizeof(file));
+        list_init(&list);
+        if (registry_init(&registry) != 0) {
+            fprintf(stderr, "registry: out of memory\n");
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < n_boxes; i++) {
+            box_name(file.box_name, i);
+            if (n_boxes <= MAX_LIST_BOXES) {
+                list_add(&list, file);
+            }
+            registry_add(&registry, &file);
+        }
+
+        for (int r = 0; r <= 1; r++) {
+            use_registry = r;
+            if (!use_registry && n_boxes > MAX_LIST_BOXES) {
+                continue;
+            }
+            for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+                printf("%s,%zu,%zu,%.0f\n", use_registry ? "registry" : "list",
+                       n_boxes, threads, run(threads));
+            }
+        }
+
+        list_destroy(&list);
+        registry_destroy(&registry);
+    }
+    return EXIT_SUCCESS;
+}
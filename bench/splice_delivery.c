@@ -0,0 +1,162 @@
+#define _GNU_SOURCE // vmsplice
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures what it costs a writer thread to push payloads of a few sizes
+// through a pipe to a reader, by copying them from storage to a buffer and
+// write()ing it ("copy", how a subscriber's messages read from TFS are sent),
+// and by handing the storage pages themselves to the pipe with vmsplice().
+// The storage is page aligned and never changes, as vmsplice requires (the
+// pipe keeps referring to the pages until the reader reads them).
+//
+// usage: splice_delivery [megabytes per run]
+
+#define DEFAULT_MEGABYTES 512
+// Bytes the reader asks for at once
+#define READ_CHUNK (64 * 1024)
+
+static size_t const payload_sizes[] = {1024, 64 * 1024, 1024 * 1024};
+
+static size_t payload_size;
+static size_t n_payloads;
+static bool spliced;
+static int write_fd;
+static char *storage;
+// CPU time used by the writer thread
+static uint64_t writer_cpu_ns;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "splice_delivery: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Writes len bytes to the pipe, copied or spliced.
+ */
+static void send_payload(char const *data, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n;
+        if (spliced) {
+            struct iovec iov = {.iov_base = (void *)(data + done),
+                                .iov_len = len - done};
+            n = vmsplice(write_fd, &iov, 1, 0);
+        } else {
+            n = write(write_fd, data + done, len - done);
+        }
+        if (n < 0 && errno != EINTR) {
+            fail(spliced ? "vmsplice" : "write");
+        }
+        done += n > 0 ? (size_t)n : 0;
+    }
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    char *buffer = spliced ? NULL : malloc(payload_size);
+    if (!spliced && buffer == NULL) {
+        fail("malloc");
+    }
+
+    uint64_t start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    for (size_t i = 0; i < n_payloads; i++) {
+        if (spliced) {
+            send_payload(storage, payload_size);
+        } else {
+            memcpy(buffer, storage, payload_size);
+            send_payload(buffer, payload_size);
+        }
+    }
+    writer_cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start;
+
+    close(write_fd);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Reads until the writer closes the pipe.
+ *
+ * Returns the number of bytes read.
+ */
+static size_t read_all(int fd) {
+    static char buffer[READ_CHUNK];
+    size_t total = 0;
+    while (true) {
+        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+        if (bytes_read == 0) {
+            return total;
+        }
+        if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("read");
+        }
+        total += (size_t)bytes_read;
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t megabytes =
+        argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_MEGABYTES;
+    size_t max_size = payload_sizes[sizeof(payload_sizes) / sizeof(size_t) - 1];
+
+    if (posix_memalign((void **)&storage, (size_t)sysconf(_SC_PAGESIZE),
+                       max_size) != 0) {
+        fprintf(stderr, "splice_delivery: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(storage, 'x', max_size);
+
+    printf("mode,payload_size,megabytes,mb_per_sec,writer_cpu_ns_per_kb\n");
+    for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(size_t); s++) {
+        for (int mode = 0; mode <= 1; mode++) {
+            payload_size = payload_sizes[s];
+            n_payloads = megabytes * 1024 * 1024 / payload_size;
+            spliced = mode;
+
+            int fds[2];
+            if (pipe(fds) == -1) {
+                fail("pipe");
+            }
+            write_fd = fds[1];
+
+            uint64_t start = clock_ns(CLOCK_MONOTONIC);
+            pthread_t thread;
+            pthread_create(&thread, NULL, writer, NULL);
+            size_t total = read_all(fds[0]);
+            pthread_join(thread, NULL);
+            double secs = (double)(clock_ns(CLOCK_MONOTONIC) - start) / 1e9;
+            close(fds[0]);
+
+            if (total != n_payloads * payload_size) {
+                fprintf(stderr, "splice_delivery: read %zu of %zu bytes\n",
+                        total, n_payloads * payload_size);
+                return EXIT_FAILURE;
+            }
+
+            double mb = (double)total / (1024 * 1024);
+            printf("%s,%zu,%.0f,%.0f,%.1f\n", spliced ? "vmsplice" : "copy",
+                   payload_size, mb, mb / secs,
+                   (double)writer_cpu_ns / ((double)total / 1024));
+        }
+    }
+
+    free(storage);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,183 @@
+#include "frame.h"
+#include "protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures how many messages per second a subscriber gets from its pipe to
+// its stdout. Plays the part of mbroker: runs the given sub binary, accepts
+// its registration and floods its pipe with messages of a few sizes, while a
+// thread drains the subscriber's stdout like a downstream tool would.
+//
+// usage: sub_throughput <sub binary> [messages] [sub options...]
+
+#define DEFAULT_MESSAGES 500000
+// Bytes of frames written to the subscriber's pipe at once
+#define WRITE_CHUNK (64 * 1024)
+
+static size_t const message_sizes[] = {10, 100, 1000};
+
+static char work_dir[] = "/tmp/sub_throughput.XXXXXX";
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void fail(char const *what) {
+    fprintf(stderr, "sub_throughput: %s: %s\n", what, strerror(errno));
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Counts the lines the subscriber writes until it exits.
+ */
+static void *drain(void *arg) {
+    int fd = *(int *)arg;
+    size_t *lines = malloc(sizeof(size_t));
+    *lines = 0;
+    char buffer[WRITE_CHUNK];
+    ssize_t bytes_read;
+    while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < bytes_read; i++) {
+            *lines += buffer[i] == '\n';
+        }
+    }
+    return lines;
+}
+
+/**
+ * Runs the subscriber and sends it n_messages messages of message_size bytes
+ * (including the '\0').
+ *
+ * Returns the number of messages per second.
+ */
+static double run(char **sub_argv, size_t run_id, size_t n_messages,
+                  size_t message_size) {
+    char register_pipe[PIPE_NAME_SIZE];
+    char client_pipe[PIPE_NAME_SIZE];
+    snprintf(register_pipe, PIPE_NAME_SIZE, "%s/register%zu", work_dir,
+             run_id);
+    snprintf(client_pipe, PIPE_NAME_SIZE, "%s/sub%zu", work_dir, run_id);
+    if (mkfifo(register_pipe, 0666) == -1) {
+        fail("mkfifo");
+    }
+
+    int out[2];
+    if (pipe(out) == -1) {
+        fail("pipe");
+    }
+    sub_argv[1] = register_pipe;
+    sub_argv[2] = client_pipe;
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        execv(sub_argv[0], sub_argv);
+        _exit(127);
+    }
+    close(out[1]);
+
+    pthread_t drainer;
+    pthread_create(&drainer, NULL, drain, &out[0]);
+
+    // Wait for the registration, like mbroker would
+    int register_fd = open(register_pipe, O_RDONLY);
+    frame_reader_t reader;
+    frame_reader_init(&reader, register_fd);
+    packet_t packet;
+    if (register_fd == -1 || frame_read(&reader, &packet) != 1 ||
+        packet.opcode != REGISTER_SUBSCRIBER) {
+        fail("read registration");
+    }
+    int fd = open(client_pipe, O_WRONLY);
+    if (fd == -1) {
+        fail("open subscriber pipe");
+    }
+
+    // Every message is the same, so frames are encoded once
+    memset(&packet, 0, sizeof(packet));
+    packet.opcode = SEND_MESSAGE;
+    memset(packet.payload.message_data.message, 'x', message_size - 1);
+    char frame[FRAME_MAX_SIZE];
+    size_t frame_size = frame_encode(&packet, frame);
+    size_t per_chunk = WRITE_CHUNK / frame_size;
+    char *chunk = malloc(per_chunk * frame_size);
+    for (size_t i = 0; i < per_chunk; i++) {
+        memcpy(chunk + i * frame_size, frame, frame_size);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t sent = 0; sent < n_messages; sent += per_chunk) {
+        size_t n = n_messages - sent < per_chunk ? n_messages - sent
+                                                 : per_chunk;
+        if (write(fd, chunk, n * frame_size) != (ssize_t)(n * frame_size)) {
+            fail("write subscriber pipe");
+        }
+    }
+    close(fd);
+
+    size_t *lines;
+    pthread_join(drainer, (void **)&lines);
+    double secs = (double)(now_ns() - start) / 1e9;
+    waitpid(pid, NULL, 0);
+
+    // The subscriber's last line is its message count
+    if (*lines != n_messages + 1) {
+        fprintf(stderr, "sub_throughput: got %zu of %zu messages\n",
+                *lines - 1, n_messages);
+        exit(EXIT_FAILURE);
+    }
+
+    free(lines);
+    free(chunk);
+    close(out[0]);
+    close(register_fd);
+    unlink(register_pipe);
+    return (double)n_messages / secs;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: sub_throughput <sub binary> [messages] "
+                        "[sub options...]\n");
+        return EXIT_FAILURE;
+    }
+    size_t n_messages = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                 : DEFAULT_MESSAGES;
+
+    // sub <register pipe> <client pipe> <box> [options...]
+    int n_options = argc > 3 ? argc - 3 : 0;
+    char **sub_argv = calloc((size_t)n_options + 5, sizeof(char *));
+    sub_argv[0] = argv[1];
+    sub_argv[3] = "box";
+    for (int i = 0; i < n_options; i++) {
+        sub_argv[4 + i] = argv[3 + i];
+    }
+
+    if (mkdtemp(work_dir) == NULL) {
+        fail("mkdtemp");
+    }
+
+    printf("message_size,messages,msgs_per_sec,mb_per_sec\n");
+    for (size_t s = 0; s < sizeof(message_sizes) / sizeof(size_t); s++) {
+        double rate = run(sub_argv, s, n_messages, message_sizes[s]);
+        printf("%zu,%zu,%.0f,%.1f\n", message_sizes[s], n_messages, rate,
+               rate * (double)message_sizes[s] / 1e6);
+    }
+
+    rmdir(work_dir);
+    free(sub_argv);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#include "logging.h"
+#include "operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Appends messages to a single box the same way mbroker does for every
+// published message (open in append mode, write, close), reporting the
+// throughput of each interval against the size the box has grown to.
+
+#define DEFAULT_MESSAGES 100000
+#define DEFAULT_MESSAGE_SIZE 64
+#define REPORT_INTERVAL 10000
+
+static double elapsed_seconds(struct timespec const *start,
+                              struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    size_t n_messages = DEFAULT_MESSAGES;
+    size_t message_size = DEFAULT_MESSAGE_SIZE;
+
+    if (argc > 1) {
+        n_messages = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        message_size = strtoul(argv[2], NULL, 10);
+    }
+    if (message_size < 2) {
+        fprintf(stderr, "usage: tfs_append [messages] [message_size >= 2]\n");
+        return EXIT_FAILURE;
+    }
+
+    set_log_level(LOG_QUIET);
+
+    // Enough blocks for every message, plus the index blocks
+    tfs_params params = tfs_default_params();
+    params.max_block_count =
+        (n_messages * message_size) / params.block_size * 2 + 64;
+    if (tfs_init(&params) != 0) {
+        fprintf(stderr, "failed to init tfs\n");
+        return EXIT_FAILURE;
+    }
+
+    int box = tfs_open("/box", TFS_O_CREAT);
+    if (box == -1 || tfs_close(box) == -1) {
+        fprintf(stderr, "failed to create box\n");
+        return EXIT_FAILURE;
+    }
+
+    // Messages are stored with their terminating '\0', like in mbroker
+    char *message = malloc(message_size);
+    memset(message, 'm', message_size - 1);
+    message[message_size - 1] = '\0';
+
+    printf("messages,box_size,interval_msgs_per_sec,interval_mib_per_sec\n");
+
+    struct timespec start, interval_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    interval_start = start;
+
+    size_t box_size = 0;
+    for (size_t i = 1; i <= n_messages; i++) {
+        box = tfs_open("/box", TFS_O_APPEND);
+        if (box == -1) {
+            fprintf(stderr, "failed to open box\n");
+            return EXIT_FAILURE;
+        }
+
+        ssize_t written = tfs_write(box, message, message_size);
+        if (written != (ssize_t)message_size) {
+            fprintf(stderr, "short write after %zu messages (%zu bytes)\n",
+                    i - 1, box_size);
+            return EXIT_FAILURE;
+        }
+        box_size += message_size;
+
+        if (tfs_close(box) == -1) {
+            fprintf(stderr, "failed to close box\n");
+            return EXIT_FAILURE;
+        }
+
+        if (i % REPORT_INTERVAL == 0 || i == n_messages) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double secs = elapsed_seconds(&interval_start, &now);
+            size_t msgs = i % REPORT_INTERVAL == 0 ? REPORT_INTERVAL
+                                                   : i % REPORT_INTERVAL;
+            printf("%zu,%zu,%.0f,%.2f\n", i, box_size, (double)msgs / secs,
+                   (double)(msgs * message_size) / secs / (1024 * 1024));
+            interval_start = now;
+        }
+    }
+
+    double total = elapsed_seconds(&start, &now);
+    fprintf(stderr, "%zu messages (%zu bytes) in %.3fs: %.0f msgs/s\n",
+            n_messages, box_size, total, (double)n_messages / total);
+
+    free(message);
+    tfs_destroy();
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "logging.h"
+#include "operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Measures tfs_open/tfs_close latency of existing files (a root directory
+// lookup each) as the number of entries in the root directory grows.
+
+#define DEFAULT_LOOKUPS 20000
+
+static size_t const entry_counts[] = {10, 1000, 10000};
+
+static double elapsed_ns(struct timespec const *start,
+                         struct timespec const *end) {
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 +
+           (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static void run(size_t n_entries, size_t n_lookups) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = n_entries + 1;
+    params.max_block_count = n_entries + 64;
+    if (tfs_init(&params) != 0) {
+        fprintf(stderr, "failed to init tfs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char name[32];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_entries; i++) {
+        snprintf(name, sizeof(name), "/box%zu", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        if (f == -1 || tfs_close(f) == -1) {
+            fprintf(stderr, "failed to create %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double create_ns = elapsed_ns(&start, &end) / (double)n_entries;
+
+    // Pseudo-random order, so lookups don't favour any part of the directory
+    unsigned int seed = 42;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_lookups; i++) {
+        snprintf(name, sizeof(name), "/box%d",
+                 rand_r(&seed) % (int)n_entries);
+        int f = tfs_open(name, 0);
+        if (f == -1 || tfs_close(f) == -1) {
+            fprintf(stderr, "failed to open %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double open_ns = elapsed_ns(&start, &end) / (double)n_lookups;
+
+    // Lookups of names that are not in the directory
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n_lookups; i++) {
+        snprintf(name, sizeof(name), "/missing%zu", i);
+        if (tfs_open(name, 0) != -1) {
+            fprintf(stderr, "unexpectedly opened %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double miss_ns = elapsed_ns(&start, &end) / (double)n_lookups;
+
+    printf("%zu,%.0f,%.0f,%.0f\n", n_entries, create_ns, open_ns, miss_ns);
+
+    tfs_destroy();
+}
+
+int main(int argc, char **argv) {
+    size_t n_lookups = DEFAULT_LOOKUPS;
+    if (argc > 1) {
+        n_lookups = strtoul(argv[1], NULL, 10);
+    }
+
+    set_log_level(LOG_QUIET);
+
+    printf("entries,create_ns,open_close_ns,missing_lookup_ns\n");
+    for (size_t i = 0; i < sizeof(entry_counts) / sizeof(entry_counts[0]);
+         i++) {
+        run(entry_counts[i], n_lookups);
+    }
+
+    return 0;
+}
@@ -0,0 +1,520 @@
+#include "histogram.h"
+#include "operations.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Microbenchmark of the TFS API: runs access patterns from 1 up to N threads,
+// under each of the given storage latency models, and reports the throughput
+// and latency percentiles of every operation involved. Comparing the "off"
+// model with the others separates the simulated storage cost from the real CPU
+// and locking cost.
+//
+// Patterns:
+//   - append: each thread opens its own file in append mode, writes a record
+//     and closes it (what mbroker does for every round of messages)
+//   - read: every thread reads a shared, prefilled file record by record,
+//     reopening it at the end (what subscribers catching up do)
+//   - churn: each thread creates a file, writes a record to it, closes and
+//     unlinks it (box creation and removal)
+//
+// Latency models (see tfs_latency_model_t), as a comma separated list:
+//   - off, spin (the default DELAY busy loop), sleep (--latency-ns per
+//     access) and table (--table ns per inode, bitmap, directory and block
+//     access)
+//
+// The TFS parameters are sized for the run unless given. With --image, every
+// run keeps the FS in a new image file at that path (removed afterwards),
+// synced as --sync says: never (none, the default), on every close, through
+// the journal, or every given number of milliseconds. E.g. the append
+// throughput of the journal's group commit with 1 up to 64 threads:
+//   tfs_ops --pattern append --latency off --threads 64 --image img
+//           --sync journal
+//
+// usage: tfs_ops [--pattern append|read|churn|all] [--latency <models>]
+//                [--latency-ns N] [--table <inode>,<bitmap>,<dir>,<block>]
+//                [--threads <max threads>] [--ops <per thread>]
+//                [--size <record bytes>] [--inodes N] [--blocks N]
+//                [--open-files N] [--block-size N] [--image <path>]
+//                [--sync none|close|journal|<ms>]
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_OPS 2000
+#define DEFAULT_SIZE 64
+// Records in the file shared by the read pattern
+#define READ_FILE_RECORDS 4096
+// Simulated latencies, in nanoseconds, of the sleep and table models
+#define DEFAULT_LATENCY_NS 10000
+#define DEFAULT_TABLE "2000,1000,2000,10000"
+
+typedef enum { OP_OPEN, OP_WRITE, OP_READ, OP_CLOSE, OP_UNLINK, OP_COUNT } op_t;
+
+static char const *const op_names[OP_COUNT] = {
+    [OP_OPEN] = "open",   [OP_WRITE] = "write",   [OP_READ] = "read",
+    [OP_CLOSE] = "close", [OP_UNLINK] = "unlink",
+};
+
+typedef enum {
+    PATTERN_APPEND,
+    PATTERN_READ,
+    PATTERN_CHURN,
+    PATTERN_COUNT,
+} pattern_t;
+
+static char const *const pattern_names[PATTERN_COUNT] = {
+    [PATTERN_APPEND] = "append",
+    [PATTERN_READ] = "read",
+    [PATTERN_CHURN] = "churn",
+};
+
+#define LATENCY_MODELS (TFS_LATENCY_TABLE + 1)
+
+static char const *const model_names[LATENCY_MODELS] = {
+    [TFS_LATENCY_SPIN] = "spin",
+    [TFS_LATENCY_OFF] = "off",
+    [TFS_LATENCY_SLEEP] = "sleep",
+    [TFS_LATENCY_TABLE] = "table",
+};
+
+typedef struct {
+    size_t id;
+    pattern_t pattern;
+    histogram_t latencies[OP_COUNT];
+} worker_t;
+
+static size_t n_ops = DEFAULT_OPS;
+static size_t record_size = DEFAULT_SIZE;
+// TFS parameters given on the command line (0: sized for the run)
+static tfs_params given;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: tfs_ops [--pattern append|read|churn|all] "
+                    "[--latency <off,spin,sleep,table>] [--latency-ns N] "
+                    "[--table <inode>,<bitmap>,<dir>,<block>] "
+                    "[--threads <max threads>] "
+                    "[--ops <per thread>] [--size <record bytes>] "
+                    "[--inodes N] [--blocks N] [--open-files N] "
+                    "[--block-size N] [--image <path>] "
+                    "[--sync none|close|journal|<ms>]\n");
+    exit(EXIT_FAILURE);
+}
+
+static void fail(worker_t const *worker, char const *what) {
+    fprintf(stderr, "tfs_ops: thread %zu: %s failed (parameters too small?)\n",
+            worker->id, what);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Counts the latency of an operation that started at start.
+ */
+static void done(worker_t *worker, op_t op, uint64_t start) {
+    histogram_record(&worker->latencies[op], now_ns() - start);
+}
+
+/**
+ * Opens, writes a record to and closes a file, timing each operation.
+ */
+static void write_record(worker_t *worker, char const *name,
+                         tfs_file_mode_t mode, char const *record) {
+    uint64_t start = now_ns();
+    int f = tfs_open(name, mode);
+    done(worker, OP_OPEN, start);
+    if (f == -1) {
+        fail(worker, "open");
+    }
+
+    start = now_ns();
+    ssize_t written = tfs_write(f, record, record_size);
+    done(worker, OP_WRITE, start);
+    if (written != (ssize_t)record_size) {
+        fail(worker, "write");
+    }
+
+    start = now_ns();
+    int ret = tfs_close(f);
+    done(worker, OP_CLOSE, start);
+    if (ret == -1) {
+        fail(worker, "close");
+    }
+}
+
+static void append(worker_t *worker, char const *record) {
+    char name[32];
+    snprintf(name, sizeof(name), "/append%zu", worker->id);
+    for (size_t i = 0; i < n_ops; i++) {
+        write_record(worker, name, TFS_O_APPEND, record);
+    }
+}
+
+static void read_shared(worker_t *worker) {
+    char *buffer = malloc(record_size);
+    int f = -1;
+    for (size_t i = 0; i < n_ops; i++) {
+        uint64_t start = now_ns();
+        if (f == -1) {
+            f = tfs_open("/shared", 0);
+            done(worker, OP_OPEN, start);
+            if (f == -1) {
+                fail(worker, "open");
+            }
+            start = now_ns();
+        }
+
+        ssize_t bytes_read = tfs_read(f, buffer, record_size);
+        done(worker, OP_READ, start);
+        if (bytes_read == -1) {
+            fail(worker, "read");
+        }
+
+        if ((size_t)bytes_read < record_size) {
+            start = now_ns();
+            int ret = tfs_close(f);
+            done(worker, OP_CLOSE, start);
+            if (ret == -1) {
+                fail(worker, "close");
+            }
+            f = -1;
+        }
+    }
+    if (f != -1) {
+        tfs_close(f);
+    }
+    free(buffer);
+}
+
+static void churn(worker_t *worker, char const *record) {
+    char name[32];
+    for (size_t i = 0; i < n_ops; i++) {
+        snprintf(name, sizeof(name), "/churn%zu_%zu", worker->id, i);
+        write_record(worker, name, TFS_O_CREAT, record);
+
+        uint64_t start = now_ns();
+        int ret = tfs_unlink(name);
+        done(worker, OP_UNLINK, start);
+        if (ret == -1) {
+            fail(worker, "unlink");
+        }
+    }
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    char *record = malloc(record_size);
+    memset(record, 'r', record_size);
+
+    switch (worker->pattern) {
+    case PATTERN_APPEND:
+        append(worker, record);
+        break;
+    case PATTERN_READ:
+        read_shared(worker);
+        break;
+    case PATTERN_CHURN:
+        churn(worker, record);
+        break;
+    case PATTERN_COUNT:
+    default:
+        break;
+    }
+
+    free(record);
+    return NULL;
+}
+
+/**
+ * Returns the TFS parameters for a run: the given ones, or enough for it.
+ */
+static tfs_params run_params(pattern_t pattern, size_t n_threads,
+                             tfs_latency_model_t model) {
+    tfs_params params = tfs_default_params();
+    if (given.block_size != 0) {
+        params.block_size = given.block_size;
+    }
+
+    size_t blocks = 64;
+    if (pattern == PATTERN_APPEND) {
+        // Each file may also need an indirect and a double indirect block,
+        // plus the blocks of indices they reference
+        size_t per_file = n_ops * record_size / params.block_size + 1;
+        blocks += n_threads * (per_file + per_file / 16 + 4);
+    } else if (pattern == PATTERN_READ) {
+        size_t per_file =
+            READ_FILE_RECORDS * record_size / params.block_size + 1;
+        blocks += per_file + per_file / 16 + 4;
+    } else {
+        blocks += n_threads * 2;
+    }
+
+    params.max_inode_count = given.max_inode_count != 0
+                                 ? given.max_inode_count
+                                 : 2 * n_threads + 8;
+    params.max_block_count =
+        given.max_block_count != 0 ? given.max_block_count : blocks;
+    params.max_open_files_count = given.max_open_files_count != 0
+                                      ? given.max_open_files_count
+                                      : n_threads + 1;
+    params.latency_model = model;
+    params.latency_ns = given.latency_ns;
+    memcpy(params.access_latency_ns, given.access_latency_ns,
+           sizeof(params.access_latency_ns));
+    params.image_path = given.image_path;
+    params.sync_policy = given.sync_policy;
+    params.sync_interval_ms = given.sync_interval_ms;
+    return params;
+}
+
+/**
+ * Removes an image (if any) and its journal.
+ */
+static void remove_image(char const *path) {
+    if (path != NULL) {
+        char journal[PATH_MAX];
+        snprintf(journal, sizeof(journal), "%s.journal", path);
+        unlink(path);
+        unlink(journal);
+    }
+}
+
+static void run(pattern_t pattern, size_t n_threads,
+                tfs_latency_model_t model) {
+    tfs_params params = run_params(pattern, n_threads, model);
+    remove_image(params.image_path); // every run starts from an empty FS
+    if (tfs_init(&params) != 0) {
+        fprintf(stderr, "tfs_ops: failed to init tfs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Files every thread needs before starting
+    char *record = malloc(record_size);
+    memset(record, 'r', record_size);
+    if (pattern == PATTERN_APPEND) {
+        for (size_t i = 0; i < n_threads; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "/append%zu", i);
+            tfs_close(tfs_open(name, TFS_O_CREAT));
+        }
+    } else if (pattern == PATTERN_READ) {
+        int f = tfs_open("/shared", TFS_O_CREAT);
+        for (size_t i = 0; i < READ_FILE_RECORDS; i++) {
+            if (tfs_write(f, record, record_size) != (ssize_t)record_size) {
+                fprintf(stderr, "tfs_ops: failed to fill the shared file\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        tfs_close(f);
+    }
+    free(record);
+
+    worker_t *workers = malloc(sizeof(worker_t) * n_threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * n_threads);
+    for (size_t i = 0; i < n_threads; i++) {
+        workers[i].id = i;
+        workers[i].pattern = pattern;
+        for (size_t op = 0; op < OP_COUNT; op++) {
+            histogram_init(&workers[i].latencies[op]);
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    // A row per operation the pattern used, and one for all of them
+    static histogram_t totals[OP_COUNT + 1];
+    for (size_t op = 0; op <= OP_COUNT; op++) {
+        histogram_init(&totals[op]);
+    }
+    for (size_t i = 0; i < n_threads; i++) {
+        for (size_t op = 0; op < OP_COUNT; op++) {
+            histogram_merge(&totals[op], &workers[i].latencies[op]);
+            histogram_merge(&totals[OP_COUNT], &workers[i].latencies[op]);
+        }
+    }
+    for (size_t op = 0; op <= OP_COUNT; op++) {
+        histogram_t const *h = &totals[op];
+        if (h->count == 0) {
+            continue;
+        }
+        printf("%s,%s,%zu,%s,%" PRIu64 ",%.0f,%" PRIu64 ",%" PRIu64
+               ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               pattern_names[pattern], model_names[model], n_threads,
+               op < OP_COUNT ? op_names[op] : "all", h->count,
+               (double)h->count / secs, histogram_mean(h),
+               histogram_quantile(h, 0.5), histogram_quantile(h, 0.99),
+               histogram_quantile(h, 0.999), h->max);
+    }
+
+    free(threads);
+    free(workers);
+    tfs_destroy();
+    remove_image(params.image_path);
+}
+
+static size_t parse_size(char const *value) {
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        usage();
+    }
+    return parsed;
+}
+
+/**
+ * Parses a comma separated list of latency models into a bit mask.
+ */
+static int parse_models(char const *value) {
+    int models = 0;
+    char const *start = value;
+    while (true) {
+        size_t len = strcspn(start, ",");
+        bool found = false;
+        for (int m = 0; m < LATENCY_MODELS; m++) {
+            if (strlen(model_names[m]) == len &&
+                strncmp(start, model_names[m], len) == 0) {
+                models |= 1 << m;
+                found = true;
+            }
+        }
+        if (!found) {
+            usage();
+        }
+        if (start[len] == '\0') {
+            return models;
+        }
+        start += len + 1;
+    }
+}
+
+/**
+ * Parses the latencies of each kind of access, in tfs_access_t order.
+ */
+static void parse_table(char const *value) {
+    char const *start = value;
+    for (int a = 0; a < TFS_ACCESS_COUNT; a++) {
+        char *end;
+        given.access_latency_ns[a] = strtoul(start, &end, 10);
+        if (end == start ||
+            *end != (a == TFS_ACCESS_COUNT - 1 ? '\0' : ',')) {
+            usage();
+        }
+        start = end + 1;
+    }
+}
+
+/**
+ * Parses the image sync policy: none, close, journal, or a period in
+ * milliseconds.
+ */
+static void parse_sync(char const *value) {
+    if (strcmp(value, "none") == 0) {
+        given.sync_policy = TFS_SYNC_NONE;
+    } else if (strcmp(value, "close") == 0) {
+        given.sync_policy = TFS_SYNC_ON_CLOSE;
+    } else if (strcmp(value, "journal") == 0) {
+        given.sync_policy = TFS_SYNC_JOURNAL;
+    } else {
+        given.sync_policy = TFS_SYNC_PERIODIC;
+        given.sync_interval_ms = parse_size(value);
+    }
+}
+
+int main(int argc, char **argv) {
+    int patterns = (1 << PATTERN_COUNT) - 1;
+    int models = (1 << TFS_LATENCY_OFF) | (1 << TFS_LATENCY_SPIN);
+    size_t max_threads = DEFAULT_THREADS;
+    given.latency_ns = DEFAULT_LATENCY_NS;
+    parse_table(DEFAULT_TABLE);
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            usage();
+        }
+        char const *name = argv[i];
+        char const *value = argv[i + 1];
+        if (strcmp(name, "--pattern") == 0) {
+            patterns = 0;
+            for (int p = 0; p < PATTERN_COUNT; p++) {
+                if (strcmp(value, pattern_names[p]) == 0 ||
+                    strcmp(value, "all") == 0) {
+                    patterns |= 1 << p;
+                }
+            }
+            if (patterns == 0) {
+                usage();
+            }
+        } else if (strcmp(name, "--latency") == 0) {
+            models = parse_models(value);
+        } else if (strcmp(name, "--latency-ns") == 0) {
+            given.latency_ns = parse_size(value);
+        } else if (strcmp(name, "--table") == 0) {
+            parse_table(value);
+        } else if (strcmp(name, "--threads") == 0) {
+            max_threads = parse_size(value);
+        } else if (strcmp(name, "--ops") == 0) {
+            n_ops = parse_size(value);
+        } else if (strcmp(name, "--size") == 0) {
+            record_size = parse_size(value);
+        } else if (strcmp(name, "--inodes") == 0) {
+            given.max_inode_count = parse_size(value);
+        } else if (strcmp(name, "--blocks") == 0) {
+            given.max_block_count = parse_size(value);
+        } else if (strcmp(name, "--open-files") == 0) {
+            given.max_open_files_count = parse_size(value);
+        } else if (strcmp(name, "--block-size") == 0) {
+            given.block_size = parse_size(value);
+        } else if (strcmp(name, "--image") == 0) {
+            given.image_path = value;
+        } else if (strcmp(name, "--sync") == 0) {
+            parse_sync(value);
+        } else {
+            usage();
+        }
+    }
+    if (max_threads == 0 || record_size == 0) {
+        usage();
+    }
+
+    // The cheapest models first
+    static tfs_latency_model_t const order[LATENCY_MODELS] = {
+        TFS_LATENCY_OFF,
+        TFS_LATENCY_SPIN,
+        TFS_LATENCY_SLEEP,
+        TFS_LATENCY_TABLE,
+    };
+
+    printf("pattern,latency,threads,op,count,ops_per_sec,mean_ns,p50_ns,"
+           "p99_ns,p999_ns,max_ns\n");
+    for (int p = 0; p < PATTERN_COUNT; p++) {
+        if (!(patterns & (1 << p))) {
+            continue;
+        }
+        for (int m = 0; m < LATENCY_MODELS; m++) {
+            if (!(models & (1 << order[m]))) {
+                continue;
+            }
+            for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+                run((pattern_t)p, threads, order[m]);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,120 @@
+#include "logging.h"
+#include "operations.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Runs 1..N worker threads, each appending to (and reading back from) its own
+// box, to show how TFS throughput scales when operations touch independent
+// files.
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_MESSAGES 5000
+#define MESSAGE_SIZE 64
+
+typedef struct {
+    int id;
+    size_t n_messages;
+} worker_args_t;
+
+static void *worker(void *arg) {
+    worker_args_t const *args = (worker_args_t const *)arg;
+
+    char box_name[32];
+    snprintf(box_name, sizeof(box_name), "/box%d", args->id);
+
+    char message[MESSAGE_SIZE];
+    memset(message, 'm', MESSAGE_SIZE - 1);
+    message[MESSAGE_SIZE - 1] = '\0';
+
+    // Publisher-like appends
+    for (size_t i = 0; i < args->n_messages; i++) {
+        int box = tfs_open(box_name, TFS_O_APPEND);
+        if (box == -1 || tfs_write(box, message, MESSAGE_SIZE) == -1 ||
+            tfs_close(box) == -1) {
+            fprintf(stderr, "worker %d: append failed\n", args->id);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Subscriber-like read of the whole box
+    int box = tfs_open(box_name, 0);
+    char buffer[MESSAGE_SIZE];
+    while (tfs_read(box, buffer, MESSAGE_SIZE) > 0) {
+    }
+    tfs_close(box);
+
+    return NULL;
+}
+
+static double run(int n_threads, size_t n_messages) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = (size_t)n_threads + 1;
+    params.max_open_files_count = (size_t)n_threads;
+    params.max_block_count =
+        (size_t)n_threads * (n_messages * MESSAGE_SIZE / params.block_size + 8);
+    if (tfs_init(&params) != 0) {
+        fprintf(stderr, "failed to init tfs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * (size_t)n_threads);
+    worker_args_t *args = malloc(sizeof(worker_args_t) * (size_t)n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        char box_name[32];
+        snprintf(box_name, sizeof(box_name), "/box%d", i);
+        tfs_close(tfs_open(box_name, TFS_O_CREAT));
+        args[i].id = i;
+        args[i].n_messages = n_messages;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n_threads; i++) {
+        pthread_create(&threads[i], NULL, worker, &args[i]);
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    free(threads);
+    free(args);
+    tfs_destroy();
+
+    return (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = DEFAULT_THREADS;
+    size_t n_messages = DEFAULT_MESSAGES;
+
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        n_messages = strtoul(argv[2], NULL, 10);
+    }
+    if (max_threads < 1) {
+        fprintf(stderr, "usage: tfs_parallel [max_threads] [messages]\n");
+        return EXIT_FAILURE;
+    }
+
+    set_log_level(LOG_QUIET);
+
+    printf("threads,seconds,appends_per_sec,speedup\n");
+    double base = 0;
+    for (int n = 1; n <= max_threads; n *= 2) {
+        double secs = run(n, n_messages);
+        double rate = (double)n * (double)n_messages / secs;
+        if (n == 1) {
+            base = rate;
+        }
+        printf("%d,%.3f,%.0f,%.2f\n", n, secs, rate, rate / base);
+    }
+
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "../mbroker/restore.h"
+#include "operations.h"
+#include "registry.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Measures how long a restarted mbroker takes to serve the boxes kept in a
+// TFS image: fills an image with the given number of boxes (each holding a few
+// messages), then mounts it again and restores the boxes into a registry, with
+// 1 up to the given number of threads, under the given storage latency model.
+//
+// usage: warm_restart [boxes] [messages per box] [max threads] [spin|off]
+
+#define DEFAULT_BOXES 100000
+#define DEFAULT_MESSAGES 4
+#define DEFAULT_MAX_THREADS 4
+#define IMAGE_PATH "warm_restart.img"
+
+static double seconds_since(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static tfs_params image_params(size_t n_boxes, size_t n_messages,
+                               tfs_latency_model_t model) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = n_boxes + 16;
+    // Each box's messages, plus the root directory and its index blocks
+    size_t per_box = n_messages * 32 / params.block_size + 1;
+    params.max_block_count = n_boxes * per_box + n_boxes / 8 + 1024;
+    params.max_open_files_count = 256;
+    params.latency_model = model;
+    params.image_path = IMAGE_PATH;
+    return params;
+}
+
+static void fill(tfs_params const *params, size_t n_boxes,
+                 size_t n_messages) {
+    unlink(IMAGE_PATH);
+    if (tfs_init(params) != 0) {
+        fprintf(stderr, "warm_restart: failed to create the image\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char name[BOX_NAME_SIZE + 2];
+    char message[32];
+    for (size_t b = 0; b < n_boxes; b++) {
+        snprintf(name, sizeof(name), "/box%zu", b);
+        int box = tfs_open(name, TFS_O_CREAT);
+        for (size_t m = 0; m < n_messages; m++) {
+            int len = snprintf(message, sizeof(message), "message %zu", m);
+            if (box == -1 ||
+                tfs_write(box, message, (size_t)len + 1) != len + 1) {
+                fprintf(stderr, "warm_restart: failed to fill %s\n", name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        tfs_close(box);
+    }
+    tfs_destroy();
+}
+
+int main(int argc, char **argv) {
+    size_t n_boxes = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_BOXES;
+    size_t n_messages =
+        argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_MESSAGES;
+    size_t max_threads =
+        argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_MAX_THREADS;
+    tfs_latency_model_t model = TFS_LATENCY_SPIN;
+    if (argc > 4 && strcmp(argv[4], "off") == 0) {
+        model = TFS_LATENCY_OFF;
+    } else if (argc > 4 && strcmp(argv[4], "spin") != 0) {
+        fprintf(stderr, "usage: warm_restart [boxes] [messages per box] "
+                        "[max threads] [spin|off]\n");
+        return EXIT_FAILURE;
+    }
+
+    tfs_params params = image_params(n_boxes, n_messages, model);
+    fill(&params, n_boxes, n_messages);
+
+    printf("boxes,messages,latency,threads,mount_ms,restore_ms\n");
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (tfs_init(&params) != 0) {
+            fprintf(stderr, "warm_restart: failed to mount the image\n");
+            return EXIT_FAILURE;
+        }
+        double mount = seconds_since(&start);
+
+        box_registry_t registry;
+        registry_init(&registry);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ssize_t restored = restore_boxes(&registry, threads);
+        double restore = seconds_since(&start);
+        if (restored != (ssize_t)n_boxes) {
+            fprintf(stderr, "warm_restart: restored %zd of %zu boxes\n",
+                    restored, n_boxes);
+            return EXIT_FAILURE;
+        }
+
+        printf("%zu,%zu,%s,%zu,%.1f,%.1f\n", n_boxes, n_messages,
+               model == TFS_LATENCY_OFF ? "off" : "spin", threads,
+               mount * 1e3, restore * 1e3);
+        registry_destroy(&registry);
+        tfs_destroy();
+    }
+
+    unlink(IMAGE_PATH);
+    return 0;
+}
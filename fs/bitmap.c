@@ -0,0 +1,148 @@
+#include "bitmap.h"
+#include "betterassert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS (64)
+
+/**
+ * Number of words holding a bitmap of n_bits slots.
+ */
+size_t bitmap_words(size_t n_bits) {
+    return (n_bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+/**
+ * Mark every slot free, except those past n_bits in the last word, which are
+ * marked as taken so a search never has to check the bound.
+ */
+static void bitmap_clear(bitmap_t *bitmap) {
+    memset(bitmap->words, 0, bitmap->n_words * sizeof(uint64_t));
+    if (bitmap->n_bits % WORD_BITS != 0) {
+        bitmap->words[bitmap->n_words - 1] = ~0ULL
+                                             << (bitmap->n_bits % WORD_BITS);
+    }
+}
+
+/**
+ * Initialize a bitmap with every slot free.
+ *
+ * Input:
+ *   - bitmap: the bitmap to initialize
+ *   - n_bits: number of slots
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure when allocating the words.
+ */
+int bitmap_init(bitmap_t *bitmap, size_t n_bits) {
+    bitmap->n_bits = n_bits;
+    bitmap->n_words = bitmap_words(n_bits);
+    bitmap->hint = 0;
+    bitmap->external = false;
+    bitmap->words = malloc(bitmap->n_words * sizeof(uint64_t));
+    if (bitmap->words == NULL && bitmap->n_words > 0) {
+        return -1;
+    }
+
+    bitmap_clear(bitmap);
+    return 0;
+}
+
+/**
+ * Initialize a bitmap over words owned by the caller (bitmap_words(n_bits) of
+ * them), which bitmap_destroy leaves alone.
+ *
+ * Input:
+ *   - bitmap: the bitmap to initialize
+ *   - n_bits: number of slots
+ *   - words: the words
+ *   - clear: whether to mark every slot free, rather than keep the state
+ *     already in the words
+ */
+void bitmap_attach(bitmap_t *bitmap, size_t n_bits, uint64_t *words,
+                   bool clear) {
+    bitmap->n_bits = n_bits;
+    bitmap->n_words = bitmap_words(n_bits);
+    bitmap->hint = 0;
+    bitmap->external = true;
+    bitmap->words = words;
+
+    if (clear) {
+        bitmap_clear(bitmap);
+    }
+}
+
+/**
+ * Release the words of a bitmap (unless they were attached).
+ */
+void bitmap_destroy(bitmap_t *bitmap) {
+    if (!bitmap->external) {
+        free(bitmap->words);
+    }
+    bitmap->words = NULL;
+    bitmap->n_bits = 0;
+    bitmap->n_words = 0;
+    bitmap->hint = 0;
+    bitmap->external = false;
+}
+
+/**
+ * Take the lowest free slot of a bitmap.
+ *
+ * Returns the index of the slot, or -1 if every slot is taken.
+ */
+ssize_t bitmap_alloc(bitmap_t *bitmap) {
+    for (size_t w = bitmap->hint; w < bitmap->n_words; w++) {
+        uint64_t word = bitmap->words[w];
+        if (word == ~0ULL) {
+            continue; // full word
+        }
+
+        int bit = __builtin_ctzll(~word);
+        bitmap->words[w] = word | (1ULL << bit);
+        bitmap->hint = w;
+
+        return (ssize_t)(w * WORD_BITS + (size_t)bit);
+    }
+
+    bitmap->hint = bitmap->n_words;
+    return -1;
+}
+
+/**
+ * Release a slot of a bitmap.
+ *
+ * Input:
+ *   - bitmap: the bitmap
+ *   - bit: index of a taken slot
+ */
+void bitmap_free(bitmap_t *bitmap, size_t bit) {
+    ALWAYS_ASSERT(bit < bitmap->n_bits, "bitmap_free: invalid slot");
+
+    size_t w = bit / WORD_BITS;
+    bitmap->words[w] &= ~(1ULL << (bit % WORD_BITS));
+    if (w < bitmap->hint) {
+        bitmap->hint = w;
+    }
+}
+
+/**
+ * Check whether a slot of a bitmap is taken.
+ */
+bool bitmap_test(bitmap_t const *bitmap, size_t bit) {
+    ALWAYS_ASSERT(bit < bitmap->n_bits, "bitmap_test: invalid slot");
+
+    return (bitmap->words[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+/**
+ * Obtain the word holding a slot of a bitmap (e.g. to log a change to it).
+ */
+uint64_t const *bitmap_word(bitmap_t const *bitmap, size_t bit) {
+    ALWAYS_ASSERT(bit < bitmap->n_bits, "bitmap_word: invalid slot");
+
+    return &bitmap->words[bit / WORD_BITS];
+}
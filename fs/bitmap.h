@@ -0,0 +1,33 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Allocation bitmap (one bit per slot, set when the slot is taken).
+ *
+ * Every word before `hint` is known to be full, so allocations start their
+ * search there instead of at the beginning of the map.
+ */
+typedef struct {
+    uint64_t *words;
+    size_t n_bits;
+    size_t n_words;
+    size_t hint;
+    bool external; // words owned by the caller (e.g. mapped from a file)
+} bitmap_t;
+
+size_t bitmap_words(size_t n_bits);
+int bitmap_init(bitmap_t *bitmap, size_t n_bits);
+void bitmap_attach(bitmap_t *bitmap, size_t n_bits, uint64_t *words,
+                   bool clear);
+void bitmap_destroy(bitmap_t *bitmap);
+
+ssize_t bitmap_alloc(bitmap_t *bitmap);
+void bitmap_free(bitmap_t *bitmap, size_t bit);
+bool bitmap_test(bitmap_t const *bitmap, size_t bit);
+uint64_t const *bitmap_word(bitmap_t const *bitmap, size_t bit);
+
+#endif // BITMAP_H
@@ -8,4 +8,11 @@
 
 #define DELAY (5000)
 
+// Number of data blocks referenced directly from an inode; larger files go
+// through the single and double indirect blocks
+#define INODE_DIRECT_BLOCKS (10)
+
+// Size past which the journal is emptied into the image (see journal.h)
+#define JOURNAL_CHECKPOINT_SIZE (64 * 1024 * 1024)
+
 #endif // CONFIG_H
@@ -0,0 +1,220 @@
+#include "dir_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY (16)
+
+/**
+ * FNV-1a hash of a file name.
+ */
+static size_t hash_name(char const *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+/**
+ * Find the bucket holding a name, or the empty bucket where it would be
+ * inserted (linear probing; the table is never more than half full, so there
+ * always is one).
+ */
+static dir_index_entry_t *find_bucket(dir_index_entry_t *buckets,
+                                      size_t capacity, char const *name) {
+    size_t mask = capacity - 1;
+    for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask) {
+        if (buckets[i].slot == -1 ||
+            strncmp(buckets[i].name, name, MAX_FILE_NAME) == 0) {
+            return &buckets[i];
+        }
+    }
+}
+
+static dir_index_entry_t *alloc_buckets(size_t capacity) {
+    dir_index_entry_t *buckets = malloc(capacity * sizeof(dir_index_entry_t));
+    if (buckets == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < capacity; i++) {
+        buckets[i].slot = -1;
+    }
+    return buckets;
+}
+
+/**
+ * Double the number of buckets, rehashing every entry.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int grow(dir_index_t *index) {
+    size_t capacity = index->capacity * 2;
+    dir_index_entry_t *buckets = alloc_buckets(capacity);
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->buckets[i].slot != -1) {
+            *find_bucket(buckets, capacity, index->buckets[i].name) =
+                index->buckets[i];
+        }
+    }
+
+    free(index->buckets);
+    index->buckets = buckets;
+    index->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Initialize an empty directory index.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int dir_index_init(dir_index_t *index) {
+    index->buckets = alloc_buckets(INITIAL_CAPACITY);
+    index->capacity = INITIAL_CAPACITY;
+    index->count = 0;
+
+    index->free_slots = NULL;
+    index->n_free_slots = 0;
+    index->free_slots_capacity = 0;
+    index->next_slot = 0;
+
+    return index->buckets == NULL ? -1 : 0;
+}
+
+/**
+ * Release the memory of a directory index.
+ */
+void dir_index_destroy(dir_index_t *index) {
+    free(index->buckets);
+    free(index->free_slots);
+    memset(index, 0, sizeof(dir_index_t));
+}
+
+/**
+ * Look up the inumber of a sub file.
+ *
+ * Returns the inumber, or -1 if there is no entry named name.
+ */
+int dir_index_find(dir_index_t const *index, char const *name) {
+    dir_index_entry_t const *bucket =
+        find_bucket(index->buckets, index->capacity, name);
+    return bucket->slot == -1 ? -1 : bucket->inumber;
+}
+
+/**
+ * Add an entry to the index.
+ *
+ * Input:
+ *   - index: the directory index
+ *   - name: sub file name (at most MAX_FILE_NAME - 1 characters)
+ *   - inumber: inumber of the sub file
+ *   - slot: directory slot where the entry is stored
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - An entry named name already exists.
+ *   - malloc failure when growing the table.
+ */
+int dir_index_insert(dir_index_t *index, char const *name, int inumber,
+                     int slot) {
+    if ((index->count + 1) * 2 > index->capacity && grow(index) == -1) {
+        return -1;
+    }
+
+    dir_index_entry_t *bucket =
+        find_bucket(index->buckets, index->capacity, name);
+    if (bucket->slot != -1) {
+        return -1; // already exists
+    }
+
+    strncpy(bucket->name, name, MAX_FILE_NAME - 1);
+    bucket->name[MAX_FILE_NAME - 1] = '\0';
+    bucket->inumber = inumber;
+    bucket->slot = slot;
+    index->count++;
+
+    return 0;
+}
+
+/**
+ * Remove an entry from the index.
+ *
+ * Returns the slot the entry was stored in, or -1 if there is no entry named
+ * name.
+ */
+int dir_index_remove(dir_index_t *index, char const *name) {
+    dir_index_entry_t *bucket =
+        find_bucket(index->buckets, index->capacity, name);
+    if (bucket->slot == -1) {
+        return -1; // not found
+    }
+
+    int slot = bucket->slot;
+    bucket->slot = -1;
+    index->count--;
+
+    // Shift back the entries of the probe sequence that follows the removed
+    // one, so that lookups never stop early at the hole
+    size_t mask = index->capacity - 1;
+    size_t hole = (size_t)(bucket - index->buckets);
+    for (size_t i = (hole + 1) & mask; index->buckets[i].slot != -1;
+         i = (i + 1) & mask) {
+        size_t home = hash_name(index->buckets[i].name) & mask;
+        // The entry may only move back if its home bucket is not cyclically
+        // within (hole, i]
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            index->buckets[hole] = index->buckets[i];
+            index->buckets[i].slot = -1;
+            hole = i;
+        }
+    }
+
+    return slot;
+}
+
+/**
+ * Pick a directory slot for a new entry, preferring slots that were released.
+ *
+ * Returns the slot.
+ */
+int dir_index_take_slot(dir_index_t *index) {
+    if (index->n_free_slots > 0) {
+        return index->free_slots[--index->n_free_slots];
+    }
+
+    return (int)index->next_slot++;
+}
+
+/**
+ * Give back a slot, to be reused by a later entry.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure when growing the free slot list.
+ */
+int dir_index_release_slot(dir_index_t *index, int slot) {
+    if (index->n_free_slots == index->free_slots_capacity) {
+        size_t capacity = index->free_slots_capacity == 0
+                              ? INITIAL_CAPACITY
+                              : index->free_slots_capacity * 2;
+        int *free_slots = realloc(index->free_slots, capacity * sizeof(int));
+        if (free_slots == NULL) {
+            return -1;
+        }
+        index->free_slots = free_slots;
+        index->free_slots_capacity = capacity;
+    }
+
+    index->free_slots[index->n_free_slots++] = slot;
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include "config.h"
+
+#include <stddef.h>
+
+/**
+ * In-memory index of a directory, kept alongside its on-block entries.
+ *
+ * Maps each sub file name to its inumber and to the slot (entry number across
+ * the directory's blocks) where it is stored, and keeps track of free slots.
+ */
+typedef struct {
+    char name[MAX_FILE_NAME];
+    int inumber;
+    int slot; // -1 if the bucket is empty
+} dir_index_entry_t;
+
+typedef struct {
+    dir_index_entry_t *buckets;
+    size_t capacity; // power of 2
+    size_t count;
+
+    int *free_slots; // slots released by removals, reused first
+    size_t n_free_slots;
+    size_t free_slots_capacity;
+    size_t next_slot; // slots from here on were never used
+} dir_index_t;
+
+int dir_index_init(dir_index_t *index);
+void dir_index_destroy(dir_index_t *index);
+
+int dir_index_find(dir_index_t const *index, char const *name);
+int dir_index_insert(dir_index_t *index, char const *name, int inumber,
+                     int slot);
+int dir_index_remove(dir_index_t *index, char const *name);
+
+int dir_index_take_slot(dir_index_t *index);
+int dir_index_release_slot(dir_index_t *index, int slot);
+
+#endif // DIR_INDEX_H
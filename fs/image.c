@@ -0,0 +1,341 @@
+#include "image.h"
+#include "betterassert.h"
+#include "bitmap.h"
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// "TFSIMAGE", read as a little-endian integer
+#define IMAGE_MAGIC (0x4547414d49534654ULL)
+// Bumped whenever the layout changes
+#define IMAGE_VERSION (1)
+
+/**
+ * First page of an image, describing the rest of it.
+ *
+ * The sizes of the structures are kept so an image is not mounted by a build
+ * that lays them out differently.
+ */
+typedef struct {
+    uint64_t magic; // 0 in a new file
+    uint64_t version;
+
+    uint64_t inode_count;
+    uint64_t block_count;
+    uint64_t block_size;
+    uint64_t inode_size;
+    uint64_t dir_entry_size;
+
+    uint64_t inodes_offset;
+    uint64_t inode_words_offset;
+    uint64_t block_words_offset;
+    uint64_t data_offset;
+    uint64_t size;
+} image_superblock_t;
+
+/**
+ * Round a size up to a whole number of pages.
+ */
+static size_t page_align(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+/**
+ * Fill in the superblock of an image made with the given parameters.
+ */
+static void layout(image_superblock_t *super, tfs_params const *params) {
+    memset(super, 0, sizeof(image_superblock_t));
+    super->version = IMAGE_VERSION;
+    super->inode_count = params->max_inode_count;
+    super->block_count = params->max_block_count;
+    super->block_size = params->block_size;
+    super->inode_size = sizeof(inode_t);
+    super->dir_entry_size = sizeof(dir_entry_t);
+
+    super->inodes_offset = page_align(sizeof(image_superblock_t));
+    super->inode_words_offset =
+        super->inodes_offset +
+        page_align(params->max_inode_count * sizeof(inode_t));
+    super->block_words_offset =
+        super->inode_words_offset +
+        page_align(bitmap_words(params->max_inode_count) * sizeof(uint64_t));
+    super->data_offset =
+        super->block_words_offset +
+        page_align(bitmap_words(params->max_block_count) * sizeof(uint64_t));
+    super->size = super->data_offset +
+                  page_align(params->max_block_count * params->block_size);
+}
+
+/**
+ * Wait for the directory entry of a file just created to reach the storage,
+ * by syncing the directory it is in.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_sync_dir(char const *path) {
+    char copy[PATH_MAX];
+    if (strlen(path) >= sizeof(copy)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(copy, path);
+
+    int dir = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) {
+        return -1;
+    }
+    int ret = fsync(dir);
+    close(dir);
+    return ret;
+}
+
+/**
+ * Make a new image durable as such: its size, its superblock and its
+ * directory entry. Until then, a crash of the OS could leave the file looking
+ * new again, and its journal would be thrown away (see state_init).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int sync_new(image_t *image, char const *path) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (msync(image->file, page, MS_SYNC) == -1 || fsync(image->fd) == -1 ||
+        image_sync_dir(path) == -1) {
+        WARN("Failed to sync new image %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write the image back every interval_ms, until image_close.
+ */
+static void *syncer(void *arg) {
+    image_t *image = (image_t *)arg;
+
+    pthread_mutex_lock(&image->lock);
+    while (!image->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += (time_t)(image->interval_ms / 1000);
+        deadline.tv_nsec += (long)(image->interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int ret = 0;
+        while (!image->stopping && ret != ETIMEDOUT) {
+            ret = pthread_cond_timedwait(&image->stop, &image->lock,
+                                         &deadline);
+        }
+        if (!image->stopping) {
+            pthread_mutex_unlock(&image->lock);
+            image_sync(image);
+            pthread_mutex_lock(&image->lock);
+        }
+    }
+    pthread_mutex_unlock(&image->lock);
+
+    return NULL;
+}
+
+/**
+ * Start the thread syncing an image periodically.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int start_syncer(image_t *image) {
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0) {
+        return -1;
+    }
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int ret = pthread_cond_init(&image->stop, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ret != 0) {
+        return -1;
+    }
+
+    pthread_mutex_init(&image->lock, NULL);
+    image->stopping = false;
+    if (pthread_create(&image->syncer, NULL, syncer, image) != 0) {
+        pthread_cond_destroy(&image->stop);
+        pthread_mutex_destroy(&image->lock);
+        return -1;
+    }
+
+    image->syncing = true;
+    return 0;
+}
+
+/**
+ * Open (creating it if needed) and map the image file of the given
+ * parameters.
+ *
+ * A new (or empty) file is sized for the parameters and left zeroed, with
+ * `fresh` set; an existing image must have been made with the same counts and
+ * block size.
+ *
+ * Input:
+ *   - image: where to keep the mapping
+ *   - params: TécnicoFS parameters, with image_path set
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - The file can't be opened, sized or mapped.
+ *   - The file is not a TécnicoFS image, or was made with other parameters.
+ */
+int image_open(image_t *image, tfs_params const *params) {
+    image_superblock_t expected;
+    layout(&expected, params);
+
+    memset(image, 0, sizeof(image_t));
+    image->fd = open(params->image_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (image->fd == -1) {
+        WARN("Failed to open image %s: %s", params->image_path,
+             strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(image->fd, &st) == -1) {
+        WARN("Failed to stat image %s: %s", params->image_path,
+             strerror(errno));
+        close(image->fd);
+        return -1;
+    }
+    // A new file is sized sparsely: blocks are only stored once written
+    if (st.st_size == 0 && ftruncate(image->fd, (off_t)expected.size) == -1) {
+        WARN("Failed to size image %s: %s", params->image_path,
+             strerror(errno));
+        close(image->fd);
+        return -1;
+    }
+    if (st.st_size != 0 && (size_t)st.st_size != expected.size) {
+        WARN("Image %s does not match the FS parameters", params->image_path);
+        close(image->fd);
+        return -1;
+    }
+
+    image->size = expected.size;
+    image->file = mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       image->fd, 0);
+    image->base = image->file;
+    if (image->file != MAP_FAILED &&
+        params->sync_policy == TFS_SYNC_JOURNAL) {
+        image->base = mmap(NULL, image->size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, image->fd, 0);
+    }
+    if (image->file == MAP_FAILED || image->base == MAP_FAILED) {
+        WARN("Failed to map image %s: %s", params->image_path,
+             strerror(errno));
+        if (image->file != MAP_FAILED) {
+            munmap(image->file, image->size);
+        }
+        close(image->fd);
+        image->base = NULL;
+        image->file = NULL;
+        return -1;
+    }
+
+    image_superblock_t *super = (image_superblock_t *)image->base;
+    if (super->magic == 0) {
+        // New image (or one whose superblock never reached the file)
+        *super = expected;
+        super->magic = IMAGE_MAGIC;
+        *(image_superblock_t *)image->file = *super;
+        image->fresh = true;
+        if (params->sync_policy != TFS_SYNC_NONE &&
+            sync_new(image, params->image_path) != 0) {
+            image_close(image);
+            return -1;
+        }
+    } else {
+        image_superblock_t found = *super;
+        found.magic = 0;
+        if (super->magic != IMAGE_MAGIC ||
+            memcmp(&found, &expected, sizeof(expected)) != 0) {
+            WARN("Image %s does not match the FS parameters",
+                 params->image_path);
+            image_close(image);
+            return -1;
+        }
+    }
+
+    image->inodes = image->base + expected.inodes_offset;
+    image->inode_words =
+        (uint64_t *)(image->base + expected.inode_words_offset);
+    image->block_words =
+        (uint64_t *)(image->base + expected.block_words_offset);
+    image->data = image->base + expected.data_offset;
+
+    image->policy = params->sync_policy;
+    image->interval_ms =
+        params->sync_interval_ms > 0 ? params->sync_interval_ms : 1000;
+    if (image->policy == TFS_SYNC_PERIODIC && start_syncer(image) != 0) {
+        WARN("Failed to start the image syncer");
+        image_close(image);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Write an image's shared mapping back to its file, waiting for it to reach
+ * the storage (when journaling, that only holds what the journal applied).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int image_sync(image_t *image) {
+    if (msync(image->file, image->size, MS_SYNC) == -1) {
+        WARN("Failed to sync image: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop syncing an image and unmap it, writing it back first unless the sync
+ * policy is TFS_SYNC_NONE (or TFS_SYNC_JOURNAL, whose journal_close does).
+ */
+void image_close(image_t *image) {
+    if (image->syncing) {
+        pthread_mutex_lock(&image->lock);
+        image->stopping = true;
+        pthread_cond_signal(&image->stop);
+        pthread_mutex_unlock(&image->lock);
+
+        pthread_join(image->syncer, NULL);
+        pthread_cond_destroy(&image->stop);
+        pthread_mutex_destroy(&image->lock);
+        image->syncing = false;
+    }
+
+    if (image->base != NULL) {
+        if (image->policy != TFS_SYNC_NONE &&
+            image->policy != TFS_SYNC_JOURNAL) {
+            image_sync(image);
+        }
+        if (image->base != image->file) {
+            munmap(image->base, image->size);
+        }
+        munmap(image->file, image->size);
+        image->base = NULL;
+        image->file = NULL;
+    }
+    if (image->fd != -1) {
+        close(image->fd);
+        image->fd = -1;
+    }
+}
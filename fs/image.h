@@ -0,0 +1,51 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "operations.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * TécnicoFS image: a file holding the persistent FS state, memory-mapped so
+ * the state is accessed in place (mounting an image costs an mmap, not a
+ * rebuild).
+ *
+ * Layout, each section starting on a page boundary:
+ *   superblock | inode table | free inode bitmap | free block bitmap | data
+ *
+ * Under TFS_SYNC_JOURNAL the state is mapped privately, so changes the
+ * journal doesn't hold yet can never reach the file (the OS writes dirty
+ * shared pages back whenever it likes); the journal applies its durable
+ * records to the file through a second, shared, mapping.
+ */
+typedef struct {
+    int fd;
+    char *base;
+    // Shared mapping of the file: base itself, unless journaling
+    char *file;
+    size_t size;
+    bool fresh; // the image was just created, with every section zeroed
+
+    void *inodes;
+    uint64_t *inode_words;
+    uint64_t *block_words;
+    char *data;
+
+    tfs_sync_policy_t policy;
+    size_t interval_ms;
+    // Background thread syncing the image, under TFS_SYNC_PERIODIC
+    pthread_t syncer;
+    bool syncing;
+    pthread_mutex_t lock;
+    pthread_cond_t stop;
+    bool stopping;
+} image_t;
+
+int image_open(image_t *image, tfs_params const *params);
+int image_sync(image_t *image);
+int image_sync_dir(char const *path);
+void image_close(image_t *image);
+
+#endif // IMAGE_H
@@ -0,0 +1,418 @@
+#include "journal.h"
+#include "betterassert.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// "TFSJRNL1", read as a little-endian integer
+#define JOURNAL_MAGIC (0x314c4e524a534654ULL)
+#define INITIAL_CAPACITY (64 * 1024)
+
+/**
+ * Header of each flush written to the journal, followed by its records.
+ *
+ * A crash may leave the last batch partly written; its checksum then doesn't
+ * match, and replay stops there.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t length; // of the records that follow
+    uint64_t checksum;
+} journal_batch_t;
+
+/**
+ * A change to the image, followed by the bytes changed (padded to 8 bytes).
+ */
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} journal_record_t;
+
+#define HEADER (sizeof(journal_batch_t))
+#define PADDED(len) (((len) + 7) & ~(size_t)7)
+
+// Bytes logged by the calling thread since its last journal_begin, up to its
+// last record (0 if it logged nothing)
+static _Thread_local uint64_t my_lsn;
+
+/**
+ * FNV-1a hash of the records of a batch.
+ */
+static uint64_t checksum(char const *records, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)records[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Apply the records of a journal file to the image's file mapping, and to its
+ * state if that is mapped apart.
+ *
+ * Batches are applied in order, up to the first one that is incomplete (the
+ * flush a crash interrupted).
+ *
+ * Input:
+ *   - fd: the journal file
+ *   - image: the image it belongs to
+ *   - to_state: whether to apply the records to the image's state too
+ *
+ * Returns the number of batches applied, or -1 if the journal can't be read.
+ */
+static ssize_t apply(int fd, image_t *image, bool to_state) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    char *contents = malloc(size > 0 ? size : 1);
+    if (contents == NULL) {
+        return -1;
+    }
+    for (size_t done = 0; done < size;) {
+        ssize_t n = pread(fd, contents + done, size - done, (off_t)done);
+        if (n <= 0) {
+            size = done; // whatever could be read
+            break;
+        }
+        done += (size_t)n;
+    }
+
+    size_t batches = 0;
+    for (size_t at = 0; at + HEADER <= size;) {
+        journal_batch_t const *batch = (journal_batch_t const *)&contents[at];
+        char const *records = &contents[at + HEADER];
+        if (batch->magic != JOURNAL_MAGIC ||
+            batch->length > size - at - HEADER ||
+            checksum(records, batch->length) != batch->checksum) {
+            break; // torn flush
+        }
+
+        for (size_t r = 0; r + sizeof(journal_record_t) <= batch->length;) {
+            journal_record_t const *record =
+                (journal_record_t const *)&records[r];
+            ALWAYS_ASSERT(record->length <= batch->length - r &&
+                              record->offset <= image->size &&
+                              record->length <= image->size - record->offset,
+                          "journal_replay: invalid record");
+            memcpy(image->file + record->offset, record + 1, record->length);
+            if (to_state && image->base != image->file) {
+                memcpy(image->base + record->offset, record + 1,
+                       record->length);
+            }
+            r += sizeof(journal_record_t) + PADDED(record->length);
+        }
+
+        at += HEADER + batch->length;
+        batches++;
+    }
+    free(contents);
+    return (ssize_t)batches;
+}
+
+/**
+ * Apply the records of a journal file to an image, then sync the image and
+ * empty the journal.
+ *
+ * Input:
+ *   - path: path of the journal (which may not exist)
+ *   - image: the image it belongs to
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_replay(char const *path, image_t *image) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    ssize_t batches = apply(fd, image, true);
+    if (batches == -1) {
+        close(fd);
+        return -1;
+    }
+    if (batches > 0) {
+        LOG("Replayed %zd journal batches", batches);
+        if (image_sync(image) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    int ret = ftruncate(fd, 0);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Open (creating it if needed) the journal of an image, which must have been
+ * replayed.
+ *
+ * Input:
+ *   - journal: the journal to initialize
+ *   - path: path of the journal
+ *   - image: the image it belongs to
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_open(journal_t *journal, char const *path, image_t *image) {
+    memset(journal, 0, sizeof(journal_t));
+    journal->image = image;
+    journal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (journal->fd == -1) {
+        WARN("Failed to open journal %s: %s", path, strerror(errno));
+        return -1;
+    }
+    // Its batches are durable once flushed only if the file itself is
+    if (image_sync_dir(path) != 0) {
+        WARN("Failed to sync journal %s: %s", path, strerror(errno));
+        close(journal->fd);
+        return -1;
+    }
+
+    journal->capacity = INITIAL_CAPACITY;
+    journal->spare_capacity = INITIAL_CAPACITY;
+    journal->buffer = malloc(journal->capacity);
+    journal->spare = malloc(journal->spare_capacity);
+    if (journal->buffer == NULL || journal->spare == NULL) {
+        free(journal->buffer);
+        free(journal->spare);
+        close(journal->fd);
+        return -1;
+    }
+    journal->length = HEADER;
+
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_cond_init(&journal->flushed, NULL);
+    pthread_mutex_init(&journal->gate_lock, NULL);
+    pthread_cond_init(&journal->gate, NULL);
+    return 0;
+}
+
+/**
+ * Write out everything logged so far, and wait for it to be durable.
+ *
+ * Called with the journal's lock held and no flush in progress; the lock is
+ * released while writing, so other threads keep logging to the other buffer.
+ */
+static void flush(journal_t *journal) {
+    char *batch = journal->buffer;
+    size_t length = journal->length;
+    size_t capacity = journal->capacity;
+    uint64_t logged = journal->logged;
+    off_t at = (off_t)journal->file_size;
+
+    journal->buffer = journal->spare;
+    journal->capacity = journal->spare_capacity;
+    journal->length = HEADER;
+    journal->flushing = true;
+    pthread_mutex_unlock(&journal->lock);
+
+    journal_batch_t *header = (journal_batch_t *)batch;
+    header->magic = JOURNAL_MAGIC;
+    header->length = length - HEADER;
+    header->checksum = checksum(batch + HEADER, length - HEADER);
+    for (size_t done = 0; done < length;) {
+        ssize_t n = pwrite(journal->fd, batch + done, length - done,
+                           at + (off_t)done);
+        if (n == -1 && errno != EINTR) {
+            PANIC("Failed to write journal: %s", strerror(errno));
+        }
+        done += n > 0 ? (size_t)n : 0;
+    }
+    // Past this point, a failure may have lost data the OS claimed written
+    if (fdatasync(journal->fd) == -1) {
+        PANIC("Failed to sync journal: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    journal->file_size += length;
+    journal->spare = batch;
+    journal->spare_capacity = capacity;
+    journal->durable = logged;
+    journal->flushing = false;
+    pthread_cond_broadcast(&journal->flushed);
+}
+
+/**
+ * Apply the flushed records to the image file and sync it, then empty the
+ * journal.
+ *
+ * Called with the journal's lock held and no flush in progress.
+ *
+ * Returns 0 if successful, -1 (leaving the journal to be replayed) otherwise.
+ */
+static int write_back(journal_t *journal) {
+    if (apply(journal->fd, journal->image, false) == -1 ||
+        image_sync(journal->image) != 0) {
+        return -1;
+    }
+    if (ftruncate(journal->fd, 0) == -1) {
+        PANIC("Failed to empty journal: %s", strerror(errno));
+    }
+    journal->file_size = 0;
+    return 0;
+}
+
+/**
+ * Flush the journal, then write it back to the image and empty it.
+ */
+void journal_close(journal_t *journal) {
+    pthread_mutex_lock(&journal->lock);
+    while (journal->flushing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    if (journal->length > HEADER) {
+        flush(journal);
+    }
+    // Nothing left to replay on the next mount
+    if (write_back(journal) != 0) {
+        WARN("Failed to write journal back to the image");
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    close(journal->fd);
+    free(journal->buffer);
+    free(journal->spare);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->flushed);
+    pthread_mutex_destroy(&journal->gate_lock);
+    pthread_cond_destroy(&journal->gate);
+}
+
+/**
+ * Start an operation that changes the image (waiting for a checkpoint in
+ * progress, if any).
+ */
+void journal_begin(journal_t *journal) {
+    my_lsn = 0;
+
+    pthread_mutex_lock(&journal->gate_lock);
+    while (journal->checkpointing) {
+        pthread_cond_wait(&journal->gate, &journal->gate_lock);
+    }
+    journal->active++;
+    pthread_mutex_unlock(&journal->gate_lock);
+}
+
+/**
+ * Log a change just made to the image's state (which the image file only gets
+ * from the journal).
+ *
+ * Input:
+ *   - journal: the journal
+ *   - at: first byte changed, inside the image
+ *   - len: number of bytes changed
+ */
+void journal_log(journal_t *journal, void const *at, size_t len) {
+    size_t offset = (size_t)((char const *)at - journal->image->base);
+    ALWAYS_ASSERT(offset <= journal->image->size &&
+                      len <= journal->image->size - offset,
+                  "journal_log: change outside the image");
+    size_t size = sizeof(journal_record_t) + PADDED(len);
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->length + size > journal->capacity) {
+        size_t capacity = journal->capacity * 2;
+        while (journal->length + size > capacity) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(journal->buffer, capacity);
+        ALWAYS_ASSERT(buffer != NULL, "journal_log: out of memory");
+        journal->buffer = buffer;
+        journal->capacity = capacity;
+    }
+
+    journal_record_t *record =
+        (journal_record_t *)&journal->buffer[journal->length];
+    record->offset = offset;
+    record->length = len;
+    memcpy(record + 1, at, len);
+    memset((char *)(record + 1) + len, 0, PADDED(len) - len);
+
+    journal->length += size;
+    journal->logged += size;
+    my_lsn = journal->logged;
+    pthread_mutex_unlock(&journal->lock);
+}
+
+/**
+ * End an operation started with journal_begin.
+ */
+void journal_end(journal_t *journal) {
+    pthread_mutex_lock(&journal->gate_lock);
+    if (--journal->active == 0 && journal->checkpointing) {
+        pthread_cond_broadcast(&journal->gate);
+    }
+    pthread_mutex_unlock(&journal->gate_lock);
+}
+
+/**
+ * Write the journal back to the image and empty it, once every operation in
+ * progress ends (and what they logged is flushed).
+ */
+static void checkpoint(journal_t *journal) {
+    pthread_mutex_lock(&journal->gate_lock);
+    if (journal->checkpointing) {
+        pthread_mutex_unlock(&journal->gate_lock);
+        return; // another thread is at it
+    }
+    journal->checkpointing = true;
+    while (journal->active > 0) {
+        pthread_cond_wait(&journal->gate, &journal->gate_lock);
+    }
+    pthread_mutex_unlock(&journal->gate_lock);
+
+    pthread_mutex_lock(&journal->lock);
+    while (journal->flushing) {
+        pthread_cond_wait(&journal->flushed, &journal->lock);
+    }
+    // Only the journal's records may reach the image file
+    if (journal->length > HEADER) {
+        flush(journal);
+    }
+    if (write_back(journal) != 0) {
+        WARN("Failed to checkpoint journal");
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    pthread_mutex_lock(&journal->gate_lock);
+    journal->checkpointing = false;
+    pthread_cond_broadcast(&journal->gate);
+    pthread_mutex_unlock(&journal->gate_lock);
+}
+
+/**
+ * Wait for the records the calling thread logged since its last journal_begin
+ * to be durable, flushing them (along with every other thread's) if no flush
+ * is in progress.
+ *
+ * Must be called after journal_end, holding no FS locks.
+ */
+void journal_commit(journal_t *journal) {
+    uint64_t lsn = my_lsn;
+    if (lsn == 0) {
+        return; // nothing logged
+    }
+
+    pthread_mutex_lock(&journal->lock);
+    while (journal->durable < lsn) {
+        if (journal->flushing) {
+            pthread_cond_wait(&journal->flushed, &journal->lock);
+        } else {
+            flush(journal);
+        }
+    }
+    bool full = journal->file_size >= JOURNAL_CHECKPOINT_SIZE;
+    pthread_mutex_unlock(&journal->lock);
+
+    if (full) {
+        checkpoint(journal);
+    }
+}
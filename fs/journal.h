@@ -0,0 +1,64 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Write-ahead journal of the changes to a TécnicoFS image (see
+ * TFS_SYNC_JOURNAL).
+ *
+ * Every change is made in the image's memory, which is mapped privately, and
+ * then logged as a redo record of the bytes changed (offset in the image,
+ * length, contents); the image file only gets the records once they are
+ * durable, at checkpoints, so replaying them is always enough. An operation
+ * is durable once a flush including its records reaches the storage; flushes
+ * are shared (group commit): a thread finding none in progress writes out
+ * everything logged so far, with a single fdatasync, while the others wait for
+ * it.
+ *
+ * Replaying the journal brings an image back to its last flushed state. Once
+ * the journal grows past JOURNAL_CHECKPOINT_SIZE, with no operation in
+ * progress, its records are applied to the image file, which is synced, and
+ * the journal is emptied (a checkpoint).
+ */
+typedef struct {
+    int fd;
+    image_t *image;
+    size_t file_size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    // Records logged and not yet flushed, after room for the batch header
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    // The other buffer, which a flush writes out from
+    char *spare;
+    size_t spare_capacity;
+    // Bytes ever logged, and how many of them are known to be durable
+    uint64_t logged;
+    uint64_t durable;
+    bool flushing;
+
+    // Operations in progress, and whether a checkpoint waits for them to end
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate;
+    size_t active;
+    bool checkpointing;
+} journal_t;
+
+int journal_replay(char const *path, image_t *image);
+
+int journal_open(journal_t *journal, char const *path, image_t *image);
+void journal_close(journal_t *journal);
+
+void journal_begin(journal_t *journal);
+void journal_log(journal_t *journal, void const *at, size_t len);
+void journal_end(journal_t *journal);
+void journal_commit(journal_t *journal);
+
+#endif // JOURNAL_H
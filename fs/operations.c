@@ -10,8 +10,6 @@
 
 #include "betterassert.h"
 
-pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 tfs_params tfs_default_params() {
     tfs_params params = {
         .max_inode_count = 64,
@@ -30,9 +28,13 @@ int tfs_init(tfs_params const *params_ptr) {
         params = tfs_default_params();
     }
 
-    if (state_init(params) != 0) {
+    int ret = state_init(params);
+    if (ret == -1) {
         return -1;
     }
+    if (ret == 1) {
+        return 0; // mounted an existing image, root included
+    }
 
     // create root inode
     int root = inode_create(T_DIRECTORY);
@@ -50,6 +52,8 @@ int tfs_destroy() {
     return 0;
 }
 
+int tfs_sync() { return state_sync(false); }
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
@@ -77,42 +81,40 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
 }
 
 int tfs_file_exists(char *path) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
-        return -1;
-    }
-
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_file_exists: root dir inode must exist");
-    int inum = tfs_lookup(path, root_dir_inode);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-    }
+    inode_rdlock(root_dir_inode);
+    int inum = tfs_lookup(path, root_dir_inode);
+    inode_unlock(root_dir_inode);
 
     return inum;
 }
 
-int tfs_open(char const *name, tfs_file_mode_t mode) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
-        return -1;
-    }
+/**
+ * Body of tfs_open, which runs it as a state operation.
+ */
+static int open_file(char const *name, tfs_file_mode_t mode) {
     // Checks if the path name is valid
     if (!valid_pathname(name)) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
         return -1;
     }
 
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_open: root dir inode must exist");
+
+    // Lookups only need the directory for reading; it is only locked for
+    // writing when the file has to be created
+    inode_rdlock(root_dir_inode);
     int inum = tfs_lookup(name, root_dir_inode);
+    if (inum < 0 && (mode & TFS_O_CREAT)) {
+        inode_unlock(root_dir_inode);
+        inode_wrlock(root_dir_inode);
+        // Another thread may have created it in the meantime
+        inum = tfs_lookup(name, root_dir_inode);
+    }
     size_t offset;
 
     if (inum >= 0) {
@@ -123,10 +125,10 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            inode_wrlock(inode);
+            inode_truncate(inode);
+        } else {
+            inode_rdlock(inode);
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
@@ -134,44 +136,33 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         } else {
             offset = 0;
         }
+        inode_unlock(inode);
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                WARN("failed to unlock mutex: %s", strerror(errno));
-                return -1;
-            }
+            inode_unlock(root_dir_inode);
             return -1; // no space in inode table
         }
 
         // Add entry in the root directory
         if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
             inode_delete(inum);
-            if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                WARN("failed to unlock mutex: %s", strerror(errno));
-                return -1;
-            }
+            inode_unlock(root_dir_inode);
             return -1; // no space in directory
         }
 
         offset = 0;
     } else {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+        inode_unlock(root_dir_inode);
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
     // handle
     int ret = add_to_open_file_table(inum, offset);
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-    }
+    inode_unlock(root_dir_inode);
     return ret;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
@@ -179,40 +170,36 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     // opened but it remains created
 }
 
+int tfs_open(char const *name, tfs_file_mode_t mode) {
+    // Creating or truncating the file changes the FS
+    state_op_begin();
+    int fhandle = open_file(name, mode);
+    state_op_end();
+    return fhandle;
+}
+
 int tfs_close(int fhandle) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
-        return -1;
-    }
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
         return -1; // invalid fd
     }
 
     remove_from_open_file_table(fhandle);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-    }
-    return 0;
+    return state_sync(true);
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
-        WARN("failed to lock mutex: %s", strerror(errno));
-        return -1;
-    }
+/**
+ * Body of tfs_write, which runs it as a state operation.
+ */
+static ssize_t write_file(int fhandle, void const *buffer, size_t to_write) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&file->of_lock) != 0) {
+        WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
 
@@ -220,128 +207,277 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
+    inode_wrlock(inode);
+    if (file->of_deleted) {
+        // Unlinked since it was opened
+        inode_unlock(inode);
+        pthread_mutex_unlock(&file->of_lock);
+        return -1;
+    }
+
     // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    size_t max_size = state_max_file_size();
+    if (file->of_offset >= max_size) {
+        to_write = 0;
+    } else if (to_write > max_size - file->of_offset) {
+        to_write = max_size - file->of_offset;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-                    WARN("failed to unlock mutex: %s", strerror(errno));
-                    return -1;
-                }
-                return -1; // no space
-            }
-
-            inode->i_data_block = bnum;
+    size_t block_size = state_block_size();
+    size_t written = 0;
+    while (written < to_write) {
+        // Locate (allocating if needed) the block under the current offset
+        int bnum =
+            inode_data_block(inode, file->of_offset / block_size, true);
+        if (bnum == -1) {
+            break; // no space
         }
 
-        void *block = data_block_get(inode->i_data_block);
+        void *block = data_block_get(bnum);
         ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
 
+        size_t block_offset = file->of_offset % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_write - written) {
+            chunk = to_write - written;
+        }
+
         // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+        memcpy(block + block_offset, (char const *)buffer + written, chunk);
+        state_log(block + block_offset, chunk);
+        written += chunk;
 
         // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
+        file->of_offset += chunk;
         if (file->of_offset > inode->i_size) {
             inode->i_size = file->of_offset;
+            state_log(&inode->i_size, sizeof(size_t));
         }
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
+    inode_unlock(inode);
+    pthread_mutex_unlock(&file->of_lock);
+
+    if (written == 0 && to_write > 0) {
+        return -1; // no space
     }
-    return (ssize_t)to_write;
+
+    return (ssize_t)written;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    state_op_begin();
+    ssize_t written = write_file(fhandle, buffer, to_write);
+    state_op_end();
+    return written;
+}
+
+/**
+ * Body of tfs_truncate, which runs it as a state operation.
+ */
+static int truncate_file(int fhandle, size_t length) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&file->of_lock) != 0) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_truncate: inode of open file deleted");
+
+    inode_wrlock(inode);
+    int ret = -1;
+    if (!file->of_deleted && length <= inode->i_size) {
+        inode->i_size = length;
+        state_log(&inode->i_size, sizeof(size_t));
+        if (file->of_offset > length) {
+            file->of_offset = length;
         }
-        return -1;
+        ret = 0;
     }
+    inode_unlock(inode);
+    pthread_mutex_unlock(&file->of_lock);
 
-    // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    return ret;
+}
 
+int tfs_truncate(int fhandle, size_t length) {
+    state_op_begin();
+    int ret = truncate_file(fhandle, length);
+    state_op_end();
+    return ret;
+}
+
+/**
+ * Copy up to len bytes of the file, starting at offset, to buffer.
+ *
+ * The caller must hold the inode's lock (for reading, at least).
+ *
+ * Returns the number of bytes read.
+ */
+static size_t inode_read_at(inode_t *inode, void *buffer, size_t len,
+                            size_t offset) {
     // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    if (offset >= inode->i_size) {
+        return 0;
+    }
+    size_t to_read = inode->i_size - offset;
     if (to_read > len) {
         to_read = len;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
+    size_t block_size = state_block_size();
+    size_t bytes_read = 0;
+    while (bytes_read < to_read) {
+        size_t position = offset + bytes_read;
+        int bnum = inode_data_block(inode, position / block_size, false);
+        ALWAYS_ASSERT(bnum != -1, "tfs_read: data block missing mid-file");
+
+        void *block = data_block_get(bnum);
         ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
 
+        size_t block_offset = position % block_size;
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_read - bytes_read) {
+            chunk = to_read - bytes_read;
+        }
+
         // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+        memcpy((char *)buffer + bytes_read, block + block_offset, chunk);
+        bytes_read += chunk;
     }
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
+    return to_read;
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
         return -1;
     }
-    return (ssize_t)to_read;
-}
 
-int tfs_unlink(char const *target) {
-    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+    if (pthread_mutex_lock(&file->of_lock) != 0) {
         WARN("failed to lock mutex: %s", strerror(errno));
         return -1;
     }
+
+    // From the open file table entry, we get the inode
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+
+    inode_rdlock(inode);
+    if (file->of_deleted) {
+        inode_unlock(inode);
+        pthread_mutex_unlock(&file->of_lock);
+        return -1;
+    }
+    size_t bytes_read = inode_read_at(inode, buffer, len, file->of_offset);
+    inode_unlock(inode);
+
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += bytes_read;
+    pthread_mutex_unlock(&file->of_lock);
+
+    return (ssize_t)bytes_read;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    // The handle's offset is neither used nor updated, so there is no need to
+    // serialize with other operations on the same handle
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+
+    inode_rdlock(inode);
+    if (file->of_deleted) {
+        inode_unlock(inode);
+        return -1;
+    }
+    size_t bytes_read = inode_read_at(inode, buffer, len, offset);
+    inode_unlock(inode);
+
+    return (ssize_t)bytes_read;
+}
+
+typedef struct {
+    tfs_list_fn fn;
+    void *arg;
+} list_context_t;
+
+/**
+ * Passes a directory entry on to the function given to tfs_list, with the
+ * size of its file.
+ */
+static int list_entry(char const *sub_name, int sub_inumber, void *arg) {
+    list_context_t const *context = (list_context_t const *)arg;
+
+    inode_t *inode = inode_get(sub_inumber);
+    inode_rdlock(inode);
+    size_t size = inode->i_size;
+    inode_unlock(inode);
+
+    return context->fn(sub_name, size, context->arg);
+}
+
+int tfs_list(tfs_list_fn fn, void *arg) {
+    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    ALWAYS_ASSERT(root_dir_inode != NULL,
+                  "tfs_list: root dir inode must exist");
+
+    list_context_t context = {.fn = fn, .arg = arg};
+    inode_rdlock(root_dir_inode);
+    int ret = dir_for_each(root_dir_inode, list_entry, &context);
+    inode_unlock(root_dir_inode);
+
+    return ret;
+}
+
+/**
+ * Body of tfs_unlink, which runs it as a state operation.
+ */
+static int unlink_file(char const *target) {
     // Checks if the path name is valid
     if (!valid_pathname(target)) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
         return -1;
     }
 
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
+                  "tfs_unlink: root dir inode must exist");
+
+    inode_wrlock(root_dir_inode);
     int inum = tfs_lookup(target, root_dir_inode);
 
     if (inum == -1) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
+        inode_unlock(root_dir_inode);
         return -1;
     }
 
+    // Wait for any write or read in progress on the file before deleting it;
+    // the handles still open on it fail afterwards
+    inode_t *inode = inode_get(inum);
+    inode_wrlock(inode);
+    open_file_table_deleted(inum);
     inode_delete(inum);
-    if (clear_dir_entry(root_dir_inode, target + 1) == -1) {
-        if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-            WARN("failed to unlock mutex: %s", strerror(errno));
-            return -1;
-        }
-        return -1;
-    }
+    inode_unlock(inode);
 
-    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
-        WARN("failed to unlock mutex: %s", strerror(errno));
-        return -1;
-    }
+    int ret = clear_dir_entry(root_dir_inode, target + 1);
+    inode_unlock(root_dir_inode);
 
-    return 0;
+    return ret;
+}
+
+int tfs_unlink(char const *target) {
+    state_op_begin();
+    int ret = unlink_file(target);
+    state_op_end();
+    return ret;
 }
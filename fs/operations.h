@@ -4,6 +4,55 @@
 #include "config.h"
 #include <sys/types.h>
 
+/**
+ * How TécnicoFS simulates the latency of its storage (which is really in
+ * memory) on every access to it.
+ */
+typedef enum {
+    // Busy loop of DELAY iterations, holding the CPU (the default)
+    TFS_LATENCY_SPIN = 0,
+    // No delay, leaving only the CPU and locking cost of each operation
+    TFS_LATENCY_OFF,
+    // Sleep for latency_ns, yielding the CPU to other threads
+    TFS_LATENCY_SLEEP,
+    // Sleep for the access_latency_ns of the kind of access
+    TFS_LATENCY_TABLE,
+} tfs_latency_model_t;
+
+/**
+ * Kinds of storage accesses, for TFS_LATENCY_TABLE.
+ */
+typedef enum {
+    // Inode table
+    TFS_ACCESS_INODE,
+    // Free inode and free block bitmaps
+    TFS_ACCESS_BITMAP,
+    // Directory entries
+    TFS_ACCESS_DIR,
+    // File data blocks
+    TFS_ACCESS_BLOCK,
+    TFS_ACCESS_COUNT,
+} tfs_access_t;
+
+/**
+ * When a TécnicoFS image (see tfs_params.image_path) is written back to its
+ * file. Whatever the policy, changes reach the file once the process exits
+ * (they are in the OS' page cache); syncing only makes them survive a crash of
+ * the OS itself.
+ */
+typedef enum {
+    // Never, leaving it to the OS (the default)
+    TFS_SYNC_NONE = 0,
+    // Every sync_interval_ms, from a background thread
+    TFS_SYNC_PERIODIC,
+    // On every tfs_close, and on tfs_destroy
+    TFS_SYNC_ON_CLOSE,
+    // Every change is logged to a journal (image_path + ".journal") before
+    // the operation making it returns, with concurrent operations sharing
+    // each flush; the image itself is only synced at checkpoints
+    TFS_SYNC_JOURNAL,
+} tfs_sync_policy_t;
+
 /**
  * TécnicoFS parameters.
  */
@@ -13,6 +62,19 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    tfs_latency_model_t latency_model;
+    // Latency of every access, for TFS_LATENCY_SLEEP
+    size_t latency_ns;
+    // Latency of each kind of access, for TFS_LATENCY_TABLE
+    size_t access_latency_ns[TFS_ACCESS_COUNT];
+
+    // File the FS is kept in, memory-mapped; NULL keeps it in (anonymous)
+    // memory, lost on tfs_destroy. An existing image is mounted as it was
+    // left, if made with the same counts and block size
+    char const *image_path;
+    tfs_sync_policy_t sync_policy;
+    size_t sync_interval_ms;
 } tfs_params;
 
 /**
@@ -32,6 +94,13 @@ int tfs_init(tfs_params const *params);
  */
 int tfs_destroy();
 
+/**
+ * Write the FS image back to its file (whatever the sync policy), waiting for
+ * it to reach the storage.
+ * Returns 0 if successful (or if there is no image), -1 otherwise.
+ */
+int tfs_sync();
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -100,6 +169,18 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/**
+ * Shorten an open file, e.g. to drop the end of a write that was cut short.
+ * The blocks past the new end stay with the file, for later writes.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - length: new size of the file, at most its current size
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_truncate(int fhandle, size_t length);
+
 /**
  * Read from an open file, starting at the current offset.
  *
@@ -113,6 +194,41 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Read from an open file, starting at the given offset instead of the current
+ * one (which is left untouched).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: position in the file to read from
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (0
+ * if offset is at or past the end of the file), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Function called by tfs_list for every file, with its name (without the
+ * leading '/') and size, and the argument given to tfs_list. Returning
+ * non-zero stops the listing.
+ */
+typedef int (*tfs_list_fn)(char const *name, size_t size, void *arg);
+
+/**
+ * List the files in TécnicoFS, in a single pass over the root directory.
+ *
+ * Input:
+ *   - fn: function to call for every file, which must not create or delete
+ *     files (the directory is locked meanwhile)
+ *   - arg: argument to pass to fn
+ *
+ * Returns 0 if every file was listed, or the non-zero value fn returned to
+ * stop the listing.
+ */
+int tfs_list(tfs_list_fn fn, void *arg);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
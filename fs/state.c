@@ -1,32 +1,62 @@
 #include "state.h"
 #include "betterassert.h"
+#include "bitmap.h"
+#include "dir_index.h"
+#include "image.h"
+#include "journal.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <time.h>
 #include <unistd.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in primary memory, or in the pages of a memory-mapped image file when
+ * the parameters name one; dir_indexes is rebuilt when an image is mounted).
  */
 static tfs_params fs_params;
+static image_t image;
+static bool mapped; // whether the state below lives in the image
+static journal_t journal;
+static bool journaling; // whether changes are logged (TFS_SYNC_JOURNAL)
 
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static bitmap_t free_inodes;
+static pthread_mutex_t free_inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static dir_index_t *dir_indexes; // in-memory index of each directory inode
 
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static bitmap_t free_blocks;
+static pthread_mutex_t free_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
  * Volatile FS state
  */
 static open_file_entry_t *open_file_table;
 static allocation_state_t *free_open_file_entries;
+static pthread_mutex_t open_file_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Locking
+ *
+ * Each inode has its own rwlock; the root directory's rwlock doubles as the
+ * lock of the directory namespace. Open file entries have a mutex protecting
+ * their offset. The allocation tables above (and the open file table) have one
+ * mutex each, which is only held for the duration of a single
+ * allocation/release.
+ *
+ * Locks are always acquired in this order:
+ *   open file entry -> root directory -> file inode -> allocation tables
+ */
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
@@ -34,6 +64,7 @@ static allocation_state_t *free_open_file_entries;
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define INDEX_ENTRIES (BLOCK_SIZE / sizeof(int))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -49,6 +80,16 @@ static inline bool valid_file_handle(int file_handle) {
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+/**
+ * Largest file size representable with the direct, single indirect and double
+ * indirect block pointers of an inode.
+ */
+size_t state_max_file_size(void) {
+    return (INODE_DIRECT_BLOCKS + INDEX_ENTRIES +
+            INDEX_ENTRIES * INDEX_ENTRIES) *
+           BLOCK_SIZE;
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -68,29 +109,88 @@ size_t state_block_size(void) { return BLOCK_SIZE; }
 static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
 
 /**
- * Artifically delay execution (busy loop).
+ * Sleep for the given number of nanoseconds.
+ *
+ * Sleeps are rounded up by the thread's timer slack (50 us by default), far
+ * more than a simulated access takes, so the slack is set to the minimum the
+ * first time a thread sleeps here.
+ */
+static void sleep_ns(size_t ns) {
+    static _Thread_local bool slack_set;
+    if (!slack_set) {
+        prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+        slack_set = true;
+    }
+
+    struct timespec left = {
+        .tv_sec = (time_t)(ns / 1000000000),
+        .tv_nsec = (long)(ns % 1000000000),
+    };
+    while (nanosleep(&left, &left) == -1) {
+    }
+}
+
+/**
+ * Artifically delay execution.
  *
  * Auxiliary function to insert a delay.
  * Used in accesses to persistent FS state as a way of emulating access
- * latencies as if such data structures were really stored in secondary memory.
+ * latencies as if such data structures were really stored in secondary memory,
+ * following the latency model of the FS parameters.
+ *
+ * Input:
+ *   - access: kind of state accessed
  */
-static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
-        touch_all_memory();
+static void insert_delay(tfs_access_t access) {
+    switch (fs_params.latency_model) {
+    case TFS_LATENCY_SPIN:
+        for (int i = 0; i < DELAY; i++) {
+            touch_all_memory();
+        }
+        break;
+    case TFS_LATENCY_SLEEP:
+        if (fs_params.latency_ns > 0) {
+            sleep_ns(fs_params.latency_ns);
+        }
+        break;
+    case TFS_LATENCY_TABLE:
+        if (access < TFS_ACCESS_COUNT &&
+            fs_params.access_latency_ns[access] > 0) {
+            sleep_ns(fs_params.access_latency_ns[access]);
+        }
+        break;
+    case TFS_LATENCY_OFF:
+    default:
+        break;
     }
 }
 
+static void mutex_lock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_lock(mutex) == 0, "failed to lock mutex");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex) {
+    ALWAYS_ASSERT(pthread_mutex_unlock(mutex) == 0, "failed to unlock mutex");
+}
+
+static int dir_indexes_load(void);
+
 /**
  * Initialize FS state.
  *
+ * With an image path in the parameters, the persistent state is mapped from
+ * the image file; an image that already holds a FS is mounted as it was left.
+ *
  * Input:
  *   - params: TécnicoFS parameters
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if a new FS was created (without a root directory yet), 1 if an
+ * existing image was mounted, -1 otherwise.
  *
  * Possible errors:
  *   - TFS already initialized.
  *   - malloc failure when allocating TFS structures.
+ *   - The image can't be mapped, or doesn't match the parameters.
  */
 int state_init(tfs_params params) {
     fs_params = params;
@@ -99,32 +199,81 @@ int state_init(tfs_params params) {
         return -1; // already initialized
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
+    bool fresh = true;
+    if (fs_params.image_path != NULL) {
+        if (image_open(&image, &fs_params) != 0) {
+            return -1;
+        }
+        mapped = true;
+        inode_table = (inode_t *)image.inodes;
+        fs_data = image.data;
+
+        // The journal of a new image can only be left over from another one
+        char journal_path[PATH_MAX];
+        snprintf(journal_path, sizeof(journal_path), "%s.journal",
+                 fs_params.image_path);
+        if (image.fresh ? unlink(journal_path) == -1 && errno != ENOENT
+                        : journal_replay(journal_path, &image) != 0) {
+            WARN("Failed to replay journal %s", journal_path);
+            return -1;
+        }
+        if (fs_params.sync_policy == TFS_SYNC_JOURNAL) {
+            if (journal_open(&journal, journal_path, &image) != 0) {
+                return -1;
+            }
+            journaling = true;
+        }
+
+        // An image without a root directory (a new one, or one that never
+        // got past tfs_init) is made anew
+        bitmap_attach(&free_inodes, INODE_TABLE_SIZE, image.inode_words,
+                      false);
+        fresh = !bitmap_test(&free_inodes, ROOT_DIR_INUM);
+        bitmap_attach(&free_inodes, INODE_TABLE_SIZE, image.inode_words,
+                      fresh);
+        bitmap_attach(&free_blocks, DATA_BLOCKS, image.block_words, fresh);
+        if (fresh) {
+            // Cleared in the image's state, which the file only gets through
+            // the journal
+            state_log(image.inode_words,
+                      bitmap_words(INODE_TABLE_SIZE) * sizeof(uint64_t));
+            state_log(image.block_words,
+                      bitmap_words(DATA_BLOCKS) * sizeof(uint64_t));
+        }
+    } else {
+        inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
+        fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
+        if (!inode_table || !fs_data ||
+            bitmap_init(&free_inodes, INODE_TABLE_SIZE) != 0 ||
+            bitmap_init(&free_blocks, DATA_BLOCKS) != 0) {
+            return -1; // allocation failed
+        }
+    }
+
+    dir_indexes = calloc(INODE_TABLE_SIZE, sizeof(dir_index_t));
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
     free_open_file_entries =
         malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+    if (!dir_indexes || !open_file_table || !free_open_file_entries) {
         return -1; // allocation failed
     }
 
+    // The locks of a mounted image hold whatever the last process left there
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
-    }
-
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+        pthread_rwlock_init(&inode_table[i].i_lock, NULL);
     }
 
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         free_open_file_entries[i] = FREE;
+        pthread_mutex_init(&open_file_table[i].of_lock, NULL);
     }
 
-    return 0;
+    if (!fresh && dir_indexes_load() != 0) {
+        return -1;
+    }
+
+    return fresh ? 0 : 1;
 }
 
 /**
@@ -133,23 +282,108 @@ int state_init(tfs_params params) {
  * Returns 0 if succesful, -1 otherwise.
  */
 int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
+    if (inode_table != NULL) {
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            pthread_rwlock_destroy(&inode_table[i].i_lock);
+        }
+    }
+    if (dir_indexes != NULL) {
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            dir_index_destroy(&dir_indexes[i]);
+        }
+    }
+    if (open_file_table != NULL) {
+        for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+            pthread_mutex_destroy(&open_file_table[i].of_lock);
+        }
+    }
+
+    if (journaling) {
+        journal_close(&journal);
+        journaling = false;
+    }
+    if (mapped) {
+        image_close(&image);
+        mapped = false;
+    } else {
+        free(inode_table);
+        free(fs_data);
+    }
+    free(dir_indexes);
+    bitmap_destroy(&free_inodes);
+    bitmap_destroy(&free_blocks);
     free(open_file_table);
     free(free_open_file_entries);
 
     inode_table = NULL;
-    freeinode_ts = NULL;
+    dir_indexes = NULL;
     fs_data = NULL;
-    free_blocks = NULL;
     open_file_table = NULL;
     free_open_file_entries = NULL;
 
     return 0;
 }
 
+/**
+ * Write the image (if any) back to its file.
+ *
+ * Input:
+ *   - on_close: whether a file is being closed, which only syncs the image
+ *     under TFS_SYNC_ON_CLOSE
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_sync(bool on_close) {
+    if (!mapped ||
+        (on_close && fs_params.sync_policy != TFS_SYNC_ON_CLOSE)) {
+        return 0;
+    }
+    return image_sync(&image);
+}
+
+/**
+ * Log a change just made to the persistent state, when journaling.
+ *
+ * Input:
+ *   - at: first byte changed (in the inode table, a bitmap or a data block)
+ *   - len: number of bytes changed
+ */
+void state_log(void const *at, size_t len) {
+    if (journaling) {
+        journal_log(&journal, at, len);
+    }
+}
+
+/**
+ * Log the fields of an inode (all but its lock), when journaling.
+ */
+static void inode_log(inode_t const *inode) {
+    state_log(inode, offsetof(inode_t, i_lock));
+}
+
+/**
+ * Start an operation that changes the persistent state.
+ */
+void state_op_begin(void) {
+    if (journaling) {
+        journal_begin(&journal);
+    }
+}
+
+/**
+ * End an operation started with state_op_begin, returning once its changes
+ * are durable (when journaling).
+ *
+ * Must be called holding no inode locks, so other operations can join the
+ * flush.
+ */
+void state_op_end(void) {
+    if (journaling) {
+        journal_end(&journal);
+        journal_commit(&journal);
+    }
+}
+
 /**
  * (Try to) Allocate a new inode in the inode table, without initializing its
  * data.
@@ -160,31 +394,44 @@ int state_destroy(void) {
  *   - No free slots in inode table.
  */
 static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
+    // simulate storage access delay (to free_inodes). The search starts at
+    // the bitmap's hint, so only the bitmap block holding the first free entry
+    // needs to be read
+    insert_delay(TFS_ACCESS_BITMAP);
+
+    // Finds (and takes) the first free entry in inode table
+    mutex_lock(&free_inodes_lock);
+    ssize_t inumber = bitmap_alloc(&free_inodes);
+    if (inumber != -1) {
+        state_log(bitmap_word(&free_inodes, (size_t)inumber),
+                  sizeof(uint64_t));
+    }
+    mutex_unlock(&free_inodes_lock);
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+    // -1 if there are no free inodes
+    return (int)inumber;
+}
 
-            return (int)inumber;
-        }
+/**
+ * Mark every block pointer of an inode as unused.
+ */
+static void inode_clear_blocks(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        inode->i_data_blocks[i] = -1;
     }
-
-    // no free inodes
-    return -1;
+    inode->i_indirect_block = -1;
+    inode->i_double_indirect_block = -1;
 }
 
+static int dir_add_block(inode_t *inode);
+
 /**
  * Create a new inode in the inode table.
  *
  * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Directories will have their first data block allocated and initialized, with
+ * i_size set to BLOCK_SIZE. Regular files will not have any data block
+ * allocated (i_size will be set to 0, every block pointer to -1).
  *
  * Input:
  *   - i_type: the type of the node (file or directory)
@@ -202,44 +449,31 @@ int inode_create(inode_type i_type) {
     }
 
     inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
+    insert_delay(TFS_ACCESS_INODE); // simulate storage access delay (to inode)
 
     inode->i_node_type = i_type;
+    inode_clear_blocks(inode);
     switch (i_type) {
     case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
+        // Initializes directory (filling its first block with empty entries,
+        // labeled with inumber==-1) and its in-memory index
+        inode->i_size = 0;
+        if (dir_add_block(inode) == -1 ||
+            dir_index_init(&dir_indexes[inumber]) == -1) {
             // run regular deletion process
             inode_delete(inumber);
             return -1;
         }
-
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
     } break;
     case T_FILE:
         // In case of a new file, simply sets its size to 0
         inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
         break;
     default:
         PANIC("inode_create: unknown file type");
     }
 
+    inode_log(inode);
     return inumber;
 }
 
@@ -250,20 +484,26 @@ int inode_create(inode_type i_type) {
  *   - inumber: inode's number
  */
 void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+    // simulate storage access delay (to inode and free_inodes)
+    insert_delay(TFS_ACCESS_INODE);
+    insert_delay(TFS_ACCESS_BITMAP);
 
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
+    mutex_lock(&free_inodes_lock);
+    ALWAYS_ASSERT(bitmap_test(&free_inodes, (size_t)inumber),
                   "inode_delete: inode already freed");
+    mutex_unlock(&free_inodes_lock);
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+    inode_truncate(&inode_table[inumber]);
+    if (inode_table[inumber].i_node_type == T_DIRECTORY) {
+        dir_index_destroy(&dir_indexes[inumber]);
     }
 
-    freeinode_ts[inumber] = FREE;
+    mutex_lock(&free_inodes_lock);
+    bitmap_free(&free_inodes, (size_t)inumber);
+    state_log(bitmap_word(&free_inodes, (size_t)inumber), sizeof(uint64_t));
+    mutex_unlock(&free_inodes_lock);
 }
 
 /**
@@ -277,10 +517,279 @@ void inode_delete(int inumber) {
 inode_t *inode_get(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
 
-    insert_delay(); // simulate storage access delay to inode
+    insert_delay(TFS_ACCESS_INODE); // simulate storage access delay to inode
     return &inode_table[inumber];
 }
 
+/**
+ * Obtain the entry at a given index of an index block, allocating the index
+ * block itself (with every entry set to -1) if needed.
+ *
+ * Input:
+ *   - index_block: pointer to the block pointer of the index block
+ *   - i: entry index inside the index block
+ *   - alloc: whether a missing index block may be allocated
+ *
+ * Returns a pointer to the entry, or NULL if the index block does not exist
+ * and could not (or may not) be allocated.
+ */
+static int *index_block_entry(int *index_block, size_t i, bool alloc) {
+    if (*index_block == -1) {
+        if (!alloc) {
+            return NULL;
+        }
+
+        int b = data_block_alloc();
+        if (b == -1) {
+            return NULL; // no free data blocks
+        }
+
+        int *entries = (int *)data_block_get(b);
+        for (size_t j = 0; j < INDEX_ENTRIES; j++) {
+            entries[j] = -1;
+        }
+        state_log(entries, BLOCK_SIZE);
+        *index_block = b;
+        state_log(index_block, sizeof(int));
+    }
+
+    int *entries = (int *)data_block_get(*index_block);
+    ALWAYS_ASSERT(entries != NULL,
+                  "index_block_entry: index block freed while in use");
+    return &entries[i];
+}
+
+/**
+ * Obtain the number of the data block holding the block_index-th block of an
+ * inode's contents.
+ *
+ * The first INODE_DIRECT_BLOCKS blocks are referenced directly by the inode,
+ * the next INDEX_ENTRIES through the single indirect block, and the remaining
+ * ones through the double indirect block.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - block_index: index of the block inside the file (offset / BLOCK_SIZE)
+ *   - alloc: whether missing data (and index) blocks should be allocated
+ *
+ * Returns the block number, or -1 if the block does not exist and could not
+ * (or may not) be allocated.
+ *
+ * Possible errors:
+ *   - block_index beyond the maximum file size.
+ *   - No free data blocks.
+ */
+int inode_data_block(inode_t *inode, size_t block_index, bool alloc) {
+    int *slot;
+
+    if (block_index < INODE_DIRECT_BLOCKS) {
+        slot = &inode->i_data_blocks[block_index];
+    } else if (block_index < INODE_DIRECT_BLOCKS + INDEX_ENTRIES) {
+        slot = index_block_entry(&inode->i_indirect_block,
+                                 block_index - INODE_DIRECT_BLOCKS, alloc);
+    } else if (block_index < INODE_DIRECT_BLOCKS + INDEX_ENTRIES +
+                                 INDEX_ENTRIES * INDEX_ENTRIES) {
+        size_t i = block_index - INODE_DIRECT_BLOCKS - INDEX_ENTRIES;
+        int *inner = index_block_entry(&inode->i_double_indirect_block,
+                                       i / INDEX_ENTRIES, alloc);
+        if (inner == NULL) {
+            return -1;
+        }
+        slot = index_block_entry(inner, i % INDEX_ENTRIES, alloc);
+    } else {
+        return -1; // beyond the maximum file size
+    }
+
+    if (slot == NULL) {
+        return -1;
+    }
+
+    if (*slot == -1 && alloc) {
+        *slot = data_block_alloc();
+        state_log(slot, sizeof(int));
+    }
+
+    return *slot;
+}
+
+/**
+ * Free every block referenced by an index block, and the index block itself.
+ *
+ * Input:
+ *   - index_block: block number of the index block (may be -1)
+ *   - depth: 1 for an index block pointing to data blocks, 2 for one pointing
+ *     to other index blocks
+ */
+static void index_block_free(int index_block, int depth) {
+    if (index_block == -1) {
+        return;
+    }
+
+    int const *entries = (int const *)data_block_get(index_block);
+    ALWAYS_ASSERT(entries != NULL,
+                  "index_block_free: index block freed while in use");
+
+    for (size_t i = 0; i < INDEX_ENTRIES; i++) {
+        if (entries[i] == -1) {
+            continue;
+        }
+
+        if (depth > 1) {
+            index_block_free(entries[i], depth - 1);
+        } else {
+            data_block_free(entries[i]);
+        }
+    }
+
+    data_block_free(index_block);
+}
+
+/**
+ * Release every data block of an inode and set its size to 0.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+void inode_truncate(inode_t *inode) {
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->i_data_blocks[i] != -1) {
+            data_block_free(inode->i_data_blocks[i]);
+        }
+    }
+    index_block_free(inode->i_indirect_block, 1);
+    index_block_free(inode->i_double_indirect_block, 2);
+
+    inode_clear_blocks(inode);
+    inode->i_size = 0;
+    inode_log(inode);
+}
+
+/**
+ * Lock an inode for reading (shared with other readers).
+ */
+void inode_rdlock(inode_t *inode) {
+    ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode->i_lock) == 0,
+                  "inode_rdlock: failed to lock inode");
+}
+
+/**
+ * Lock an inode for writing (exclusive).
+ */
+void inode_wrlock(inode_t *inode) {
+    ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode->i_lock) == 0,
+                  "inode_wrlock: failed to lock inode");
+}
+
+/**
+ * Release a lock taken with inode_rdlock or inode_wrlock.
+ */
+void inode_unlock(inode_t *inode) {
+    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode->i_lock) == 0,
+                  "inode_unlock: failed to unlock inode");
+}
+
+/**
+ * Obtain the in-memory index of a directory inode.
+ */
+static dir_index_t *dir_index_of(inode_t const *inode) {
+    return &dir_indexes[inode - inode_table];
+}
+
+/**
+ * Append an empty block of entries (labeled with inumber==-1) to a directory.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ *   - Directory already has the maximum file size.
+ */
+static int dir_add_block(inode_t *inode) {
+    int b = inode_data_block(inode, inode->i_size / BLOCK_SIZE, true);
+    if (b == -1) {
+        return -1;
+    }
+
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_add_block: data block freed while in use");
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    state_log(dir_entry, BLOCK_SIZE);
+
+    inode->i_size += BLOCK_SIZE;
+    state_log(&inode->i_size, sizeof(size_t));
+    return 0;
+}
+
+/**
+ * Obtain a pointer to the entry stored in a given slot of a directory (slots
+ * are numbered consecutively across the directory's blocks).
+ */
+static dir_entry_t *dir_entry_get(inode_t *inode, int slot) {
+    int b = inode_data_block(inode, (size_t)slot / MAX_DIR_ENTRIES, false);
+    ALWAYS_ASSERT(b != -1, "dir_entry_get: directory block missing");
+
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+    ALWAYS_ASSERT(dir_entry != NULL,
+                  "dir_entry_get: data block freed while in use");
+
+    return &dir_entry[(size_t)slot % MAX_DIR_ENTRIES];
+}
+
+/**
+ * Rebuild the in-memory index of every directory of a mounted image from the
+ * entries in its blocks.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure when growing an index.
+ */
+static int dir_indexes_load(void) {
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (!bitmap_test(&free_inodes, i) ||
+            inode->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+
+        dir_index_t *index = &dir_indexes[i];
+        if (dir_index_init(index) == -1) {
+            return -1;
+        }
+
+        // Takes every slot of the directory's blocks (in order, as none was
+        // released), then gives back the empty ones
+        size_t n_blocks = inode->i_size / BLOCK_SIZE;
+        for (size_t slot = 0; slot < n_blocks * MAX_DIR_ENTRIES; slot++) {
+            dir_index_take_slot(index);
+        }
+
+        for (size_t b = 0; b < n_blocks; b++) {
+            int block = inode_data_block(inode, b, false);
+            ALWAYS_ASSERT(block != -1, "dir_indexes_load: block missing");
+            dir_entry_t const *entries =
+                (dir_entry_t const *)data_block_get(block);
+
+            for (size_t e = 0; e < MAX_DIR_ENTRIES; e++) {
+                int slot = (int)(b * MAX_DIR_ENTRIES + e);
+                int ret = entries[e].d_inumber == -1
+                              ? dir_index_release_slot(index, slot)
+                              : dir_index_insert(index, entries[e].d_name,
+                                                 entries[e].d_inumber, slot);
+                if (ret == -1) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Clear the directory entry associated with a sub file.
  *
@@ -295,24 +804,26 @@ inode_t *inode_get(int inumber) {
  *   - Directory does not contain an entry for sub_name.
  */
 int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
+    insert_delay(TFS_ACCESS_DIR);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
-        }
+    // The index tells which slot holds the entry
+    dir_index_t *index = dir_index_of(inode);
+    int slot = dir_index_remove(index, sub_name);
+    if (slot == -1) {
+        return -1; // sub_name not found
     }
-    return -1; // sub_name not found
+
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot);
+    dir_entry->d_inumber = -1;
+    memset(dir_entry->d_name, 0, MAX_FILE_NAME);
+    state_log(dir_entry, sizeof(dir_entry_t));
+
+    // If the slot can't be remembered, it is simply never reused
+    dir_index_release_slot(index, slot);
+    return 0;
 }
 
 /**
@@ -328,35 +839,46 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Directory already contains an entry for sub_name.
+ *   - Directory is full and can't grow (no free data blocks).
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
         return -1; // invalid sub_name
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to the directory's entries
+    insert_delay(TFS_ACCESS_DIR);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    dir_index_t *index = dir_index_of(inode);
+    if (dir_index_find(index, sub_name) != -1) {
+        return -1; // already exists
+    }
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    // Picks a free slot, growing the directory by one block if every slot of
+    // its current blocks is in use
+    int slot = dir_index_take_slot(index);
+    if ((size_t)slot >= inode->i_size / BLOCK_SIZE * MAX_DIR_ENTRIES &&
+        dir_add_block(inode) == -1) {
+        dir_index_release_slot(index, slot);
+        return -1; // no space for entry
+    }
 
-            return 0;
-        }
+    if (dir_index_insert(index, sub_name, sub_inumber, slot) == -1) {
+        dir_index_release_slot(index, slot);
+        return -1;
     }
 
-    return -1; // no space for entry
+    dir_entry_t *dir_entry = dir_entry_get(inode, slot);
+    dir_entry->d_inumber = sub_inumber;
+    strncpy(dir_entry->d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    state_log(dir_entry, sizeof(dir_entry_t));
+
+    return 0;
 }
 
 /**
@@ -376,27 +898,52 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
     ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
     ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
+    // simulate storage access delay to the directory's entries
+    insert_delay(TFS_ACCESS_DIR);
     if (inode->i_node_type != T_DIRECTORY) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    // The in-memory index answers without scanning the directory's blocks
+    return dir_index_find(dir_index_of(inode), sub_name);
+}
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+/**
+ * Call a function for every entry of a directory, in slot order.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - fn: function to call with the name and inumber of each entry (and arg)
+ *   - arg: argument to pass to fn
+ *
+ * Returns 0 if fn was called for every entry, -1 if inode is not a directory,
+ * or the non-zero value fn returned to stop the iteration.
+ */
+int dir_for_each(inode_t *inode,
+                 int (*fn)(char const *sub_name, int sub_inumber, void *arg),
+                 void *arg) {
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
+    for (size_t b = 0; b < inode->i_size / BLOCK_SIZE; b++) {
+        int block = inode_data_block(inode, b, false);
+        ALWAYS_ASSERT(block != -1, "dir_for_each: directory block missing");
+        // One access per block of entries
+        dir_entry_t const *entries = (dir_entry_t const *)data_block_get(block);
+
+        for (size_t e = 0; e < MAX_DIR_ENTRIES; e++) {
+            if (entries[e].d_inumber == -1) {
+                continue;
+            }
+            int ret = fn(entries[e].d_name, entries[e].d_inumber, arg);
+            if (ret != 0) {
+                return ret;
+            }
         }
+    }
 
-    return -1; // entry not found
+    return 0;
 }
 
 /**
@@ -408,18 +955,18 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
  *   - No free data blocks.
  */
 int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
-        }
-
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-
-            return (int)i;
-        }
+    // simulate storage access delay to free_blocks
+    insert_delay(TFS_ACCESS_BITMAP);
+
+    mutex_lock(&free_blocks_lock);
+    ssize_t block_number = bitmap_alloc(&free_blocks);
+    if (block_number != -1) {
+        state_log(bitmap_word(&free_blocks, (size_t)block_number),
+                  sizeof(uint64_t));
     }
-    return -1;
+    mutex_unlock(&free_blocks_lock);
+
+    return (int)block_number;
 }
 
 /**
@@ -432,9 +979,14 @@ void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    // simulate storage access delay to free_blocks
+    insert_delay(TFS_ACCESS_BITMAP);
 
-    free_blocks[block_number] = FREE;
+    mutex_lock(&free_blocks_lock);
+    bitmap_free(&free_blocks, (size_t)block_number);
+    state_log(bitmap_word(&free_blocks, (size_t)block_number),
+              sizeof(uint64_t));
+    mutex_unlock(&free_blocks_lock);
 }
 
 /**
@@ -449,7 +1001,7 @@ void *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
+    insert_delay(TFS_ACCESS_BLOCK); // simulate storage access delay to block
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
@@ -466,15 +1018,19 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
+    mutex_lock(&open_file_table_lock);
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
+            open_file_table[i].of_deleted = false;
 
+            mutex_unlock(&open_file_table_lock);
             return i;
         }
     }
+    mutex_unlock(&open_file_table_lock);
 
     return -1;
 }
@@ -489,10 +1045,12 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(valid_file_handle(fhandle),
                   "remove_from_open_file_table: file handle must be valid");
 
+    mutex_lock(&open_file_table_lock);
     ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
                   "remove_from_open_file_table: file handle must be taken");
 
     free_open_file_entries[fhandle] = FREE;
+    mutex_unlock(&open_file_table_lock);
 }
 
 /**
@@ -509,9 +1067,33 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    mutex_lock(&open_file_table_lock);
+    bool taken = free_open_file_entries[fhandle] == TAKEN;
+    mutex_unlock(&open_file_table_lock);
+
+    if (!taken) {
         return NULL;
     }
 
     return &open_file_table[fhandle];
 }
+
+/**
+ * Mark the open file entries of a file being deleted, so their handles no
+ * longer reach its inode (which a new file may get).
+ *
+ * The caller must hold the inode's write lock, and the root directory's.
+ *
+ * Input:
+ *   - inumber: inode number of the file
+ */
+void open_file_table_deleted(int inumber) {
+    mutex_lock(&open_file_table_lock);
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        if (free_open_file_entries[i] == TAKEN &&
+            open_file_table[i].of_inumber == inumber) {
+            open_file_table[i].of_deleted = true;
+        }
+    }
+    mutex_unlock(&open_file_table_lock);
+}
@@ -4,6 +4,7 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,7 +27,12 @@ typedef struct {
     inode_type i_node_type;
 
     size_t i_size;
-    int i_data_block;
+    int i_data_blocks[INODE_DIRECT_BLOCKS];
+    int i_indirect_block;
+    int i_double_indirect_block;
+
+    // protects every field above and the inode's data blocks
+    pthread_rwlock_t i_lock;
 
     // in a more complete FS, more fields could exist here
 } inode_t;
@@ -39,20 +45,39 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    // Set once the file is deleted (with its inode's write lock held): the
+    // inode may be reused by another file, so the handle fails from then on
+    bool of_deleted;
+
+    // protects of_offset
+    pthread_mutex_t of_lock;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
+int state_sync(bool on_close);
+void state_log(void const *at, size_t len);
+void state_op_begin(void);
+void state_op_end(void);
 
 size_t state_block_size(void);
+size_t state_max_file_size(void);
 
 int inode_create(inode_type n_type);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+int inode_data_block(inode_t *inode, size_t block_index, bool alloc);
+void inode_truncate(inode_t *inode);
+void inode_rdlock(inode_t *inode);
+void inode_wrlock(inode_t *inode);
+void inode_unlock(inode_t *inode);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_for_each(inode_t *inode,
+                 int (*fn)(char const *sub_name, int sub_inumber, void *arg),
+                 void *arg);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
@@ -61,5 +86,6 @@ void *data_block_get(int block_number);
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
+void open_file_table_deleted(int inumber);
 
 #endif // STATE_H
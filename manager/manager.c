@@ -1,9 +1,12 @@
+#include "frame.h"
 #include "list.h"
 #include "logging.h"
 #include "pipes.h"
 #include "protocol.h"
+#include "sockets.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +15,8 @@
 #include <unistd.h>
 
 static char *registerPipeName;
+// -1 if the request went through mbroker's socket, in which case clientPipe is
+// the connection to it
 static int registerPipe;
 static char *clientPipeName;
 static int clientPipe;
@@ -22,14 +27,17 @@ static void print_usage() {
             "usage: \n"
             "   manager <register_pipe_name> <pipe_name> create <box_name>\n"
             "   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
-            "   manager <register_pipe_name> <pipe_name> list\n");
+            "   manager <register_pipe_name> <pipe_name> list\n"
+            "   manager <register_pipe_name> <pipe_name> stats\n");
 }
 
 void close_manager() {
     LOG("Closing manager...");
-    pipe_close(registerPipe);
+    if (registerPipe != -1) {
+        pipe_close(registerPipe);
+        pipe_destroy(clientPipeName);
+    }
     pipe_close(clientPipe);
-    pipe_destroy(clientPipeName);
 }
 
 void handle_response(packet_t response) {
@@ -54,15 +62,19 @@ void handle_response(packet_t response) {
 void send_packet(packet_t packet) {
     // Sends a packet to the server 
 
-    pipe_create(clientPipeName);
-
     LOG("Registering pipe: %s", clientPipeName);
-    registerPipe = pipe_open(registerPipeName, O_WRONLY);
-    pipe_write(registerPipe, &packet);
+    clientPipe = socket_register_client(registerPipeName, clientPipeName,
+                                        &packet, O_RDONLY, &registerPipe);
 
+    // Read through a frame reader, which takes a connection's answer whole
     LOG("Waiting for confirmation");
-    clientPipe = pipe_open(clientPipeName, O_RDONLY);
-    handle_response(pipe_read(clientPipe));
+    static frame_reader_t reader;
+    frame_reader_init(&reader, clientPipe);
+    packet_t response;
+    if (frame_read(&reader, &response) <= 0) {
+        memset(&response, 0, sizeof(response));
+    }
+    handle_response(response);
 }
 
 int createBox(char *boxName) {
@@ -109,21 +121,20 @@ int listBoxes() {
     strcpy(payload.client_pipe, clientPipeName);
     packet.payload.list_box_data = payload;
 
-    pipe_create(clientPipeName);
-
     LOG("Registering pipe: %s", clientPipeName);
 
-    // Opens pipe and sends packet
-    registerPipe = pipe_open(registerPipeName, O_WRONLY);
-    pipe_write(registerPipe, &packet);
+    // Sends the packet, and opens the pipe (or connection) for the answer
+    clientPipe = socket_register_client(registerPipeName, clientPipeName,
+                                        &packet, O_RDONLY, &registerPipe);
 
     LOG("Waiting for list of boxes");
-    clientPipe = pipe_open(clientPipeName, O_RDONLY);
     list_init(&list);
 
     // Read from client pipe
+    static frame_reader_t reader;
+    frame_reader_init(&reader, clientPipe);
     packet_t response;
-    while (read(clientPipe, &response, sizeof(packet_t)) > 0) {
+    while (frame_read(&reader, &response) > 0) {
         mailbox_data_t data = response.payload.mailbox_data;
 
         // If there are no boxes
@@ -156,6 +167,70 @@ int listBoxes() {
     return 0;
 }
 
+/**
+ * Prints an entry of the broker's stats.
+ */
+static void print_stats(stats_data_t const *data) {
+    uint64_t const *v = data->values;
+    switch (data->kind) {
+    case STATS_COUNTER:
+        fprintf(stdout, "%s %" PRIu64 "\n", data->name, v[0]);
+        break;
+    case STATS_LATENCY:
+        fprintf(stdout,
+                "%s count %" PRIu64 " mean %" PRIu64 " min %" PRIu64
+                " p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64
+                " p999 %" PRIu64 " max %" PRIu64 "\n",
+                data->name, v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        break;
+    case STATS_BOX:
+        fprintf(stdout,
+                "box %s messages_in %" PRIu64 " messages_out %" PRIu64
+                " bytes_in %" PRIu64 " bytes_out %" PRIu64
+                " publishers %" PRIu64 " subscribers %" PRIu64 "\n",
+                data->name, v[0], v[1], v[2], v[3], v[4], v[5]);
+        break;
+    default:
+        WARN("Unknown stats entry %d", data->kind);
+        break;
+    }
+}
+
+int showStats() {
+    // Shows the broker's counters and latencies, and the counters of each box
+
+    packet_t packet;
+    packet.opcode = STATS;
+    list_box_data_t payload;
+    strcpy(payload.client_pipe, clientPipeName);
+    packet.payload.list_box_data = payload;
+
+    LOG("Registering pipe: %s", clientPipeName);
+
+    clientPipe = socket_register_client(registerPipeName, clientPipeName,
+                                        &packet, O_RDONLY, &registerPipe);
+
+    LOG("Waiting for stats");
+
+    static frame_reader_t reader;
+    frame_reader_init(&reader, clientPipe);
+    packet_t response;
+    while (frame_read(&reader, &response) > 0) {
+        if (response.opcode != STATS_ANSWER) {
+            WARN("Unexpected response from server");
+            break;
+        }
+        stats_data_t data = response.payload.stats_data;
+        if (data.last == 1) {
+            break;
+        }
+        print_stats(&data);
+    }
+
+    close_manager();
+    return 0;
+}
+
 int main(int argc, char **argv) {
     char *operation;
 
@@ -200,6 +275,10 @@ int main(int argc, char **argv) {
     // If we are listing boxes 
     else if (strcmp(operation, "list") == 0) {
         listBoxes();
+    }
+    // If we are asking for the broker's stats
+    else if (strcmp(operation, "stats") == 0) {
+        showStats();
     } else {
         print_usage();
         return EXIT_FAILURE;
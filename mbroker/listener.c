@@ -0,0 +1,143 @@
+#define _GNU_SOURCE // accept4
+#include "listener.h"
+#include "frame.h"
+#include "logging.h"
+#include "sockets.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Maximum number of epoll events handled per epoll_wait
+#define MAX_EVENTS 64
+
+static int listen_fd;
+static int epoll_fd;
+static listener_callback_t callback;
+static pthread_t thread;
+
+/**
+ * Returns whether a packet can start a connection.
+ */
+static bool is_request(uint8_t opcode) {
+    switch (opcode) {
+    case REGISTER_PUBLISHER:
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_PUBLISHER_SHM:
+    case REGISTER_SUBSCRIBER_SHM:
+    case CREATE_MAILBOX:
+    case REMOVE_MAILBOX:
+    case LIST_MAILBOXES:
+    case STATS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Accepts every client waiting, to wait for their first packet.
+ */
+static void accept_clients() {
+    while (true) {
+        int connection =
+            accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                WARN("Failed to accept client: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = connection};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection, &event) == -1) {
+            WARN("Failed to watch client: %s", strerror(errno));
+            close(connection);
+        }
+    }
+}
+
+/**
+ * Reads a connection's first packet, handing the connection over with it, or
+ * closing it if it isn't a valid request.
+ */
+static void read_request(int connection) {
+    // A record holding more than a frame is cut short, and rejected below
+    char record[FRAME_MAX_SIZE];
+    ssize_t size;
+    do {
+        size = read(connection, record, sizeof(record));
+    } while (size < 0 && errno == EINTR);
+    if (size < 0 && errno == EAGAIN) {
+        return;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection, NULL);
+
+    frame_header_t header;
+    char const *payload;
+    if (size <= 0 ||
+        frame_parse(record, (size_t)size, &header, &payload) != size ||
+        !is_request(header.opcode)) {
+        if (size != 0) {
+            WARN("Invalid request from client");
+        }
+        close(connection);
+        return;
+    }
+
+    packet_t packet;
+    frame_decode(&header, payload, &packet);
+    LOG("Received packet with opcode %d", packet.opcode);
+    callback(&packet, connection);
+}
+
+static void *listener_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PANIC("epoll_wait failed: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == listen_fd) {
+                accept_clients();
+            } else {
+                read_request(events[i].data.fd);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int listener_start(char const *path, listener_callback_t on_request) {
+    callback = on_request;
+
+    listen_fd = socket_listen(path);
+    if (listen_fd == -1) {
+        WARN("Failed to listen on %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = listen_fd};
+    if (epoll_fd == -1 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1 ||
+        pthread_create(&thread, NULL, listener_thread, NULL) != 0) {
+        WARN("Failed to start listener");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __MBROKER_LISTENER_H__
+#define __MBROKER_LISTENER_H__
+
+#include "protocol.h"
+
+/**
+ * Called with the first packet of a connection (a registration or manager
+ * request), and the connection, which it takes over.
+ */
+typedef void (*listener_callback_t)(packet_t const *packet, int connection);
+
+/**
+ * Starts accepting clients on a Unix socket at path (see sockets.h), on a
+ * thread of its own. The thread waits in epoll for the connections' first
+ * packets too, so a client that is slow to send it doesn't hold up anybody
+ * else.
+ *
+ * Input:
+ *   - path: where to create the socket
+ *   - on_request: called (on the listener's thread) with every connection's
+ *     first packet; connections that send anything else are closed
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int listener_start(char const *path, listener_callback_t on_request);
+
+#endif // __MBROKER_LISTENER_H__
@@ -1,43 +1,60 @@
 #include "../producer-consumer/producer-consumer.h"
-#include "list.h"
+#include "frame.h"
+#include "listener.h"
 #include "logging.h"
+#include "metrics.h"
 #include "operations.h"
 #include "pipes.h"
 #include "protocol.h"
 #include "pthread.h"
+#include "registry.h"
+#include "restore.h"
+#include "session.h"
+#include "shm_ring.h"
+#include "sockets.h"
 #include "utils.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+// Maximum number of packets read from the register pipe (and handed to the
+// workers) at once
+#define REGISTER_BATCH 64
+
+// A packet waiting in the queue for a worker, when it was queued, and the
+// connection it came through (-1 if it came through the register pipe)
+typedef struct {
+    uint64_t queued;
+    packet_t packet;
+    int connection;
+} queued_packet_t;
+
 static int registerPipe;
 static char *registerPipeName;
+static char const *socketName;
+static reactor_engine_t ioEngine = REACTOR_EPOLL;
 static size_t maxSessions;
-static List list;
+static box_registry_t registry;
 pthread_t *workers;
 pc_queue_t queue;
 
-const tfs_params params = {
-    .max_inode_count = 64,
-    .max_block_count = 1024,
+tfs_params params = {
+    .max_inode_count = 4096,
+    .max_block_count = 16384,
     .max_open_files_count = MAX_FILES,
     .block_size = 1024,
 };
 
-ssize_t try_read(int fd, void *buf, size_t count) {
-    ssize_t bytes_read;
-    do {
-        bytes_read = read(fd, buf, count);
-    } while (bytes_read < 0 && errno == EINTR);
-    return bytes_read;
-}
-
 char *formatBoxName(char *boxName) {
     // add a slash to the beginning of the box name
     char *formattedBoxName = malloc(strlen(boxName) + 2);
@@ -46,14 +63,149 @@ char *formatBoxName(char *boxName) {
     return formattedBoxName;
 }
 
+/**
+ * Sends the counters, the latency histograms and the counters of every box to
+ * a manager, one STATS_ANSWER packet each.
+ */
+static void send_stats(int pipe) {
+    static _Thread_local metrics_t totals;
+    metrics_collect(&totals);
+
+    packet_t packet;
+    packet.opcode = STATS_ANSWER;
+    stats_data_t data;
+    data.last = 0;
+
+    data.kind = STATS_COUNTER;
+    memset(data.values, 0, sizeof(data.values));
+    for (metric_t i = 0; i < METRIC_COUNT; i++) {
+        strcpy(data.name, metrics_counter_name(i));
+        // Counters of different threads may be read at slightly different
+        // times; a gauge is never shown below 0
+        data.values[0] =
+            totals.counters[i] > 0 ? (uint64_t)totals.counters[i] : 0;
+        packet.payload.stats_data = data;
+        pipe_write(pipe, &packet);
+    }
+
+    data.kind = STATS_LATENCY;
+    for (latency_t i = 0; i < LATENCY_COUNT; i++) {
+        histogram_t const *histogram = &totals.latencies[i];
+        strcpy(data.name, metrics_latency_name(i));
+        data.values[0] = histogram->count;
+        data.values[1] = histogram_mean(histogram);
+        data.values[2] = histogram->count > 0 ? histogram->min : 0;
+        data.values[3] = histogram_quantile(histogram, 0.5);
+        data.values[4] = histogram_quantile(histogram, 0.9);
+        data.values[5] = histogram_quantile(histogram, 0.99);
+        data.values[6] = histogram_quantile(histogram, 0.999);
+        data.values[7] = histogram->max;
+        packet.payload.stats_data = data;
+        pipe_write(pipe, &packet);
+    }
+
+    box_node_t **nodes;
+    ssize_t count = registry_snapshot(&registry, &nodes);
+
+    data.kind = STATS_BOX;
+    memset(data.values, 0, sizeof(data.values));
+    for (ssize_t i = 0; i < count; i++) {
+        tfs_file *file = &nodes[i]->file;
+        strcpy(data.name, file->box_name);
+        pthread_mutex_lock(&file->lock);
+        data.values[0] = file->n_messages;
+        data.values[2] = file->box_size;
+        data.values[4] = file->n_publishers;
+        data.values[5] = file->n_subscribers;
+        pthread_mutex_unlock(&file->lock);
+        data.values[1] = __atomic_load_n(&file->messages_out, __ATOMIC_RELAXED);
+        data.values[3] = __atomic_load_n(&file->bytes_out, __ATOMIC_RELAXED);
+        registry_release(&registry, nodes[i]);
+
+        packet.payload.stats_data = data;
+        pipe_write(pipe, &packet);
+    }
+    free(nodes);
+
+    // An empty entry marks the end
+    memset(&data, 0, sizeof(data));
+    data.last = 1;
+    packet.payload.stats_data = data;
+    pipe_write(pipe, &packet);
+}
+
+/**
+ * Maps the shared ring a client created before registering.
+ *
+ * A client registered through a connection can't tell when that happened
+ * (unlike one waiting for its pipe to be opened), so connection is set to
+ * remove the ring's name here instead.
+ *
+ * Returns the ring, or NULL if there is no valid one.
+ */
+static shm_ring_t *attach_ring(char *pipeName, int connection) {
+    char name[SHM_RING_NAME_SIZE];
+    shm_ring_name(pipeName, name);
+
+    shm_ring_t *ring = malloc(sizeof(shm_ring_t));
+    if (ring != NULL && shm_ring_attach(ring, name) == -1) {
+        free(ring);
+        return NULL;
+    }
+    if (connection != -1) {
+        shm_unlink(name);
+    }
+    return ring;
+}
+
+/**
+ * Unmaps a ring returned by attach_ring (if any) that no session took over,
+ * telling the client.
+ */
+static void detach_ring(shm_ring_t *ring) {
+    if (ring != NULL) {
+        shm_ring_close(ring);
+        shm_ring_detach(ring);
+        free(ring);
+    }
+}
+
+/**
+ * Opens the client's end of a request: the connection it came through (made
+ * blocking, like a pipe opened by pipe_open), or else the client's pipe.
+ */
+static int open_client(int connection, char *pipeName, int mode) {
+    if (connection == -1) {
+        return pipe_open(pipeName, mode);
+    }
+    if (fcntl(connection, F_SETFL, 0) == -1) {
+        WARN("Failed to make connection blocking");
+    }
+    return connection;
+}
+
+/**
+ * Turns a client away by closing its end of the request, which the client
+ * sees as mbroker hanging up.
+ */
+static void reject_client(int connection, char *pipeName, int mode) {
+    pipe_close(open_client(connection, pipeName, mode));
+}
+
 void *session_worker() {
     while (true) {
         LOG("Worker waiting for new message");
-        packet_t packet = *(packet_t *)pcq_dequeue(&queue);
+        queued_packet_t *queued = (queued_packet_t *)pcq_dequeue(&queue);
+        metrics_add(METRIC_QUEUE_DEPTH, -1);
+        metrics_record(LATENCY_QUEUE_WAIT, metrics_now() - queued->queued);
+        packet_t packet = queued->packet;
+        int connection = queued->connection;
+        free(queued);
         LOG("Worker dequeued message");
 
         switch (packet.opcode) {
-        case REGISTER_PUBLISHER: {
+        case REGISTER_PUBLISHER:
+        case REGISTER_PUBLISHER_SHM: {
             // Register a publisher to a given box
 
             LOG("Registering Publisher");
@@ -62,166 +214,124 @@ void *session_worker() {
 
             LOG("Verifying box exists");
 
-            // Looks for the box in the list
-            ListNode *node = search_node(&list, payload.box_name);
+            // Looks for the box in the registry
+            box_node_t *node = registry_acquire(&registry, payload.box_name);
 
-            // If the box does not exist, create it
+            // If the box does not exist, reject the publisher
             if (node == NULL) {
                 WARN("Box does not exist");
-                int pipe = pipe_open(pipeName, O_RDONLY);
-                pipe_close(pipe);
+                metrics_add(METRIC_PUBLISHERS_REJECTED, 1);
+                reject_client(connection, pipeName, O_RDONLY);
                 break;
             }
 
-            // If the box already has a publisher, reject the new publisher
-            if (node->file.n_publishers > 0) {
-                WARN("Too many publishers");
-                int pipe = pipe_open(pipeName, O_RDONLY);
-                pipe_close(pipe);
+            // A shared ring is mapped before the pipe is opened, so the
+            // publisher can remove its name once its own open returns
+            shm_ring_t *shm = NULL;
+            if (packet.opcode == REGISTER_PUBLISHER_SHM &&
+                (shm = attach_ring(pipeName, connection)) == NULL) {
+                WARN("Failed to attach publisher ring");
+                metrics_add(METRIC_PUBLISHERS_REJECTED, 1);
+                registry_release(&registry, node);
+                reject_client(connection, pipeName, O_RDONLY);
                 break;
             }
 
-            // Increment number of publishers of the box
-            increment_publishers(&list, payload.box_name);
-            DEBUG("Publishers: %ld", node->file.n_publishers);
-
-            LOG("Waiting to receive messages in %s", pipeName);
-            int pipe = pipe_open(pipeName, O_RDONLY);
-
-            packet_t new_packet;
-            char *message;
-            while (true) {
-                // Reads packet from publisher
-                if (try_read(pipe, &new_packet, sizeof(packet_t)) <= 0)
-                    break;
-
-                message = new_packet.payload.message_data.message;
-                LOG("Opening box in TFS");
-
-                int box =
-                    tfs_open(formatBoxName(payload.box_name), TFS_O_APPEND);
-                if (box == -1) {
-                    WARN("Failed to open box");
-                    break;
-                }
-
-                if (tfs_write(box, message, strlen(message) + 1) == -1) {
-                    WARN("Failed to write to box");
-                    break;
-                }
+            // The publisher's pipe is served by the reactor threads from now
+            // on, so it must not block (connections are accepted non-blocking)
+            int pipe = connection != -1
+                           ? connection
+                           : open(pipeName, O_RDONLY | O_NONBLOCK);
+            if (pipe == -1) {
+                WARN("Failed to open publisher pipe");
+                metrics_add(METRIC_PUBLISHERS_REJECTED, 1);
+                detach_ring(shm);
+                registry_release(&registry, node);
+                break;
+            }
 
-                node->file.box_size += strlen(message) + 1;
-                if (tfs_close(box) == -1) {
-                    WARN("Failed to close box");
-                    break;
+            // If the box already has a publisher, reject the new publisher
+            if (session_publisher_start(node, pipe, shm) == -1) {
+                WARN("Too many publishers");
+                metrics_add(METRIC_PUBLISHERS_REJECTED, 1);
+                pipe_close(pipe);
+                detach_ring(shm);
+                registry_release(&registry, node);
+                // A pipe is reopened (blocking until the publisher opened its
+                // end) and closed, for the publisher to notice; a connection
+                // is closed already
+                if (connection == -1) {
+                    reject_client(connection, pipeName, O_RDONLY);
                 }
-                LOG("Writing %s", new_packet.payload.message_data.message);
-
-                // signals condvar to wake up subscribers reading
-                LOG("Waking up subscribers");
-                pthread_cond_broadcast(&node->file.cond);
+                break;
             }
 
-            pipe_close(pipe);
-            decrement_publishers(&list, payload.box_name);
-
+            metrics_add(METRIC_PUBLISHERS_REGISTERED, 1);
+            LOG("Receiving messages in %s", pipeName);
             break;
         }
-        case REGISTER_SUBSCRIBER: {
+        case REGISTER_SUBSCRIBER:
+        case REGISTER_SUBSCRIBER_SHM: {
             // Register a subscriber to a given mailbox
 
             LOG("Registering subscriber");
             registration_data_t payload = packet.payload.registration_data;
             char *pipeName = payload.client_pipe;
+            // A subscriber with a shared ring writes to its pipe instead
+            bool shared = packet.opcode == REGISTER_SUBSCRIBER_SHM;
+            int mode = shared ? O_RDONLY : O_WRONLY;
 
             LOG("Verifying box exists");
 
-            // Looks for the box in the list
-            ListNode *node = search_node(&list, payload.box_name);
+            // Looks for the box in the registry
+            box_node_t *node = registry_acquire(&registry, payload.box_name);
 
             // If box does not exist, sends error message
             if (node == NULL) {
                 WARN("Box does not exist");
+                metrics_add(METRIC_SUBSCRIBERS_REJECTED, 1);
                 // The pipe is opened and then closed to notify the client that
                 // the box does not exist
-                int pipe = pipe_open(pipeName, O_WRONLY);
-                pipe_close(pipe);
+                reject_client(connection, pipeName, mode);
                 break;
             }
 
-            LOG("Opening box in TFS");
-
-            // Open box in TFS
-            int box = tfs_open(formatBoxName(payload.box_name), 0);
-            // If box creation fails, sends error message
-            if (box == -1) {
-                WARN("Failed to open box");
-                int pipe = pipe_open(pipeName, O_WRONLY);
-                pipe_close(pipe);
+            shm_ring_t *shm = NULL;
+            if (shared && (shm = attach_ring(pipeName, connection)) == NULL) {
+                WARN("Failed to attach subscriber ring");
+                metrics_add(METRIC_SUBSCRIBERS_REJECTED, 1);
+                registry_release(&registry, node);
+                reject_client(connection, pipeName, mode);
                 break;
             }
 
-            // Increment number of subscribers of the box
-            increment_subscribers(&list, payload.box_name);
-
-            LOG("Waiting to write messages");
-            int pipe = pipe_open(pipeName, O_WRONLY);
-
-            // Send messages to subscriber
-            char buffer[MESSAGE_SIZE];
-            memset(buffer, 0, MESSAGE_SIZE);
-            packet_t new_packet;
-            new_packet.opcode = SEND_MESSAGE;
-            tfs_read(box, buffer, MESSAGE_SIZE);
-            char *message = buffer;
-            while (strlen(message) > 0) {
-                LOG("Sending %s", message);
-                memset(new_packet.payload.message_data.message, 0,
-                       MESSAGE_SIZE);
-                strcpy(new_packet.payload.message_data.message, message);
-                pipe_write(pipe, &new_packet);
-                message += strlen(message) + 1;
-            }
-
-            while (true) {
-                // Wait for publisher to write to box
-                pthread_mutex_lock(&node->file.lock);
-                pthread_cond_wait(&node->file.cond, &node->file.lock);
-                pthread_mutex_unlock(&node->file.lock);
-                LOG("Subscriber woken up");
-                if (tfs_read(box, buffer, MESSAGE_SIZE) == -1) {
-                    WARN("Failed to read from box");
-                    break;
-                }
-
-                LOG("Sending %s", message);
-                memset(new_packet.payload.message_data.message, 0,
-                       MESSAGE_SIZE);
-                strcpy(new_packet.payload.message_data.message, buffer);
-                if (write(pipe, &new_packet, sizeof(packet_t)) == -1) {
-                    break;
-                }
-            }
-            decrement_subscribers(&list, payload.box_name);
-
-            if (tfs_close(box) == -1) {
-                WARN("Failed to close box");
+            // Opening blocks until the subscriber opens its end; only then can
+            // the pipe be made non-blocking for the reactor threads
+            int pipe = open_client(connection, pipeName, mode);
+            if (fcntl(pipe, F_SETFL, O_NONBLOCK) == -1 ||
+                session_subscriber_start(node, pipe, shm) == -1) {
+                WARN("Failed to start subscriber session");
+                metrics_add(METRIC_SUBSCRIBERS_REJECTED, 1);
                 pipe_close(pipe);
+                detach_ring(shm);
+                registry_release(&registry, node);
                 break;
             }
-            pipe_close(pipe);
 
+            metrics_add(METRIC_SUBSCRIBERS_REGISTERED, 1);
+            LOG("Sending messages to %s", pipeName);
             break;
         }
         case CREATE_MAILBOX: {
             // Creates mailbox in TFS
 
             LOG("Creating Mailbox");
+            metrics_add(METRIC_MANAGER_REQUESTS, 1);
 
             registration_data_t payload = packet.payload.registration_data;
             char *pipeName = payload.client_pipe;
 
-            int pipe = pipe_open(pipeName, O_WRONLY);
+            int pipe = open_client(connection, pipeName, O_WRONLY);
 
             // Creates packet to send to client
             packet_t new_packet;
@@ -230,7 +340,10 @@ void *session_worker() {
             LOG("Checking if box already exists");
 
             // Checks if box already exists
-            if (search_node(&list, payload.box_name) != NULL) {
+            box_node_t *existing =
+                registry_acquire(&registry, payload.box_name);
+            if (existing != NULL) {
+                registry_release(&registry, existing);
                 WARN("Box already exists");
                 new_packet.payload.answer_data.return_code = -1;
                 strcpy(new_packet.payload.answer_data.error_message,
@@ -255,16 +368,29 @@ void *session_worker() {
                 break;
             }
 
-            LOG("Adding box to list");
+            LOG("Adding box to registry");
 
-            // Initializes new file and adds it to list
+            // Initializes new file and adds it to the registry
             tfs_file new_file;
             strcpy(new_file.box_name, payload.box_name);
             new_file.n_publishers = 0;
             new_file.n_subscribers = 0;
             new_file.box_size = 0;
+            new_file.n_messages = 0;
+            new_file.messages_out = 0;
+            new_file.bytes_out = 0;
 
-            list_add(&list, new_file);
+            // Another manager may have created it meanwhile
+            if (registry_add(&registry, &new_file) == -1) {
+                WARN("Box already exists");
+                new_packet.payload.answer_data.return_code = -1;
+                strcpy(new_packet.payload.answer_data.error_message,
+                       "Box already exists");
+                pipe_write(pipe, &new_packet);
+                tfs_close(box);
+                pipe_close(pipe);
+                break;
+            }
 
             // Sends "OK" message to manager
             new_packet.payload.answer_data.return_code = 0;
@@ -279,11 +405,12 @@ void *session_worker() {
             // Removes mailbox from tfs
 
             LOG("Removing Mailbox");
+            metrics_add(METRIC_MANAGER_REQUESTS, 1);
 
             registration_data_t payload = packet.payload.registration_data;
             char *pipeName = payload.client_pipe;
 
-            int pipe = pipe_open(pipeName, O_WRONLY);
+            int pipe = open_client(connection, pipeName, O_WRONLY);
 
             // Creates packet to send to client
             packet_t new_packet;
@@ -296,22 +423,16 @@ void *session_worker() {
                 strcpy(new_packet.payload.answer_data.error_message,
                        "Failed to delete box");
                 pipe_write(pipe, &new_packet);
+                pipe_close(pipe);
                 break;
             }
 
-            // broadcasts to all subscribers that the box has been deleted
-            ListNode *node = search_node(&list, payload.box_name);
+            // Removes the box from the registry, and ends its sessions (the
+            // node is freed once the last of them is gone)
+            box_node_t *node = registry_unlink(&registry, payload.box_name);
             if (node != NULL) {
-                pthread_cond_broadcast(&node->file.cond);
-            }
-
-            // Removes tfs_file from tfs_list
-            ListNode *prev = search_prev_node(&list, payload.box_name);
-            // If the node is not the head
-            if (prev != NULL) {
-                list_remove(&list, prev, prev->next);
-            } else {
-                list_remove(&list, NULL, list.head);
+                sessions_box_removed(node);
+                registry_release(&registry, node);
             }
 
             // Sends "OK" message to manager
@@ -326,50 +447,67 @@ void *session_worker() {
             // Sends all existing mailboxes to manager
 
             LOG("Listing Mailboxes");
+            metrics_add(METRIC_MANAGER_REQUESTS, 1);
             list_box_data_t payload = packet.payload.list_box_data;
             char *pipeName = payload.client_pipe;
 
-            int pipe = pipe_open(pipeName, O_WRONLY);
+            int pipe = open_client(connection, pipeName, O_WRONLY);
 
             // Creates packet to send to manager
             packet_t new_packet;
             new_packet.opcode = LIST_MAILBOXES_ANSWER;
 
-            // If the list is empty, send a packet with last = 1
-            if (list.size == 0) {
+            box_node_t **nodes;
+            ssize_t count = registry_snapshot(&registry, &nodes);
+
+            // If there are no boxes (or no memory to list them), send a
+            // packet with last = 1
+            if (count <= 0) {
                 new_packet.payload.mailbox_data.last = 1;
                 memset(new_packet.payload.mailbox_data.box_name, 0,
                        sizeof(new_packet.payload.mailbox_data.box_name));
                 pipe_write(pipe, &new_packet);
-            } else {
-                // Send packet for each mailbox
-                ListNode *node = list.head;
-                while (node != NULL) {
-                    strcpy(new_packet.payload.mailbox_data.box_name,
-                           node->file.box_name);
-                    new_packet.payload.mailbox_data.n_publishers =
-                        node->file.n_publishers;
-                    new_packet.payload.mailbox_data.n_subscribers =
-                        node->file.n_subscribers;
-                    new_packet.payload.mailbox_data.box_size =
-                        node->file.box_size;
-
-                    // if it is the last message, set last = 1
-                    if (node->next == NULL) {
-                        new_packet.payload.mailbox_data.last = 1;
-                    } else {
-                        new_packet.payload.mailbox_data.last = 0;
-                    }
-                    pipe_write(pipe, &new_packet);
-                    node = node->next;
-                }
             }
+            // Send packet for each mailbox
+            for (ssize_t i = 0; i < count; i++) {
+                tfs_file *file = &nodes[i]->file;
+                strcpy(new_packet.payload.mailbox_data.box_name,
+                       file->box_name);
+                pthread_mutex_lock(&file->lock);
+                new_packet.payload.mailbox_data.n_publishers =
+                    file->n_publishers;
+                new_packet.payload.mailbox_data.n_subscribers =
+                    file->n_subscribers;
+                new_packet.payload.mailbox_data.box_size = file->box_size;
+                pthread_mutex_unlock(&file->lock);
+
+                // if it is the last message, set last = 1
+                new_packet.payload.mailbox_data.last = i == count - 1;
+                pipe_write(pipe, &new_packet);
+                registry_release(&registry, nodes[i]);
+            }
+            free(nodes);
+
+            pipe_close(pipe);
+            break;
+        }
+        case STATS: {
+            // Sends what the broker has been doing to manager
+
+            LOG("Sending stats");
+            metrics_add(METRIC_MANAGER_REQUESTS, 1);
+            list_box_data_t payload = packet.payload.list_box_data;
 
+            int pipe = open_client(connection, payload.client_pipe, O_WRONLY);
+            send_stats(pipe);
             pipe_close(pipe);
             break;
         }
         default: {
             WARN("Invalid opcode");
+            if (connection != -1) {
+                pipe_close(connection);
+            }
             break;
         }
         }
@@ -379,20 +517,167 @@ void *session_worker() {
 }
 
 void close_server(int status) {
-    list_destroy(&list);
+    registry_destroy(&registry);
 
     pipe_close(registerPipe);
     pipe_destroy(registerPipeName);
+    if (socketName != NULL) {
+        unlink(socketName);
+    }
 
     free(workers);
 
+    // Only the image's own sync policy decides if it must reach the storage
+    if (params.sync_policy != TFS_SYNC_NONE) {
+        tfs_sync();
+    }
+
     LOG("Successfully ended the server.");
     exit(status);
 }
 
+/**
+ * Queues a request that came through the socket, for a worker to answer
+ * through its connection.
+ */
+static void queue_connection(packet_t const *packet, int connection) {
+    queued_packet_t *queued = malloc(sizeof(queued_packet_t));
+    queued->queued = metrics_now();
+    queued->packet = *packet;
+    queued->connection = connection;
+    metrics_add(METRIC_QUEUE_DEPTH, 1);
+    pcq_enqueue(&queue, queued);
+}
+
+/**
+ * Raises the limit of open file descriptors as far as allowed, as every
+ * session keeps its pipe open.
+ */
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+            WARN("Failed to raise open file limit");
+        }
+    }
+}
+
+/**
+ * Sets the TFS latency model from the value of --storage-latency: "spin" (the
+ * default), "off", or the nanoseconds to sleep on every storage access.
+ *
+ * Returns 0 if successful, -1 if the value is invalid.
+ */
+static int set_storage_latency(char const *value) {
+    if (strcmp(value, "spin") == 0) {
+        params.latency_model = TFS_LATENCY_SPIN;
+        return 0;
+    }
+    if (strcmp(value, "off") == 0) {
+        params.latency_model = TFS_LATENCY_OFF;
+        return 0;
+    }
+
+    char *end;
+    unsigned long ns = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0') {
+        return -1;
+    }
+    params.latency_model = TFS_LATENCY_SLEEP;
+    params.latency_ns = ns;
+    return 0;
+}
+
+/**
+ * Sets the TFS image sync policy from the value of --sync: "none" (the
+ * default), "close", "journal", or the interval in milliseconds to sync it
+ * periodically.
+ *
+ * Returns 0 if successful, -1 if the value is invalid.
+ */
+static int set_sync_policy(char const *value) {
+    if (strcmp(value, "none") == 0) {
+        params.sync_policy = TFS_SYNC_NONE;
+        return 0;
+    }
+    if (strcmp(value, "close") == 0) {
+        params.sync_policy = TFS_SYNC_ON_CLOSE;
+        return 0;
+    }
+    if (strcmp(value, "journal") == 0) {
+        params.sync_policy = TFS_SYNC_JOURNAL;
+        return 0;
+    }
+
+    char *end;
+    unsigned long ms = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || ms == 0) {
+        return -1;
+    }
+    params.sync_policy = TFS_SYNC_PERIODIC;
+    params.sync_interval_ms = ms;
+    return 0;
+}
+
+/**
+ * Applies an option given after the pipe name and the number of sessions.
+ *
+ * Returns 0 if successful, -1 if the option or its value is invalid.
+ */
+static int set_option(char const *option, char const *value) {
+    if (strcmp(option, "--storage-latency") == 0) {
+        return set_storage_latency(value);
+    }
+    if (strcmp(option, "--image") == 0) {
+        params.image_path = value;
+        return 0;
+    }
+    if (strcmp(option, "--sync") == 0) {
+        return set_sync_policy(value);
+    }
+    if (strcmp(option, "--socket") == 0) {
+        socketName = value;
+        return 0;
+    }
+    if (strcmp(option, "--io-engine") == 0) {
+        if (strcmp(value, "epoll") == 0) {
+            ioEngine = REACTOR_EPOLL;
+        } else if (strcmp(value, "uring") == 0) {
+            ioEngine = REACTOR_URING;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if (strcmp(option, "--inodes") == 0 || strcmp(option, "--blocks") == 0) {
+        char *end;
+        unsigned long count = strtoul(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || count == 0) {
+            return -1;
+        }
+        if (option[2] == 'i') {
+            params.max_inode_count = count;
+        } else {
+            params.max_block_count = count;
+        }
+        return 0;
+    }
+    return -1;
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: mbroker <pipename>\n");
+    bool valid = argc >= 3 && argc % 2 == 1;
+    for (int i = 3; valid && i < argc; i += 2) {
+        valid = set_option(argv[i], argv[i + 1]) == 0;
+    }
+    if (!valid) {
+        fprintf(stderr, "usage: mbroker <pipename> <max_sessions> "
+                        "[--storage-latency spin|off|<ns>] "
+                        "[--image <path>] [--sync none|close|journal|<ms>] "
+                        "[--inodes N] [--blocks N] [--socket <path>] "
+                        "[--io-engine epoll|uring]\n");
         return EXIT_FAILURE;
     }
 
@@ -404,11 +689,25 @@ int main(int argc, char **argv) {
 
     LOG("Starting server with pipe named %s", registerPipeName);
 
-    // Initialize file list and queue
-    list_init(&list);
+    // Initialize box registry and queue
+    if (registry_init(&registry) != 0) {
+        WARN("Failed to create box registry");
+        return EXIT_FAILURE;
+    }
     pcq_create(&queue, maxSessions);
 
-    // Initialize workers
+    raise_fd_limit();
+
+    // Start the reactor threads serving publisher and subscriber sessions,
+    // one per CPU
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_loops = cpus > 0 ? (size_t)cpus : 1;
+    if (sessions_init(&registry, n_loops, ioEngine) != 0) {
+        WARN("Failed to start session reactor");
+        return EXIT_FAILURE;
+    }
+
+    // Initialize workers, which handle registrations and manager requests
     workers = malloc(sizeof(pthread_t) * maxSessions);
     for (int i = 0; i < maxSessions; ++i) {
         pthread_create(&workers[i], NULL, session_worker, NULL);
@@ -420,20 +719,62 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    // Serve the boxes kept in the image as before the restart
+    if (params.image_path != NULL) {
+        uint64_t start = metrics_now();
+        ssize_t restored =
+            restore_boxes(&registry, cpus > 0 ? (size_t)cpus : 1);
+        if (restored == -1) {
+            WARN("Failed to restore the boxes in %s", params.image_path);
+            return EXIT_FAILURE;
+        }
+        LOG("Restored %zd boxes in %" PRIu64 " us", restored,
+            (metrics_now() - start) / 1000);
+    }
+
+    // Clients can also register through the socket, each on a connection of
+    // its own
+    if (socketName != NULL &&
+        listener_start(socketName, queue_connection) == -1) {
+        return EXIT_FAILURE;
+    }
+
     // Creates and open registration server pipe
     pipe_create(registerPipeName);
     registerPipe = pipe_open(registerPipeName, O_RDONLY);
 
     // Main loop
-    // Waits for new packets and adds them to the queue
+    // Waits for new packets and adds them to the queue, moving every packet
+    // already read from the pipe (up to REGISTER_BATCH) in a single round
+    static frame_reader_t reader;
+    frame_reader_init(&reader, registerPipe);
+    void *batch[REGISTER_BATCH];
     while (true) {
         int tempPipe = pipe_open(registerPipeName, O_RDONLY);
         pipe_close(tempPipe);
 
         packet_t packet;
-        while (try_read(registerPipe, &packet, sizeof(packet_t)) > 0) {
-            LOG("Received packet with opcode %d", packet.opcode);
-            pcq_enqueue(&queue, &packet);
+        int ret;
+        while ((ret = frame_read(&reader, &packet)) > 0) {
+            size_t n = 0;
+            uint64_t now = metrics_now();
+            do {
+                LOG("Received packet with opcode %d", packet.opcode);
+                // Each packet gets its own copy, freed by the worker
+                queued_packet_t *copy = malloc(sizeof(queued_packet_t));
+                copy->queued = now;
+                copy->packet = packet;
+                copy->connection = -1;
+                batch[n++] = copy;
+            } while (n < REGISTER_BATCH && frame_next(&reader, &packet) == 1);
+            metrics_add(METRIC_QUEUE_DEPTH, (int64_t)n);
+            pcq_enqueue_many(&queue, batch, n);
+        }
+
+        if (ret < 0 && errno == EPROTO) {
+            // Drop whatever was buffered and resynchronize with new clients
+            WARN("Invalid frame in register pipe");
+            frame_reader_init(&reader, registerPipe);
         }
     }
 
@@ -0,0 +1,116 @@
+#include "metrics.h"
+#include "logging.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+// A thread's copy of the metrics, linked into the list of every thread's.
+// Copies are never freed: what a thread counted still counts once it's gone
+typedef struct thread_metrics {
+    metrics_t metrics;
+    struct thread_metrics *next;
+} thread_metrics_t;
+
+static char const *const counter_names[METRIC_COUNT] = {
+    [METRIC_MESSAGES_IN] = "messages_in",
+    [METRIC_MESSAGES_OUT] = "messages_out",
+    [METRIC_BYTES_IN] = "bytes_in",
+    [METRIC_BYTES_OUT] = "bytes_out",
+    [METRIC_PUBLISHERS_REGISTERED] = "publishers_registered",
+    [METRIC_PUBLISHERS_REJECTED] = "publishers_rejected",
+    [METRIC_SUBSCRIBERS_REGISTERED] = "subscribers_registered",
+    [METRIC_SUBSCRIBERS_REJECTED] = "subscribers_rejected",
+    [METRIC_MANAGER_REQUESTS] = "manager_requests",
+    [METRIC_QUEUE_DEPTH] = "queue_depth",
+};
+
+static char const *const latency_names[LATENCY_COUNT] = {
+    [LATENCY_PUBLISH_TO_DELIVER] = "publish_to_deliver_ns",
+    [LATENCY_TFS_WRITE] = "tfs_write_ns",
+    [LATENCY_QUEUE_WAIT] = "queue_wait_ns",
+};
+
+// Guards the list (only taken by a thread's first update and by readers)
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_metrics_t *threads;
+static _Thread_local thread_metrics_t *mine;
+
+char const *metrics_counter_name(metric_t metric) {
+    return counter_names[metric];
+}
+
+char const *metrics_latency_name(latency_t latency) {
+    return latency_names[latency];
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Returns the calling thread's metrics, creating them on first use.
+ *
+ * Returns NULL if out of memory (the update is then lost).
+ */
+static metrics_t *my_metrics() {
+    if (mine != NULL) {
+        return &mine->metrics;
+    }
+
+    thread_metrics_t *created = calloc(1, sizeof(thread_metrics_t));
+    if (created == NULL) {
+        WARN("Failed to allocate thread metrics");
+        return NULL;
+    }
+    for (size_t i = 0; i < LATENCY_COUNT; i++) {
+        histogram_init(&created->metrics.latencies[i]);
+    }
+
+    pthread_mutex_lock(&lock);
+    created->next = threads;
+    threads = created;
+    pthread_mutex_unlock(&lock);
+
+    mine = created;
+    return &mine->metrics;
+}
+
+void metrics_add(metric_t metric, int64_t delta) {
+    metrics_t *metrics = my_metrics();
+    if (metrics != NULL) {
+        __atomic_store_n(&metrics->counters[metric],
+                         metrics->counters[metric] + delta, __ATOMIC_RELAXED);
+    }
+}
+
+void metrics_record(latency_t latency, uint64_t ns) {
+    metrics_t *metrics = my_metrics();
+    if (metrics != NULL) {
+        histogram_record(&metrics->latencies[latency], ns);
+    }
+}
+
+void metrics_collect(metrics_t *totals) {
+    for (size_t i = 0; i < METRIC_COUNT; i++) {
+        totals->counters[i] = 0;
+    }
+    for (size_t i = 0; i < LATENCY_COUNT; i++) {
+        histogram_init(&totals->latencies[i]);
+    }
+
+    pthread_mutex_lock(&lock);
+    for (thread_metrics_t *thread = threads; thread != NULL;
+         thread = thread->next) {
+        for (size_t i = 0; i < METRIC_COUNT; i++) {
+            totals->counters[i] += __atomic_load_n(
+                &thread->metrics.counters[i], __ATOMIC_RELAXED);
+        }
+        for (size_t i = 0; i < LATENCY_COUNT; i++) {
+            histogram_merge(&totals->latencies[i],
+                            &thread->metrics.latencies[i]);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
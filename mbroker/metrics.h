@@ -0,0 +1,80 @@
+#ifndef __MBROKER_METRICS_H__
+#define __MBROKER_METRICS_H__
+
+#include "histogram.h"
+#include <stdint.h>
+
+/**
+ * What mbroker is doing, for the manager's stats command.
+ *
+ * Every thread updates its own copy of the counters and histograms, with plain
+ * (single writer) stores, so recording never contends; reading them adds up
+ * every thread's copy.
+ */
+
+typedef enum {
+    METRIC_MESSAGES_IN,
+    METRIC_MESSAGES_OUT,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_PUBLISHERS_REGISTERED,
+    METRIC_PUBLISHERS_REJECTED,
+    METRIC_SUBSCRIBERS_REGISTERED,
+    METRIC_SUBSCRIBERS_REJECTED,
+    METRIC_MANAGER_REQUESTS,
+    // Packets waiting in the register queue (added to when enqueued,
+    // subtracted from when dequeued)
+    METRIC_QUEUE_DEPTH,
+    METRIC_COUNT,
+} metric_t;
+
+typedef enum {
+    // From a message being published to it being written to a subscriber
+    LATENCY_PUBLISH_TO_DELIVER,
+    // Appending a round of messages to a box in TFS
+    LATENCY_TFS_WRITE,
+    // From a packet being queued for the workers to one of them taking it
+    LATENCY_QUEUE_WAIT,
+    LATENCY_COUNT,
+} latency_t;
+
+typedef struct {
+    int64_t counters[METRIC_COUNT];
+    histogram_t latencies[LATENCY_COUNT];
+} metrics_t;
+
+/**
+ * Returns the name of a counter, as shown by the manager.
+ */
+char const *metrics_counter_name(metric_t metric);
+
+/**
+ * Returns the name of a latency histogram, as shown by the manager.
+ */
+char const *metrics_latency_name(latency_t latency);
+
+/**
+ * Returns the current time in nanoseconds (of a monotonic clock), for
+ * measuring latencies.
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Adds delta to a counter.
+ */
+void metrics_add(metric_t metric, int64_t delta);
+
+/**
+ * Counts a latency, in nanoseconds.
+ */
+void metrics_record(latency_t latency, uint64_t ns);
+
+/**
+ * Adds up the metrics of every thread.
+ *
+ * Input:
+ *   - totals: where to store them
+ */
+void metrics_collect(metrics_t *totals);
+
+#endif // __MBROKER_METRICS_H__
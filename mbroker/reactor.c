@@ -0,0 +1,614 @@
+#include "reactor.h"
+#include "logging.h"
+#include "uring.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Maximum number of epoll events (or io_uring completions) handled per round
+#define MAX_EVENTS 64
+// Sizes of an io_uring loop's submission and completion rings (the latter
+// with room for a completion from every session of the loop at once; more
+// are kept by the kernel until there is room)
+#define URING_ENTRIES 256
+#define URING_CQ_ENTRIES 16384
+// user_data of the completions of the loop's poll cancellations, and of its
+// read of its wake up eventfd; any other is a reactor_poll_t address, tagged
+// in its low bits with what completed
+#define URING_CANCEL 0
+#define URING_WAKEUP 1
+// The handler's poll (reporting its events), an I/O operation, and the poll
+// its read is linked to (whose completion only tells the read will run)
+#define TAG_POLL ((uint64_t)0)
+#define TAG_IO ((uint64_t)1)
+#define TAG_IO_POLL ((uint64_t)2)
+#define TAG_MASK ((uint64_t)3)
+
+/**
+ * A handler on an io_uring loop. Polls are one-shot, and armed again after
+ * every event (which is reported again if it still lasts), to behave like
+ * level-triggered epoll; no poll is armed while the handler has I/O in
+ * flight, whose completion tells it more.
+ *
+ * Every completion to come holds a reference to it, so a handler that is
+ * removed with operations in flight is released (see on_release) once the
+ * kernel is done with them.
+ */
+struct reactor_poll {
+    reactor_handler_t *handler;
+    uint32_t events;
+    bool removed;
+    bool in_flight;
+    bool io_in_flight;
+    // Completions to come, plus one while the poll waits in new_polls or a
+    // callback of its handler runs
+    unsigned refs;
+    reactor_poll_t *next_new;
+};
+
+struct reactor_loop {
+    pthread_t thread;
+    int epoll_fd;
+    // io_uring instance, if the loop uses it instead of epoll
+    uring_t *ring;
+    // eventfd written to wake the loop up when a handler is notified, and
+    // what the ring reads from it
+    int wakeup_fd;
+    uint64_t wakeup_count;
+
+    // Handlers waiting for their on_notify callback, in notification order
+    pthread_mutex_t lock;
+    reactor_handler_t *pending_head;
+    reactor_handler_t *pending_tail;
+    size_t n_pending;
+    // Polls of the handlers added to an io_uring loop, for its thread to arm
+    reactor_poll_t *new_polls;
+};
+
+static reactor_loop_t *loops;
+static size_t loop_count;
+static size_t next_loop;
+
+static void wake_up(reactor_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        WARN("failed to wake up reactor loop: %s", strerror(errno));
+    }
+}
+
+/**
+ * Appends the handler to its loop's pending list.
+ *
+ * The caller must hold the loop's lock.
+ *
+ * Returns true if the list was empty (so the loop may need a wake up).
+ */
+static bool push_pending(reactor_loop_t *loop, reactor_handler_t *handler) {
+    bool was_empty = loop->pending_head == NULL;
+
+    handler->pending = true;
+    handler->next_pending = NULL;
+    if (was_empty) {
+        loop->pending_head = handler;
+    } else {
+        loop->pending_tail->next_pending = handler;
+    }
+    loop->pending_tail = handler;
+    loop->n_pending++;
+
+    return was_empty;
+}
+
+/**
+ * Removes the handler from its loop's pending list.
+ *
+ * The caller must hold the loop's lock.
+ */
+static void unlink_pending(reactor_loop_t *loop, reactor_handler_t *handler) {
+    reactor_handler_t *prev = NULL;
+    reactor_handler_t *node = loop->pending_head;
+    while (node != handler) {
+        prev = node;
+        node = node->next_pending;
+    }
+
+    if (prev == NULL) {
+        loop->pending_head = handler->next_pending;
+    } else {
+        prev->next_pending = handler->next_pending;
+    }
+    if (loop->pending_tail == handler) {
+        loop->pending_tail = prev;
+    }
+    loop->n_pending--;
+    handler->pending = false;
+}
+
+/**
+ * Runs the on_notify callback of the handlers pending when called. Handlers
+ * notified meanwhile are left for the next round, so a handler that keeps
+ * getting notified cannot starve the loop's fd events.
+ */
+static void run_pending(reactor_loop_t *loop) {
+    pthread_mutex_lock(&loop->lock);
+    size_t n = loop->n_pending;
+    pthread_mutex_unlock(&loop->lock);
+
+    for (; n > 0; n--) {
+        pthread_mutex_lock(&loop->lock);
+        reactor_handler_t *handler = loop->pending_head;
+        if (handler == NULL) {
+            // the rest were removed meanwhile
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        }
+        loop->pending_head = handler->next_pending;
+        if (loop->pending_head == NULL) {
+            loop->pending_tail = NULL;
+        }
+        loop->n_pending--;
+        handler->pending = false;
+        pthread_mutex_unlock(&loop->lock);
+
+        handler->on_notify(handler);
+    }
+}
+
+static void *loop_thread(void *arg) {
+    reactor_loop_t *loop = (reactor_loop_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        // Don't block if there are notifications left from the last round
+        pthread_mutex_lock(&loop->lock);
+        int timeout = loop->pending_head != NULL ? 0 : -1;
+        pthread_mutex_unlock(&loop->lock);
+
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PANIC("epoll_wait failed: %s", strerror(errno));
+        }
+
+        for (int i = 0; i < n; i++) {
+            reactor_handler_t *handler =
+                (reactor_handler_t *)events[i].data.ptr;
+            if (handler == NULL) {
+                // The wake up eventfd; the notifications are handled below
+                uint64_t count;
+                if (read(loop->wakeup_fd, &count, sizeof(count)) < 0 &&
+                    errno != EAGAIN) {
+                    WARN("failed to read wake up eventfd: %s",
+                         strerror(errno));
+                }
+                continue;
+            }
+            handler->on_event(handler, events[i].events);
+        }
+
+        run_pending(loop);
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns an entry of the loop's submission ring to fill in.
+ */
+static struct io_uring_sqe *get_sqe(reactor_loop_t *loop) {
+    struct io_uring_sqe *sqe = uring_get_sqe(loop->ring);
+    if (sqe == NULL) {
+        PANIC("io_uring submission failed: %s", strerror(errno));
+    }
+    return sqe;
+}
+
+static uint64_t tagged(reactor_poll_t *poll, uint64_t tag) {
+    return (uint64_t)(uintptr_t)poll | tag;
+}
+
+/**
+ * Drops a reference to a handler's poll, releasing a removed handler with the
+ * last one.
+ */
+static void drop(reactor_poll_t *poll) {
+    if (--poll->refs > 0 || !poll->removed) {
+        return;
+    }
+    reactor_handler_t *handler = poll->handler;
+    free(poll);
+    if (handler->on_release != NULL) {
+        handler->on_release(handler);
+    }
+}
+
+/**
+ * Queues a one-shot poll of the handler's fd, for its events (and errors or
+ * hang-ups), unless one is in flight already or the handler has I/O in
+ * flight.
+ */
+static void arm_poll(reactor_loop_t *loop, reactor_poll_t *poll) {
+    if (poll->removed || poll->in_flight || poll->io_in_flight) {
+        return;
+    }
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = poll->handler->fd;
+    sqe->poll32_events = poll->events | EPOLLERR | EPOLLHUP;
+    sqe->user_data = tagged(poll, TAG_POLL);
+    poll->in_flight = true;
+    poll->refs++;
+}
+
+/**
+ * Queues the cancellation of an operation in flight.
+ */
+static void cancel(reactor_loop_t *loop, uint8_t opcode, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = opcode;
+    sqe->addr = user_data;
+    sqe->user_data = URING_CANCEL;
+}
+
+/**
+ * Queues a read of the wake up eventfd, which completes once it is written.
+ */
+static void read_wakeup(reactor_loop_t *loop) {
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->wakeup_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->wakeup_count;
+    sqe->len = sizeof(loop->wakeup_count);
+    sqe->user_data = URING_WAKEUP;
+}
+
+/**
+ * Arms the polls of the handlers added since the last round.
+ */
+static void arm_new_polls(reactor_loop_t *loop) {
+    pthread_mutex_lock(&loop->lock);
+    reactor_poll_t *poll = loop->new_polls;
+    loop->new_polls = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (poll != NULL) {
+        reactor_poll_t *next = poll->next_new;
+        arm_poll(loop, poll);
+        drop(poll);
+        poll = next;
+    }
+}
+
+/**
+ * Handles an io_uring completion: runs the callback of the handler whose poll
+ * or I/O operation completed, and arms its poll again.
+ */
+static void complete(reactor_loop_t *loop, uint64_t user_data, int32_t res) {
+    if (user_data == URING_CANCEL) {
+        // The operation may have completed already
+        if (res < 0 && res != -ENOENT && res != -EALREADY) {
+            PANIC("io_uring cancellation failed: %s", strerror(-res));
+        }
+        return;
+    }
+    if (user_data == URING_WAKEUP) {
+        // The notifications are handled after the completions
+        if (res < 0) {
+            WARN("failed to read wake up eventfd: %s", strerror(-res));
+        }
+        read_wakeup(loop);
+        return;
+    }
+
+    reactor_poll_t *poll = (reactor_poll_t *)(uintptr_t)(user_data & ~TAG_MASK);
+    reactor_handler_t *handler = poll->handler;
+    switch (user_data & TAG_MASK) {
+    case TAG_POLL:
+        poll->in_flight = false;
+        // A poll cancelled by reactor_modify is armed again with the new
+        // events; one that failed (the fd can't be polled) is an error. Events
+        // found while I/O is in flight are found again once it completes
+        if (!poll->removed && !poll->io_in_flight && res != -ECANCELED) {
+            handler->on_event(handler, res < 0 ? EPOLLERR : (uint32_t)res);
+        }
+        break;
+    case TAG_IO:
+        poll->io_in_flight = false;
+        if (!poll->removed) {
+            handler->on_io(handler, res);
+        }
+        break;
+    default:
+        break; // the read it is linked to completes too
+    }
+
+    arm_poll(loop, poll);
+    drop(poll);
+}
+
+static void *uring_loop_thread(void *arg) {
+    reactor_loop_t *loop = (reactor_loop_t *)arg;
+    read_wakeup(loop);
+
+    while (true) {
+        arm_new_polls(loop);
+
+        // Hand every poll armed or changed since the last round to the
+        // kernel, and (unless there are notifications left from the last
+        // round) wait for a completion, with a single system call
+        pthread_mutex_lock(&loop->lock);
+        bool wait = loop->pending_head == NULL;
+        pthread_mutex_unlock(&loop->lock);
+
+        if (uring_enter(loop->ring, wait) == -1 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            PANIC("io_uring_enter failed: %s", strerror(errno));
+        }
+
+        struct io_uring_cqe *cqe;
+        for (int i = 0;
+             i < MAX_EVENTS && (cqe = uring_peek_cqe(loop->ring)) != NULL;
+             i++) {
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uring_cqe_seen(loop->ring);
+            complete(loop, user_data, res);
+        }
+
+        run_pending(loop);
+    }
+
+    return NULL;
+}
+
+/**
+ * Sets up the loop's io_uring instance.
+ *
+ * Returns 0 if successful, -1 (with errno set) otherwise.
+ */
+static int start_uring(reactor_loop_t *loop) {
+    loop->ring = malloc(sizeof(uring_t));
+    if (loop->ring == NULL ||
+        uring_init(loop->ring, URING_ENTRIES, URING_CQ_ENTRIES) == -1) {
+        int error = errno;
+        free(loop->ring);
+        loop->ring = NULL;
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_start(size_t n_loops, reactor_engine_t engine) {
+    loops = calloc(n_loops, sizeof(reactor_loop_t));
+    if (loops == NULL) {
+        return -1;
+    }
+    loop_count = n_loops;
+
+    for (size_t i = 0; i < n_loops; i++) {
+        reactor_loop_t *loop = &loops[i];
+
+        if (engine == REACTOR_URING && start_uring(loop) == -1) {
+            if (i > 0) {
+                WARN("failed to create reactor loop: %s", strerror(errno));
+                return -1;
+            }
+            WARN("io_uring unavailable (%s), using epoll", strerror(errno));
+            engine = REACTOR_EPOLL;
+        }
+
+        if (loop->ring != NULL) {
+            // Read by the ring, which waits for it to be written
+            loop->epoll_fd = -1;
+            loop->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+            if (loop->wakeup_fd == -1) {
+                WARN("failed to create reactor loop: %s", strerror(errno));
+                return -1;
+            }
+        } else {
+            loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (loop->epoll_fd == -1 || loop->wakeup_fd == -1) {
+                WARN("failed to create reactor loop: %s", strerror(errno));
+                return -1;
+            }
+
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+            if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd,
+                          &event) == -1) {
+                WARN("failed to watch wake up eventfd: %s", strerror(errno));
+                return -1;
+            }
+        }
+
+        pthread_mutex_init(&loop->lock, NULL);
+        loop->pending_head = NULL;
+        loop->pending_tail = NULL;
+        loop->n_pending = 0;
+        loop->new_polls = NULL;
+
+        if (pthread_create(&loop->thread, NULL,
+                           loop->ring != NULL ? uring_loop_thread : loop_thread,
+                           loop) != 0) {
+            WARN("failed to start reactor thread");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int reactor_add(reactor_handler_t *handler, uint32_t events) {
+    size_t i = __atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED);
+    reactor_loop_t *loop = &loops[i % loop_count];
+    handler->loop = loop;
+    handler->pending = false;
+    handler->poll = NULL;
+
+    if (loop->ring != NULL) {
+        // The loop's thread arms the poll, as only it uses the ring
+        reactor_poll_t *poll = calloc(1, sizeof(reactor_poll_t));
+        if (poll == NULL) {
+            return -1;
+        }
+        poll->handler = handler;
+        poll->events = events;
+        poll->refs = 1; // until it is armed
+        handler->poll = poll;
+
+        pthread_mutex_lock(&loop->lock);
+        bool was_empty = push_pending(loop, handler);
+        poll->next_new = loop->new_polls;
+        loop->new_polls = poll;
+        pthread_mutex_unlock(&loop->lock);
+
+        if (was_empty) {
+            wake_up(loop);
+        }
+        return 0;
+    }
+
+    // The handler is queued before its fd is watched, and both happen under
+    // the loop lock, so its first callback can't run (and possibly remove it)
+    // before it is fully added
+    pthread_mutex_lock(&loop->lock);
+    bool was_empty = push_pending(loop, handler);
+
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &event) == -1) {
+        WARN("failed to watch fd %d: %s", handler->fd, strerror(errno));
+        unlink_pending(loop, handler);
+        pthread_mutex_unlock(&loop->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    if (was_empty) {
+        wake_up(loop);
+    }
+    return 0;
+}
+
+int reactor_modify(reactor_handler_t *handler, uint32_t events) {
+    reactor_poll_t *poll = handler->poll;
+    if (poll != NULL) {
+        // A poll in flight is cancelled, and armed again with the new events
+        // when its cancellation completes (or when it completes first)
+        poll->events = events;
+        if (poll->in_flight) {
+            cancel(handler->loop, IORING_OP_POLL_REMOVE,
+                   tagged(poll, TAG_POLL));
+        }
+        return 0;
+    }
+
+    struct epoll_event event = {.events = events, .data.ptr = handler};
+    if (epoll_ctl(handler->loop->epoll_fd, EPOLL_CTL_MOD, handler->fd,
+                  &event) == -1) {
+        WARN("failed to modify fd %d: %s", handler->fd, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void reactor_remove(reactor_handler_t *handler) {
+    reactor_loop_t *loop = handler->loop;
+
+    pthread_mutex_lock(&loop->lock);
+    if (handler->pending) {
+        unlink_pending(loop, handler);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    reactor_poll_t *poll = handler->poll;
+    if (poll == NULL) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+        if (handler->on_release != NULL) {
+            handler->on_release(handler);
+        }
+        return;
+    }
+
+    // Released once whatever is in flight completes (or once the loop gets
+    // to its poll, or is done with its callback)
+    poll->removed = true;
+    handler->poll = NULL;
+    if (poll->in_flight) {
+        cancel(loop, IORING_OP_POLL_REMOVE, tagged(poll, TAG_POLL));
+    }
+    if (poll->io_in_flight) {
+        cancel(loop, IORING_OP_POLL_REMOVE, tagged(poll, TAG_IO_POLL));
+        cancel(loop, IORING_OP_ASYNC_CANCEL, tagged(poll, TAG_IO));
+    }
+    poll->refs++;
+    drop(poll);
+}
+
+bool reactor_has_ring(reactor_handler_t const *handler) {
+    return handler->poll != NULL;
+}
+
+void reactor_read(reactor_handler_t *handler, void *buffer, size_t size) {
+    reactor_poll_t *poll = handler->poll;
+    reactor_loop_t *loop = handler->loop;
+
+    // Read once the fd is readable, which keeps a pipe whose writer didn't
+    // open it yet from looking closed (like epoll, which doesn't report it)
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handler->fd;
+    sqe->poll32_events = EPOLLIN | EPOLLERR | EPOLLHUP;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tagged(poll, TAG_IO_POLL);
+
+    // If the submission ring was full and the poll handed to the kernel
+    // alone, the read may find nothing yet (EAGAIN)
+    sqe = get_sqe(loop);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = handler->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)size;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = tagged(poll, TAG_IO);
+
+    poll->io_in_flight = true;
+    poll->refs += 2;
+}
+
+void reactor_writev(reactor_handler_t *handler, struct iovec const *iov,
+                    size_t count) {
+    reactor_poll_t *poll = handler->poll;
+
+    struct io_uring_sqe *sqe = get_sqe(handler->loop);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = handler->fd;
+    sqe->addr = (uint64_t)(uintptr_t)iov;
+    sqe->len = (uint32_t)count;
+    sqe->off = (uint64_t)-1;
+    sqe->user_data = tagged(poll, TAG_IO);
+
+    poll->io_in_flight = true;
+    poll->refs++;
+}
+
+void reactor_notify(reactor_handler_t *handler) {
+    reactor_loop_t *loop = handler->loop;
+    bool was_empty = false;
+
+    pthread_mutex_lock(&loop->lock);
+    if (!handler->pending) {
+        was_empty = push_pending(loop, handler);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    if (was_empty) {
+        wake_up(loop);
+    }
+}
@@ -0,0 +1,128 @@
+#ifndef __MBROKER_REACTOR_H__
+#define __MBROKER_REACTOR_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct reactor_loop reactor_loop_t;
+typedef struct reactor_poll reactor_poll_t;
+
+// How the loops wait for their fds
+typedef enum {
+    // epoll_wait, with an epoll_ctl for every change to what is watched
+    REACTOR_EPOLL,
+    // io_uring: polls, and the handlers' reads and writes (see reactor_read),
+    // are handed to the kernel along with the wait, in a single system call
+    // per round
+    REACTOR_URING,
+} reactor_engine_t;
+
+/**
+ * Something watched by a reactor loop: a file descriptor plus the callbacks
+ * the loop's thread runs for it. Meant to be embedded in (as the first member
+ * of) the structure it belongs to.
+ *
+ * Both callbacks always run on the thread of the loop the handler was added
+ * to, so a handler's state needs no locking as long as only they touch it.
+ */
+typedef struct reactor_handler {
+    int fd;
+    // Called with the epoll events (EPOLLIN, EPOLLOUT, EPOLLERR, ...) ready
+    void (*on_event)(struct reactor_handler *handler, uint32_t events);
+    // Called after reactor_notify
+    void (*on_notify)(struct reactor_handler *handler);
+    // Called with the result of reactor_read or reactor_writev (what read()
+    // or writev() would return, or -errno)
+    void (*on_io)(struct reactor_handler *handler, ssize_t result);
+    // Called once the reactor is done with a removed handler (if set)
+    void (*on_release)(struct reactor_handler *handler);
+
+    // Private to the reactor
+    reactor_loop_t *loop;
+    struct reactor_handler *next_pending;
+    bool pending;
+    reactor_poll_t *poll;
+} reactor_handler_t;
+
+/**
+ * Starts n_loops event loops, each with its own thread and epoll instance (or
+ * io_uring instance).
+ *
+ * If the io_uring engine is asked for but the kernel doesn't support (or
+ * allow) it, the loops use epoll instead.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int reactor_start(size_t n_loops, reactor_engine_t engine);
+
+/**
+ * Starts watching the handler's fd for the given epoll events, on one of the
+ * loops (picked round-robin). The handler is also notified once, so it can
+ * start its work on the loop's thread.
+ *
+ * EPOLLERR and EPOLLHUP are always watched, and the events are reported for
+ * as long as they last (level-triggered), with either engine.
+ *
+ * Returns 0 if successful, -1 otherwise (with io_uring, a fd that can't be
+ * watched is only found out later, and reported as EPOLLERR).
+ */
+int reactor_add(reactor_handler_t *handler, uint32_t events);
+
+/**
+ * Changes the epoll events watched for the handler's fd.
+ *
+ * Must be called from the handler's loop thread.
+ */
+int reactor_modify(reactor_handler_t *handler, uint32_t events);
+
+/**
+ * Stops watching the handler (dropping any pending notification), and calls
+ * its on_release callback once the reactor is done with it: right away, or,
+ * with io_uring, once the operations in flight for it complete. Only then can
+ * its fd be closed, and it (and the buffers of its reads and writes) freed.
+ *
+ * Must be called from the handler's loop thread; no callback but on_release
+ * runs for the handler afterwards.
+ */
+void reactor_remove(reactor_handler_t *handler);
+
+/**
+ * Returns whether the handler's loop uses io_uring, so its reads and writes
+ * can go through reactor_read and reactor_writev.
+ */
+bool reactor_has_ring(reactor_handler_t const *handler);
+
+/**
+ * Reads from the handler's fd through its loop's io_uring, once it is
+ * readable. Reads are handed to the kernel together with every other change
+ * and the loop's wait, and the handler's on_io gets the result.
+ *
+ * No events are reported for the handler while it has a read or write in
+ * flight, and it may only have one.
+ *
+ * Must be called from the handler's loop thread, which must use io_uring; the
+ * buffer must stay valid until on_io (or on_release).
+ */
+void reactor_read(reactor_handler_t *handler, void *buffer, size_t size);
+
+/**
+ * Like reactor_read, for a writev() (of a non-blocking fd, which isn't waited
+ * for: a full pipe fails with EAGAIN). The iov array must stay valid too.
+ */
+void reactor_writev(reactor_handler_t *handler, struct iovec const *iov,
+                    size_t count);
+
+/**
+ * Schedules the handler's on_notify callback on its loop thread. Notifying a
+ * handler that is already pending does nothing, so several notifications may
+ * result in a single call.
+ *
+ * Can be called from any thread, as long as the handler is not concurrently
+ * removed.
+ */
+void reactor_notify(reactor_handler_t *handler);
+
+#endif // __MBROKER_REACTOR_H__
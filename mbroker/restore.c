@@ -0,0 +1,194 @@
+#include "restore.h"
+#include "logging.h"
+#include "operations.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Boxes each thread restores, at least (fewer boxes are left to one thread)
+#define BOXES_PER_THREAD 1024
+// Bytes of a box read at once when counting its messages
+#define COUNT_CHUNK (64 * 1024)
+
+// A box found in TFS
+typedef struct {
+    char name[BOX_NAME_SIZE + 1];
+    size_t size;
+} found_box_t;
+
+typedef struct {
+    found_box_t *boxes;
+    size_t count;
+    size_t capacity;
+} found_list_t;
+
+// The boxes a thread restores
+typedef struct {
+    box_registry_t *registry;
+    found_box_t const *boxes;
+    size_t count;
+    size_t restored;
+} restore_range_t;
+
+/**
+ * Adds a file listed by tfs_list to the boxes found.
+ *
+ * Returns 0 if successful, -1 if out of memory (stopping the listing).
+ */
+static int collect(char const *name, size_t size, void *arg) {
+    found_list_t *found = (found_list_t *)arg;
+    if (strlen(name) > BOX_NAME_SIZE) {
+        WARN("Skipping /%s: name too long for a box", name);
+        return 0;
+    }
+
+    if (found->count == found->capacity) {
+        size_t capacity = found->capacity == 0 ? 64 : found->capacity * 2;
+        found_box_t *boxes =
+            realloc(found->boxes, capacity * sizeof(found_box_t));
+        if (boxes == NULL) {
+            return -1;
+        }
+        found->boxes = boxes;
+        found->capacity = capacity;
+    }
+
+    strcpy(found->boxes[found->count].name, name);
+    found->boxes[found->count].size = size;
+    found->count++;
+    return 0;
+}
+
+/**
+ * Counts the messages in a box, each ending with a '\0'.
+ *
+ * Input:
+ *   - box: the box
+ *   - chunk: buffer of COUNT_CHUNK bytes to read the box into
+ *
+ * Returns the number of messages, or -1 if the box can't be opened.
+ */
+static ssize_t count_messages(found_box_t const *box, char *chunk) {
+    if (box->size == 0) {
+        return 0; // no need to open it
+    }
+
+    char path[BOX_NAME_SIZE + 2];
+    path[0] = '/';
+    strcpy(path + 1, box->name);
+
+    int fd = tfs_open(path, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for (size_t offset = 0; offset < box->size;) {
+        ssize_t n = tfs_pread(fd, chunk, COUNT_CHUNK, offset);
+        if (n <= 0) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            count += chunk[i] == '\0';
+        }
+        offset += (size_t)n;
+    }
+
+    tfs_close(fd);
+    return (ssize_t)count;
+}
+
+/**
+ * Adds a range of the boxes found to the registry.
+ */
+static void *restore_range(void *arg) {
+    restore_range_t *range = (restore_range_t *)arg;
+
+    char *chunk = malloc(COUNT_CHUNK);
+    if (chunk == NULL) {
+        WARN("Failed to allocate restore buffer");
+        return NULL;
+    }
+
+    for (size_t i = 0; i < range->count; i++) {
+        found_box_t const *box = &range->boxes[i];
+        ssize_t n_messages = count_messages(box, chunk);
+        if (n_messages == -1) {
+            WARN("Failed to read box %s", box->name);
+            continue;
+        }
+
+        tfs_file file;
+        strcpy(file.box_name, box->name);
+        file.n_publishers = 0;
+        file.n_subscribers = 0;
+        file.box_size = box->size;
+        file.n_messages = (uint64_t)n_messages;
+        file.messages_out = 0;
+        file.bytes_out = 0;
+        if (registry_add(range->registry, &file) == 0) {
+            range->restored++;
+        }
+    }
+
+    free(chunk);
+    return NULL;
+}
+
+ssize_t restore_boxes(box_registry_t *registry, size_t n_threads) {
+    found_list_t found = {0};
+    if (tfs_list(collect, &found) != 0) {
+        free(found.boxes);
+        return -1;
+    }
+    if (found.count == 0) {
+        return 0;
+    }
+
+    size_t threads = found.count / BOXES_PER_THREAD + 1;
+    if (threads > n_threads) {
+        threads = n_threads > 0 ? n_threads : 1;
+    }
+    restore_range_t *ranges = calloc(threads, sizeof(restore_range_t));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    bool *started = calloc(threads, sizeof(bool));
+    if (ranges == NULL || ids == NULL || started == NULL) {
+        free(ranges);
+        free(ids);
+        free(started);
+        free(found.boxes);
+        return -1;
+    }
+
+    // The first range is restored by the calling thread, and any range whose
+    // thread can't be started too
+    size_t per_thread = (found.count + threads - 1) / threads;
+    for (size_t t = 0; t < threads; t++) {
+        size_t first = t * per_thread;
+        size_t end = first + per_thread;
+        first = first < found.count ? first : found.count;
+        end = end < found.count ? end : found.count;
+        ranges[t].registry = registry;
+        ranges[t].boxes = found.boxes + first;
+        ranges[t].count = end - first;
+        started[t] = t > 0 && pthread_create(&ids[t], NULL, restore_range,
+                                             &ranges[t]) == 0;
+    }
+
+    size_t restored = 0;
+    for (size_t t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        } else {
+            restore_range(&ranges[t]);
+        }
+        restored += ranges[t].restored;
+    }
+
+    free(ranges);
+    free(ids);
+    free(started);
+    free(found.boxes);
+    return (ssize_t)restored;
+}
@@ -0,0 +1,25 @@
+#ifndef __MBROKER_RESTORE_H__
+#define __MBROKER_RESTORE_H__
+
+#include "registry.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Adds every box stored in TFS (e.g. in an image kept from a previous run) to
+ * the registry, with its size and number of messages, so a restarted broker
+ * serves them as it did before.
+ *
+ * The root directory is listed in a single pass; the boxes are then split
+ * among up to n_threads threads, which count their messages (every message
+ * ends with a '\0') and add them to the registry.
+ *
+ * Input:
+ *   - registry: registry to add the boxes to
+ *   - n_threads: maximum number of threads to use
+ *
+ * Returns the number of boxes restored, or -1 if out of memory.
+ */
+ssize_t restore_boxes(box_registry_t *registry, size_t n_threads);
+
+#endif // __MBROKER_RESTORE_H__
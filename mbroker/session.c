@@ -0,0 +1,1029 @@
+#include "session.h"
+#include "frame.h"
+#include "logging.h"
+#include "message_ring.h"
+#include "metrics.h"
+#include "operations.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "shm_ring.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Publisher and subscriber sessions, served by the reactor threads.
+//
+// Session pipes are non-blocking and every session is handled by a single
+// reactor thread, so a session only takes a thread while it has work to do.
+// Publishers are woken up by their pipe becoming readable; subscribers are
+// notified by the publisher (or by the box being removed), and by their pipe
+// becoming writable again after it filled up.
+//
+// Sessions over a shared ring (see shm_ring.h) pass their frames through it
+// instead, and are woken up by their client writing to the pipe when the ring
+// is no longer empty (publishers) or full (subscribers).
+//
+// With the reactor's io_uring engine, the pipes of the other sessions are read
+// and written through the ring (see reactor_read), one operation in flight per
+// session, whose completion queues the next.
+
+// Maximum number of packets read from a publisher's pipe at once
+#define PUBLISH_BATCH 16
+// Maximum number of messages appended to a box with one TFS write (far fewer
+// than a message ring holds, so messages reach the box in TFS well before they
+// are evicted from the ring). Only batches of very short messages need more
+// than one write
+#define PUBLISH_CHUNK 1024
+// Maximum number of messages written to a subscriber's pipe in one round, so a
+// subscriber catching up on a large box doesn't hog its reactor thread
+#define DELIVERY_BATCH 64
+// Size of the chunks a box is read in when delivering
+#define DELIVERY_CHUNK (4 * MESSAGE_SIZE)
+
+typedef enum { SESSION_PUBLISHER, SESSION_SUBSCRIBER } session_kind_t;
+
+/**
+ * A single write of frames to a subscriber's pipe: messages from the box's
+ * ring, written straight from the frames the ring shares among all the box's
+ * subscribers, or the whole messages at the start of a chunk read from the
+ * box, of which only the frame headers are built.
+ *
+ * Only as many messages as fit in PIPE_BUF are written at once, so, like a
+ * single frame, they are either written whole or not at all.
+ */
+typedef struct {
+    // Messages from the ring, held until the write is done (none for a chunk)
+    ring_message_t *messages[DELIVERY_BATCH];
+    size_t n_messages;
+    frame_header_t headers[DELIVERY_BATCH];
+    struct iovec iov[2 * DELIVERY_BATCH];
+    size_t iov_count;
+    // Number of messages, bytes of their frames, bytes they take in the box
+    // and box offset after the last one
+    size_t n;
+    size_t size;
+    size_t bytes;
+    size_t offset;
+    char chunk[DELIVERY_CHUNK];
+} delivery_t;
+
+struct session {
+    // Must be the first member (the reactor callbacks get a pointer to it)
+    reactor_handler_t handler;
+    session_kind_t kind;
+    box_node_t *box;
+
+    // Ring shared with the client, or NULL if the frames go through the pipe
+    shm_ring_t *shm;
+
+    // Publisher: reader of the frames coming through the pipe
+    frame_reader_t *reader;
+
+    // Whether a read or write of the pipe is in flight in the reactor's
+    // io_uring, and (subscriber) the write, if the pipe is written through it
+    bool io_in_flight;
+    delivery_t *delivery;
+
+    // Subscriber: sequence number and box offset of the next message to
+    // deliver, epoll events currently watched, and links in the box's
+    // subscriber list
+    uint64_t seq;
+    size_t offset;
+    uint32_t events;
+    struct session *prev;
+    struct session *next;
+};
+
+typedef struct session session_t;
+
+static box_registry_t *boxes;
+
+int sessions_init(box_registry_t *registry, size_t n_threads,
+                  reactor_engine_t engine) {
+    boxes = registry;
+    return reactor_start(n_threads, engine);
+}
+
+/**
+ * Writes the TFS path name of a box ("/<box name>") to path, which must hold
+ * at least BOX_NAME_SIZE + 2 characters.
+ */
+static void box_path(box_node_t *box, char *path) {
+    path[0] = '/';
+    strcpy(path + 1, box->file.box_name);
+}
+
+static void finish_delivery(session_t *session, delivery_t *delivery,
+                            bool written);
+
+/**
+ * Detaches the session from its box and stops watching it, which frees it
+ * (see session_release).
+ *
+ * Must be called from the session's reactor thread.
+ */
+static void session_close(session_t *session) {
+    tfs_file *file = &session->box->file;
+
+    pthread_mutex_lock(&file->lock);
+    if (session->kind == SESSION_PUBLISHER) {
+        file->publisher = NULL;
+        file->n_publishers--;
+    } else {
+        if (session->prev == NULL) {
+            file->subscribers = session->next;
+        } else {
+            session->prev->next = session->next;
+        }
+        if (session->next != NULL) {
+            session->next->prev = session->prev;
+        }
+        file->n_subscribers--;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    // Once detached, nobody else can notify the session
+    reactor_remove(&session->handler);
+}
+
+/**
+ * Frees a session once the reactor is done with it, and with its pipe and
+ * buffers.
+ */
+static void session_release(reactor_handler_t *handler) {
+    session_t *session = (session_t *)handler;
+
+    if (session->delivery != NULL) {
+        if (session->io_in_flight) {
+            // Cancelled: lets go of its messages
+            finish_delivery(session, session->delivery, false);
+        }
+        free(session->delivery);
+    }
+    close(session->handler.fd);
+    if (session->shm != NULL) {
+        shm_ring_close(session->shm);
+        shm_ring_detach(session->shm);
+        free(session->shm);
+    }
+    registry_release(boxes, session->box);
+    free(session->reader);
+    free(session);
+}
+
+/**
+ * Reads the wake-ups a client of a shared ring wrote to its pipe.
+ *
+ * Returns 1 if successful, 0 if the client closed its end of the pipe, or -1
+ * on error.
+ */
+static int read_doorbell(session_t *session) {
+    char buffer[64];
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(session->handler.fd, buffer, sizeof(buffer));
+    } while (bytes_read > 0 || (bytes_read < 0 && errno == EINTR));
+
+    if (bytes_read == 0) {
+        return 0;
+    }
+    return errno == EAGAIN ? 1 : -1;
+}
+
+/**
+ * Wakes up the box's subscribers.
+ *
+ * The caller must hold the box lock.
+ */
+static void notify_subscribers(tfs_file *file) {
+    for (session_t *sub = file->subscribers; sub != NULL; sub = sub->next) {
+        reactor_notify(&sub->handler);
+    }
+}
+
+/**
+ * Appends the messages in a publisher packet (one, or several for a batch),
+ * each with its terminating '\0', to data.
+ *
+ * Input:
+ *   - packet: packet sent by the publisher
+ *   - data: where to append the messages
+ *   - size: bytes already in data, updated
+ *   - lens: where to append the length of each message
+ *   - n: number of messages in lens, updated
+ */
+static void collect_messages(packet_t const *packet, char *data, size_t *size,
+                             size_t *lens, size_t *n) {
+    char const *messages;
+    size_t length;
+    if (packet->opcode == PUBLISH_MESSAGE) {
+        messages = packet->payload.message_data.message;
+        length = strnlen(messages, MESSAGE_SIZE - 1);
+    } else {
+        messages = packet->payload.batch_data.messages;
+        length = packet->payload.batch_data.length;
+    }
+
+    // A missing '\0' at the end is added; an empty batch adds nothing
+    size_t pos = 0;
+    while (pos < length || (pos == 0 && packet->opcode == PUBLISH_MESSAGE)) {
+        size_t len = strnlen(messages + pos, length - pos);
+        memcpy(data + *size, messages + pos, len);
+        data[*size + len] = '\0';
+        *size += len + 1;
+        lens[(*n)++] = len + 1;
+        pos += len + 1;
+    }
+}
+
+/**
+ * Publishes n messages, stored back to back in data (size bytes), appending
+ * them to the box with a single TFS write.
+ *
+ * Only then are the messages added to the box's ring, from which the
+ * subscribers are served, and the subscribers notified, so the ring never
+ * holds a message the box doesn't, and the offsets of its messages are those
+ * in the box. If the box fills up, the messages written whole are still
+ * published; a message cut short is dropped from the box, so the next one
+ * isn't glued to it.
+ *
+ * Returns 0 if successful, -1 if the box can't be written.
+ */
+static int publish_messages(session_t *session, char const *data, size_t size,
+                            size_t const *lens, size_t n) {
+    tfs_file *file = &session->box->file;
+    uint64_t published = metrics_now();
+
+    char path[BOX_NAME_SIZE + 2];
+    box_path(session->box, path);
+
+    int box = tfs_open(path, TFS_O_APPEND);
+    if (box == -1) {
+        WARN("Failed to open box %s", path);
+        return -1;
+    }
+
+    // Only this session appends to the box, so its size can't change
+    // meanwhile
+    pthread_mutex_lock(&file->lock);
+    size_t box_size = file->box_size;
+    pthread_mutex_unlock(&file->lock);
+
+    LOG("Writing %zu messages to %s", n, path);
+    uint64_t start = metrics_now();
+    ssize_t written = tfs_write(box, data, size);
+    metrics_record(LATENCY_TFS_WRITE, metrics_now() - start);
+
+    size_t kept = 0;
+    size_t kept_n = 0;
+    while (kept_n < n && written > 0 &&
+           kept + lens[kept_n] <= (size_t)written) {
+        kept += lens[kept_n++];
+    }
+    int ret = 0;
+    if (written != (ssize_t)size) {
+        WARN("Failed to write to box %s", path);
+        ret = -1;
+        if (written > 0 && (size_t)written > kept &&
+            tfs_truncate(box, box_size + kept) == -1) {
+            WARN("Failed to drop a partial message from box %s", path);
+        }
+    }
+    if (tfs_close(box) == -1) {
+        WARN("Failed to close box %s", path);
+        ret = -1;
+    }
+    if (kept_n == 0) {
+        return ret;
+    }
+
+    pthread_mutex_lock(&file->lock);
+    if (file->ring == NULL) {
+        // Without a ring (out of memory), subscribers read the box itself
+        __atomic_store_n(&file->ring, message_ring_create(file->n_messages),
+                         __ATOMIC_RELEASE);
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < kept_n; i++) {
+        if (file->ring != NULL) {
+            message_ring_append(file->ring, data + pos, lens[i],
+                                file->box_size, published);
+        }
+        file->box_size += lens[i];
+        file->n_messages++;
+        pos += lens[i];
+    }
+    notify_subscribers(file);
+    pthread_mutex_unlock(&file->lock);
+
+    metrics_add(METRIC_MESSAGES_IN, (int64_t)kept_n);
+    metrics_add(METRIC_BYTES_IN, (int64_t)kept);
+    return ret;
+}
+
+/**
+ * Publishes the messages in packets (count of them), PUBLISH_CHUNK messages
+ * at a time.
+ *
+ * Returns 0 if successful, -1 if the box can't be written.
+ */
+static int publish(session_t *session, packet_t const *packets, size_t count) {
+    // Messages take at least 1 byte (the '\0'), plus 1 if it had to be added
+    static _Thread_local char data[PUBLISH_BATCH * (MESSAGE_SIZE + 1)];
+    static _Thread_local size_t lens[PUBLISH_BATCH * MESSAGE_SIZE];
+    size_t size = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (packets[i].opcode != PUBLISH_MESSAGE &&
+            packets[i].opcode != PUBLISH_MESSAGE_BATCH) {
+            WARN("Invalid opcode %d from publisher", packets[i].opcode);
+            continue;
+        }
+        collect_messages(&packets[i], data, &size, lens, &n);
+    }
+
+    size_t pos = 0;
+    for (size_t first = 0; first < n; first += PUBLISH_CHUNK) {
+        size_t chunk_n = n - first < PUBLISH_CHUNK ? n - first : PUBLISH_CHUNK;
+        size_t chunk_size = 0;
+        for (size_t i = first; i < first + chunk_n; i++) {
+            chunk_size += lens[i];
+        }
+
+        if (publish_messages(session, data + pos, chunk_size, lens + first,
+                             chunk_n) == -1) {
+            return -1;
+        }
+        pos += chunk_size;
+    }
+    return 0;
+}
+
+/**
+ * Queues a read of the publisher's pipe into its reader through the reactor's
+ * io_uring (unless one is in flight already), for publisher_on_io.
+ */
+static void publisher_read(session_t *session) {
+    if (!session->io_in_flight) {
+        size_t size;
+        char *space = frame_reader_space(session->reader, &size);
+        reactor_read(&session->handler, space, size);
+        session->io_in_flight = true;
+    }
+}
+
+/**
+ * Publishes the frames sent by the publisher, up to PUBLISH_BATCH at a time,
+ * ending the session if the publisher left or the box was removed.
+ *
+ * Only frames already buffered are published unless from_pipe is set (the
+ * pipe was reported readable): reading a pipe whose writer hasn't opened it
+ * yet would look like the publisher leaving. With io_uring, the pipe is never
+ * read here; a read is queued once the buffered frames are published.
+ */
+static void publisher_drain(session_t *session, bool from_pipe) {
+    tfs_file *file = &session->box->file;
+
+    if (__atomic_load_n(&file->removed, __ATOMIC_ACQUIRE)) {
+        session_close(session);
+        return;
+    }
+
+    packet_t packets[PUBLISH_BATCH];
+    size_t count = 0;
+    int ret;
+    if (from_pipe) {
+        ret = frame_read(session->reader, &packets[0]);
+        if (ret == 0) {
+            // The publisher closed its end of the pipe
+            LOG("Publisher of %s left", file->box_name);
+            session_close(session);
+            return;
+        }
+    } else {
+        ret = frame_next(session->reader, &packets[0]);
+    }
+
+    // Whatever else was read along with the first frame
+    while (ret == 1 && ++count < PUBLISH_BATCH) {
+        ret = frame_next(session->reader, &packets[count]);
+    }
+    int error = ret < 0 ? errno : 0;
+
+    if (count > 0 && publish(session, packets, count) == -1) {
+        session_close(session);
+        return;
+    }
+
+    if (ret < 0 && error != EAGAIN) {
+        WARN("Failed to read from publisher of %s: %s", file->box_name,
+             strerror(error));
+        session_close(session);
+        return;
+    }
+
+    if (count == PUBLISH_BATCH) {
+        // There may be more frames buffered, which epoll won't report
+        reactor_notify(&session->handler);
+    } else if (reactor_has_ring(&session->handler)) {
+        publisher_read(session);
+    }
+}
+
+static void publisher_on_io(reactor_handler_t *handler, ssize_t result) {
+    session_t *session = (session_t *)handler;
+    session->io_in_flight = false;
+
+    if (result == 0) {
+        // The publisher closed its end of the pipe
+        LOG("Publisher of %s left", session->box->file.box_name);
+        session_close(session);
+        return;
+    }
+    if (result < 0 && result != -EAGAIN) {
+        WARN("Failed to read from publisher of %s: %s",
+             session->box->file.box_name, strerror((int)-result));
+        session_close(session);
+        return;
+    }
+
+    if (result > 0) {
+        frame_reader_add(session->reader, (size_t)result);
+    }
+    publisher_drain(session, false);
+}
+
+/**
+ * Like publisher_drain, for a publisher that sends its frames through a
+ * shared ring: the pipe only carries its wake-ups (and its hang-up), and is
+ * read when from_pipe is set.
+ */
+static void publisher_drain_shm(session_t *session, bool from_pipe) {
+    tfs_file *file = &session->box->file;
+
+    if (__atomic_load_n(&file->removed, __ATOMIC_ACQUIRE)) {
+        session_close(session);
+        return;
+    }
+
+    // A publisher that left may still have frames in the ring
+    int doorbell = from_pipe ? read_doorbell(session) : 1;
+
+    packet_t packets[PUBLISH_BATCH];
+    size_t count = 0;
+    char const *data;
+    ssize_t available = shm_ring_peek(session->shm, &data);
+    size_t used = 0;
+    ssize_t size = 0;
+    while (available > 0 && count < PUBLISH_BATCH) {
+        frame_header_t header;
+        char const *payload;
+        size = frame_parse(data + used, (size_t)available - used, &header,
+                           &payload);
+        if (size <= 0) {
+            break;
+        }
+        frame_decode(&header, payload, &packets[count++]);
+        used += (size_t)size;
+    }
+    shm_ring_consume(session->shm, used);
+
+    if (available < 0 || size < 0 || doorbell == -1) {
+        WARN("Failed to read from publisher of %s", file->box_name);
+        session_close(session);
+        return;
+    }
+
+    if (count > 0 && publish(session, packets, count) == -1) {
+        session_close(session);
+        return;
+    }
+
+    if (count == PUBLISH_BATCH) {
+        // There may be more frames in the ring
+        reactor_notify(&session->handler);
+    } else if (doorbell == 0) {
+        LOG("Publisher of %s left", file->box_name);
+        session_close(session);
+    } else if (!shm_ring_consumer_sleep(session->shm,
+                                        (size_t)available - used)) {
+        // Written after the ring was read
+        reactor_notify(&session->handler);
+    }
+}
+
+static void publisher_on_event(reactor_handler_t *handler, uint32_t events) {
+    (void)events; // whatever happened, read() tells the rest
+    session_t *session = (session_t *)handler;
+    if (session->shm != NULL) {
+        publisher_drain_shm(session, true);
+    } else {
+        publisher_drain(session, !reactor_has_ring(handler));
+    }
+}
+
+static void publisher_on_notify(reactor_handler_t *handler) {
+    // Notified when added, when the box is removed and to continue draining
+    session_t *session = (session_t *)handler;
+    if (session->shm != NULL) {
+        publisher_drain_shm(session, false);
+    } else {
+        publisher_drain(session, false);
+    }
+}
+
+/**
+ * Writes frames to the subscriber's pipe with a single writev(), or copies
+ * them into its shared ring.
+ *
+ * Input:
+ *   - session: the subscriber
+ *   - iov: the frames' bytes, at most PIPE_BUF of them in all (so they are
+ *     either written whole or not at all)
+ *   - count: number of entries in iov
+ *
+ * Returns 1 if they were written, 0 if the pipe (or ring) is full, or -1 if
+ * the subscriber is gone.
+ */
+static int send_frames(session_t *session, struct iovec const *iov,
+                       size_t count) {
+    if (session->shm != NULL) {
+        // A full ring marks the session as sleeping, for the subscriber to
+        // wake it up once it makes room
+        return shm_ring_write(session->shm, iov, count);
+    }
+
+    ssize_t written;
+    do {
+        written = writev(session->handler.fd, iov, (int)count);
+    } while (written < 0 && errno == EINTR);
+
+    if (written < 0) {
+        return errno == EAGAIN ? 0 : -1;
+    }
+    return 1;
+}
+
+/**
+ * Prepares the write of the subscriber's next messages in the ring (at most
+ * max of them).
+ *
+ * Input:
+ *   - session: the subscriber
+ *   - ring: the box's ring
+ *   - max: maximum number of messages to write, at most DELIVERY_BATCH
+ *   - delivery: the write
+ *
+ * Returns whether the message after the last one taken is in the ring (RING_OK
+ * if it didn't fit in the write).
+ */
+static ring_result_t prepare_messages(session_t *session, message_ring_t *ring,
+                                      size_t max, delivery_t *delivery) {
+    ring_result_t result = RING_OK;
+    size_t n = 0;
+    delivery->size = 0;
+    delivery->bytes = 0;
+    while (n < max) {
+        ring_message_t *message;
+        result = message_ring_acquire(ring, session->seq + n, &message);
+        if (result != RING_OK) {
+            break;
+        }
+        if (delivery->size + message->frame_size > PIPE_BUF) {
+            message_release(message);
+            break;
+        }
+        delivery->messages[n] = message;
+        delivery->iov[n].iov_base = message->frame;
+        delivery->iov[n].iov_len = message->frame_size;
+        delivery->size += message->frame_size;
+        delivery->bytes += message->len;
+        delivery->offset = message->offset + message->len;
+        n++;
+    }
+    delivery->n = n;
+    delivery->n_messages = n;
+    delivery->iov_count = n;
+    return result;
+}
+
+/**
+ * Prepares the write of the whole messages at the start of the chunk read
+ * from the box (at most max of them).
+ *
+ * Input:
+ *   - session: the subscriber, whose next message starts the chunk
+ *   - delivery: the write, with the chunk
+ *   - size: number of bytes in the chunk
+ *   - max: maximum number of messages to write, at most DELIVERY_BATCH
+ */
+static void prepare_chunk(session_t *session, delivery_t *delivery,
+                          size_t size, size_t max) {
+    char const *chunk = delivery->chunk;
+    size_t n = 0;
+    size_t used = 0;
+    size_t frames_size = 0;
+    char const *end;
+    while (n < max && (end = memchr(chunk + used, '\0', size - used)) != NULL) {
+        // The frame carries the message without its '\0'
+        size_t len = (size_t)(end - (chunk + used)) + 1;
+        size_t length = len <= MESSAGE_SIZE ? len - 1 : MESSAGE_SIZE - 1;
+        if (frames_size + sizeof(frame_header_t) + length > PIPE_BUF) {
+            break;
+        }
+
+        delivery->headers[n].opcode = SEND_MESSAGE;
+        delivery->headers[n].length = (uint16_t)length;
+        delivery->iov[2 * n].iov_base = &delivery->headers[n];
+        delivery->iov[2 * n].iov_len = sizeof(frame_header_t);
+        delivery->iov[2 * n + 1].iov_base = (void *)(chunk + used);
+        delivery->iov[2 * n + 1].iov_len = length;
+        frames_size += sizeof(frame_header_t) + length;
+        used += len;
+        n++;
+    }
+    delivery->n = n;
+    delivery->n_messages = 0;
+    delivery->iov_count = 2 * n;
+    delivery->size = frames_size;
+    delivery->bytes = used;
+    delivery->offset = session->offset + used;
+}
+
+/**
+ * Prepares the write of the messages the subscriber is missing (at most max of
+ * them). Messages still in the box's ring are written from there; older ones
+ * are read from the box in TFS.
+ *
+ * Input:
+ *   - session: the subscriber
+ *   - delivery: the write
+ *   - max: maximum number of messages to write, at most DELIVERY_BATCH
+ *   - box: the box opened in TFS, or -1 (then opened if needed, for the caller
+ *     to close)
+ *
+ * Returns 1 if there is something to write, 0 if the subscriber is up to date,
+ * or -1 if the box can't be read.
+ */
+static int prepare_delivery(session_t *session, delivery_t *delivery,
+                            size_t max, int *box) {
+    tfs_file *file = &session->box->file;
+
+    message_ring_t *ring = __atomic_load_n(&file->ring, __ATOMIC_ACQUIRE);
+    if (ring != NULL) {
+        ring_result_t result = prepare_messages(session, ring, max, delivery);
+        if (delivery->n > 0) {
+            return 1;
+        }
+        if (result == RING_NOT_YET) {
+            return 0; // up to date
+        }
+    }
+
+    // Evicted: read the next chunk of the box instead
+    if (*box == -1) {
+        char path[BOX_NAME_SIZE + 2];
+        box_path(session->box, path);
+        *box = tfs_open(path, 0);
+        if (*box == -1) {
+            WARN("Failed to open box %s", path);
+            return -1;
+        }
+    }
+
+    ssize_t bytes_read = tfs_pread(*box, delivery->chunk,
+                                   sizeof(delivery->chunk), session->offset);
+    if (bytes_read <= 0) {
+        return 0; // up to date
+    }
+
+    // A message cut at the end of the chunk is read again, whole, with the
+    // next one; without a whole message, only part of one was written to the
+    // box so far
+    prepare_chunk(session, delivery, (size_t)bytes_read, max);
+    return delivery->n > 0 ? 1 : 0;
+}
+
+/**
+ * Ends a write of frames to the subscriber: moves past its messages if they
+ * were written, and lets go of those from the ring.
+ */
+static void finish_delivery(session_t *session, delivery_t *delivery,
+                            bool written) {
+    if (written) {
+        if (delivery->n_messages > 0) {
+            LOG("Sent %zu messages", delivery->n);
+        } else {
+            LOG("Sent %zu messages from the box", delivery->n);
+        }
+        uint64_t now = metrics_now();
+        for (size_t i = 0; i < delivery->n_messages; i++) {
+            metrics_record(LATENCY_PUBLISH_TO_DELIVER,
+                           now - delivery->messages[i]->published);
+        }
+        session->seq += delivery->n;
+        session->offset = delivery->offset;
+    }
+
+    for (size_t i = 0; i < delivery->n_messages; i++) {
+        message_release(delivery->messages[i]);
+    }
+    delivery->n_messages = 0;
+}
+
+/**
+ * Counts n messages (bytes long) delivered to the subscriber.
+ */
+static void count_delivered(session_t *session, size_t n, size_t bytes) {
+    tfs_file *file = &session->box->file;
+    if (n > 0) {
+        metrics_add(METRIC_MESSAGES_OUT, (int64_t)n);
+        metrics_add(METRIC_BYTES_OUT, (int64_t)bytes);
+        __atomic_fetch_add(&file->messages_out, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&file->bytes_out, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Writes the messages the subscriber is missing to its pipe, until there are
+ * none left, the pipe is full or DELIVERY_BATCH messages were sent.
+ *
+ * Returns the number of messages sent, or -1 if the session must end.
+ */
+static ssize_t deliver(session_t *session, bool *blocked) {
+    // Only opened if some message is no longer in the ring
+    int box = -1;
+    delivery_t delivery;
+
+    size_t sent = 0;
+    size_t bytes = 0;
+    int ret = 0;
+    *blocked = false;
+    while (sent < DELIVERY_BATCH) {
+        ret = prepare_delivery(session, &delivery, DELIVERY_BATCH - sent, &box);
+        if (ret != 1) {
+            break;
+        }
+
+        ret = send_frames(session, delivery.iov, delivery.iov_count);
+        finish_delivery(session, &delivery, ret == 1);
+        if (ret != 1) {
+            *blocked = ret == 0;
+            break;
+        }
+        sent += delivery.n;
+        bytes += delivery.bytes;
+    }
+
+    if (box != -1) {
+        tfs_close(box);
+    }
+    if (ret == -1) {
+        return -1;
+    }
+
+    count_delivered(session, sent, bytes);
+    return (ssize_t)sent;
+}
+
+/**
+ * Changes the epoll events watched for the subscriber's pipe, ending the
+ * session if that fails.
+ *
+ * Returns 0 if successful, -1 if the session ended.
+ */
+static int subscriber_watch(session_t *session, uint32_t events) {
+    if (events != session->events) {
+        if (reactor_modify(&session->handler, events) == -1) {
+            session_close(session);
+            return -1;
+        }
+        session->events = events;
+    }
+    return 0;
+}
+
+/**
+ * Like deliver, for a subscriber whose pipe is written through the reactor's
+ * io_uring: queues a write of the subscriber's next messages (unless one is in
+ * flight already), whose completion (subscriber_on_io) queues the next one.
+ */
+static void deliver_ring(session_t *session) {
+    if (session->io_in_flight) {
+        return;
+    }
+
+    int box = -1;
+    int ret = prepare_delivery(session, session->delivery, DELIVERY_BATCH,
+                               &box);
+    if (box != -1) {
+        tfs_close(box);
+    }
+    if (ret == -1) {
+        session_close(session);
+        return;
+    }
+
+    if (ret == 1) {
+        reactor_writev(&session->handler, session->delivery->iov,
+                       session->delivery->iov_count);
+        session->io_in_flight = true;
+    }
+    // Only hang-ups are watched while the pipe has room
+    subscriber_watch(session, 0);
+}
+
+/**
+ * Delivers whatever the subscriber is missing, watching the pipe for room if
+ * it fills up.
+ */
+static void subscriber_deliver(session_t *session) {
+    if (__atomic_load_n(&session->box->file.removed, __ATOMIC_ACQUIRE)) {
+        session_close(session);
+        return;
+    }
+
+    if (session->shm == NULL && reactor_has_ring(&session->handler)) {
+        if (session->delivery == NULL) {
+            session->delivery = malloc(sizeof(delivery_t));
+            if (session->delivery == NULL) {
+                session_close(session);
+                return;
+            }
+            session->delivery->n_messages = 0;
+        }
+        deliver_ring(session);
+        return;
+    }
+
+    bool blocked;
+    ssize_t sent = deliver(session, &blocked);
+    if (sent == -1) {
+        session_close(session);
+        return;
+    }
+
+    // A shared ring's pipe is always watched, for the wake-ups
+    uint32_t events = session->shm != NULL ? EPOLLIN : blocked ? EPOLLOUT : 0;
+    if (subscriber_watch(session, events) == -1) {
+        return;
+    }
+
+    if (!blocked && sent == DELIVERY_BATCH) {
+        // There may be more; continue after the other sessions had their turn
+        reactor_notify(&session->handler);
+    }
+}
+
+static void subscriber_on_io(reactor_handler_t *handler, ssize_t result) {
+    session_t *session = (session_t *)handler;
+    delivery_t *delivery = session->delivery;
+    session->io_in_flight = false;
+
+    // Writes of at most PIPE_BUF bytes are never short
+    bool written = result == (ssize_t)delivery->size;
+    finish_delivery(session, delivery, written);
+    if (written) {
+        count_delivered(session, delivery->n, delivery->bytes);
+        subscriber_deliver(session);
+    } else if (result == -EAGAIN) {
+        // The pipe is full: delivered again once it has room
+        subscriber_watch(session, EPOLLOUT);
+    } else {
+        LOG("Subscriber of %s left", session->box->file.box_name);
+        session_close(session);
+    }
+}
+
+static void subscriber_on_event(reactor_handler_t *handler, uint32_t events) {
+    session_t *session = (session_t *)handler;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        // The subscriber closed its end of the pipe
+        LOG("Subscriber of %s left", session->box->file.box_name);
+        session_close(session);
+        return;
+    }
+
+    if (events & EPOLLIN) {
+        int doorbell = read_doorbell(session);
+        if (doorbell != 1) {
+            LOG("Subscriber of %s left", session->box->file.box_name);
+            session_close(session);
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLOUT)) {
+        subscriber_deliver(session);
+    }
+}
+
+static void subscriber_on_notify(reactor_handler_t *handler) {
+    subscriber_deliver((session_t *)handler);
+}
+
+static session_t *session_new(session_kind_t kind, box_node_t *box, int pipe,
+                              shm_ring_t *shm) {
+    session_t *session = calloc(1, sizeof(session_t));
+    if (session == NULL) {
+        return NULL;
+    }
+
+    session->kind = kind;
+    session->box = box;
+    session->handler.fd = pipe;
+    session->shm = shm;
+    session->handler.on_release = session_release;
+    if (kind == SESSION_PUBLISHER && shm != NULL) {
+        session->handler.on_event = publisher_on_event;
+        session->handler.on_notify = publisher_on_notify;
+    } else if (kind == SESSION_PUBLISHER) {
+        session->reader = malloc(sizeof(frame_reader_t));
+        if (session->reader == NULL) {
+            free(session);
+            return NULL;
+        }
+        frame_reader_init(session->reader, pipe);
+        session->handler.on_event = publisher_on_event;
+        session->handler.on_notify = publisher_on_notify;
+        session->handler.on_io = publisher_on_io;
+    } else {
+        session->handler.on_event = subscriber_on_event;
+        session->handler.on_notify = subscriber_on_notify;
+        session->handler.on_io = subscriber_on_io;
+    }
+    return session;
+}
+
+int session_publisher_start(box_node_t *box, int pipe, shm_ring_t *shm) {
+    session_t *session = session_new(SESSION_PUBLISHER, box, pipe, shm);
+    if (session == NULL) {
+        return -1;
+    }
+
+    // The session is added to the reactor under the box lock, so it can't end
+    // (which needs the lock) before it is fully attached
+    tfs_file *file = &box->file;
+    pthread_mutex_lock(&file->lock);
+    if (file->removed || file->publisher != NULL ||
+        reactor_add(&session->handler, EPOLLIN) == -1) {
+        pthread_mutex_unlock(&file->lock);
+        free(session->reader);
+        free(session);
+        return -1;
+    }
+    file->publisher = session;
+    file->n_publishers++;
+    pthread_mutex_unlock(&file->lock);
+
+    return 0;
+}
+
+int session_subscriber_start(box_node_t *box, int pipe, shm_ring_t *shm) {
+    session_t *session = session_new(SESSION_SUBSCRIBER, box, pipe, shm);
+    if (session == NULL) {
+        return -1;
+    }
+
+    // Only hang-ups (and a shared ring's wake-ups) are watched until the pipe
+    // fills up; the initial notification delivers the messages already in the
+    // box
+    session->events = shm != NULL ? EPOLLIN : 0;
+    tfs_file *file = &box->file;
+    pthread_mutex_lock(&file->lock);
+    if (file->removed ||
+        reactor_add(&session->handler, session->events) == -1) {
+        pthread_mutex_unlock(&file->lock);
+        free(session);
+        return -1;
+    }
+    session->next = file->subscribers;
+    if (file->subscribers != NULL) {
+        file->subscribers->prev = session;
+    }
+    file->subscribers = session;
+    file->n_subscribers++;
+    pthread_mutex_unlock(&file->lock);
+
+    return 0;
+}
+
+void sessions_box_removed(box_node_t *box) {
+    tfs_file *file = &box->file;
+
+    pthread_mutex_lock(&file->lock);
+    __atomic_store_n(&file->removed, true, __ATOMIC_RELEASE);
+    if (file->publisher != NULL) {
+        reactor_notify(&file->publisher->handler);
+    }
+    for (session_t *sub = file->subscribers; sub != NULL; sub = sub->next) {
+        reactor_notify(&sub->handler);
+    }
+    pthread_mutex_unlock(&file->lock);
+}
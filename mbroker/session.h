@@ -0,0 +1,64 @@
+#ifndef __MBROKER_SESSION_H__
+#define __MBROKER_SESSION_H__
+
+#include "reactor.h"
+#include "registry.h"
+#include "shm_ring.h"
+#include <stddef.h>
+
+/**
+ * Starts the reactor threads that serve publisher and subscriber sessions.
+ *
+ * Input:
+ *   - boxes: registry the boxes of the sessions belong to
+ *   - n_threads: number of reactor threads
+ *   - engine: how the reactor threads wait for I/O (see reactor_start)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int sessions_init(box_registry_t *boxes, size_t n_threads,
+                  reactor_engine_t engine);
+
+/**
+ * Attaches a publisher session to a box. From then on, the messages read from
+ * the pipe are appended to the box (and delivered to its subscribers).
+ *
+ * Input:
+ *   - box: box to publish to, with a reference taken by registry_acquire
+ *   - pipe: non-blocking read end of the publisher's pipe
+ *   - shm: ring the publisher writes its frames to (allocated with malloc),
+ *     or NULL if it writes them to the pipe
+ *
+ * On success, the session takes over the box reference, the pipe and the
+ * ring, and releases/closes them when it ends.
+ *
+ * Returns 0 if successful, -1 if the box already has a publisher or was
+ * removed meanwhile.
+ */
+int session_publisher_start(box_node_t *box, int pipe, shm_ring_t *shm);
+
+/**
+ * Attaches a subscriber session to a box. Every message in the box, and every
+ * message published to it from then on, is written to the pipe (or ring).
+ *
+ * Input:
+ *   - box: box to subscribe, with a reference taken by registry_acquire
+ *   - pipe: non-blocking write end of the subscriber's pipe, or its read end
+ *     if shm is set
+ *   - shm: ring to write the subscriber's frames to (allocated with malloc),
+ *     or NULL to write them to the pipe
+ *
+ * On success, the session takes over the box reference, the pipe and the
+ * ring, and releases/closes them when it ends.
+ *
+ * Returns 0 if successful, -1 if the box was removed meanwhile.
+ */
+int session_subscriber_start(box_node_t *box, int pipe, shm_ring_t *shm);
+
+/**
+ * Ends every session attached to a box that has been removed from the registry.
+ * The sessions end asynchronously, closing their pipes.
+ */
+void sessions_box_removed(box_node_t *box);
+
+#endif // __MBROKER_SESSION_H__
@@ -0,0 +1,124 @@
+#define _GNU_SOURCE // syscall
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = cq_entries;
+
+    int fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    if (fd == -1 && errno == EINVAL) {
+        // Kernels before 5.19 don't know COOP_TASKRUN
+        params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+        fd = (int)syscall(SYS_io_uring_setup, entries, &params);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    // Both rings in a single mapping, no completions dropped when the ring
+    // is full, reads and writes at the current position (of pipes), and poll
+    // masks of 32 bits, are needed (kernel 5.9); everything else used (reads,
+    // writes, linked polls, poll and operation cancellation) is older
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_RW_CUR_POS) ||
+        !(params.features & IORING_FEAT_POLL_32BITS)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->ring_map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_map, ring->ring_map_size);
+        close(fd);
+        return -1;
+    }
+
+    char *map = ring->ring_map;
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)(map + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(map + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(map + params.sq_off.array);
+    ring->to_submit = 0;
+    ring->cq_head = (unsigned *)(map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(map + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+    return 0;
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+           ring->sq_mask) {
+        // Full: the kernel takes the queued entries (and makes room) as soon
+        // as they are submitted
+        if (uring_enter(ring, false) == -1 && errno != EINTR &&
+            errno != EAGAIN && errno != EBUSY) {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    // Published to the kernel only by the next uring_enter
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+int uring_enter(uring_t *ring, bool wait) {
+    unsigned to_submit = ring->to_submit;
+    unsigned flags = 0;
+    unsigned min_complete = 0;
+    if (wait && uring_peek_cqe(ring) == NULL) {
+        flags = IORING_ENTER_GETEVENTS;
+        min_complete = 1;
+    }
+    if (to_submit == 0 && flags == 0) {
+        return 0;
+    }
+
+    long submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit,
+                             min_complete, flags, NULL, 0);
+    if (submitted < 0) {
+        return -1;
+    }
+    ring->to_submit -= (unsigned)submitted;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
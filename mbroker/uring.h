@@ -0,0 +1,78 @@
+#ifndef __MBROKER_URING_H__
+#define __MBROKER_URING_H__
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * An io_uring instance, set up and driven with the raw system calls (there is
+ * no liburing to depend on).
+ *
+ * Only the thread that owns a ring may use it: entries are queued in the
+ * submission ring without system calls, and handed to the kernel together by
+ * the next uring_enter (or by uring_get_sqe, if the ring is full).
+ */
+typedef struct {
+    int fd;
+
+    // Submission ring, shared with the kernel, and its entries
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    // Entries queued since the last uring_enter
+    unsigned to_submit;
+
+    // Completion ring, shared with the kernel
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_map;
+    size_t ring_map_size;
+    size_t sqes_size;
+} uring_t;
+
+/**
+ * Sets up a ring.
+ *
+ * Input:
+ *   - ring: the ring to initialize
+ *   - entries: size of the submission ring (a power of two)
+ *   - cq_entries: size of the completion ring (a power of two, at least
+ *     entries), which should fit every operation in flight at once
+ *
+ * Returns 0 if successful, -1 (with errno set) if the kernel doesn't support
+ * io_uring (or the features used here) or doesn't allow it.
+ */
+int uring_init(uring_t *ring, unsigned entries, unsigned cq_entries);
+
+/**
+ * Returns a zeroed submission entry to fill in, handing the queued entries to
+ * the kernel first if the ring is full, or NULL if that fails.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * Hands the queued entries to the kernel, and waits for a completion if wait
+ * is set and there is none yet, all with a single system call.
+ *
+ * Returns 0 if successful, -1 with errno set on error (EINTR if interrupted).
+ */
+int uring_enter(uring_t *ring, bool wait);
+
+/**
+ * Returns the oldest completion not yet seen, or NULL if there is none.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * Frees the completion returned by uring_peek_cqe, which must not be used
+ * afterwards.
+ */
+void uring_cqe_seen(uring_t *ring);
+
+#endif // __MBROKER_URING_H__
@@ -0,0 +1,259 @@
+#include "producer-consumer.h"
+
+// Lock-free implementation, built with `make PCQ=lockfree`
+//
+// Bounded MPMC ring with a sequence number per slot: producers and consumers
+// claim positions by CAS on pcq_tail/pcq_head (which here are ever-increasing
+// positions, not indices) and hand slots over through the slot's sequence
+// number, so neither side takes a lock while the queue is neither empty nor
+// full. Threads only park on the condvars when they find it empty/full, and
+// the other side only takes the condvar lock when someone is parked.
+//
+// The header's layout is shared with the lock-based implementation, so the
+// ring (slots plus the parked thread counters) lives behind pcq_buffer.
+#ifdef PCQ_LOCK_FREE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+    size_t seq;
+    void *elem;
+} pcq_slot_t;
+
+typedef struct {
+    size_t waiting_poppers;
+    size_t waiting_pushers;
+    pcq_slot_t slots[];
+} pcq_ring_t;
+
+static pcq_ring_t *ring_of(pc_queue_t *queue) {
+    return (pcq_ring_t *)(void *)queue->pcq_buffer;
+}
+
+int pcq_create(pc_queue_t *queue, size_t capacity) {
+    pcq_ring_t *ring =
+        malloc(sizeof(pcq_ring_t) + capacity * sizeof(pcq_slot_t));
+    if (ring == NULL) {
+        return -1;
+    }
+
+    ring->waiting_poppers = 0;
+    ring->waiting_pushers = 0;
+    // Slot i is free for the producer claiming position i
+    for (size_t i = 0; i < capacity; i++) {
+        ring->slots[i].seq = i;
+        ring->slots[i].elem = NULL;
+    }
+
+    queue->pcq_buffer = (void **)(void *)ring;
+    queue->pcq_capacity = capacity;
+    queue->pcq_current_size = 0;
+    queue->pcq_head = 0;
+    queue->pcq_tail = 0;
+
+    pthread_mutex_init(&queue->pcq_pusher_condvar_lock, NULL);
+    pthread_cond_init(&queue->pcq_pusher_condvar, NULL);
+
+    pthread_mutex_init(&queue->pcq_popper_condvar_lock, NULL);
+    pthread_cond_init(&queue->pcq_popper_condvar, NULL);
+    return 0;
+}
+
+int pcq_destroy(pc_queue_t *queue) {
+    free(queue->pcq_buffer);
+    pthread_cond_destroy(&queue->pcq_popper_condvar);
+    pthread_mutex_destroy(&queue->pcq_popper_condvar_lock);
+    pthread_cond_destroy(&queue->pcq_pusher_condvar);
+    pthread_mutex_destroy(&queue->pcq_pusher_condvar_lock);
+
+    return 0;
+}
+
+/**
+ * Claim and fill up to count consecutive free slots with a single CAS.
+ *
+ * Returns the number of elements enqueued (0 if the queue is full).
+ */
+static size_t try_enqueue_many(pc_queue_t *queue, void **elems,
+                               size_t count) {
+    pcq_ring_t *ring = ring_of(queue);
+    size_t pos = __atomic_load_n(&queue->pcq_tail, __ATOMIC_RELAXED);
+
+    while (true) {
+        // Count how many slots from pos on are free for their position
+        size_t n = 0;
+        intptr_t diff = 0;
+        while (n < count && n < queue->pcq_capacity) {
+            pcq_slot_t *slot = &ring->slots[(pos + n) % queue->pcq_capacity];
+            size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            diff = (intptr_t)seq - (intptr_t)(pos + n);
+            if (diff != 0) {
+                break;
+            }
+            n++;
+        }
+
+        if (n == 0) {
+            if (diff < 0) {
+                return 0; // slot still holds the element of the previous lap
+            }
+            // Another producer got here first
+            pos = __atomic_load_n(&queue->pcq_tail, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Claim the slots
+        if (__atomic_compare_exchange_n(&queue->pcq_tail, &pos, pos + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (size_t i = 0; i < n; i++) {
+                pcq_slot_t *slot =
+                    &ring->slots[(pos + i) % queue->pcq_capacity];
+                slot->elem = elems[i];
+                __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+        // pos was reloaded by the failed CAS
+    }
+}
+
+/**
+ * Claim and empty up to count consecutive published slots with a single CAS.
+ *
+ * Returns the number of elements dequeued (0 if the queue is empty).
+ */
+static size_t try_dequeue_many(pc_queue_t *queue, void **elems,
+                               size_t count) {
+    pcq_ring_t *ring = ring_of(queue);
+    size_t pos = __atomic_load_n(&queue->pcq_head, __ATOMIC_RELAXED);
+
+    while (true) {
+        // Count how many slots from pos on hold the element for their position
+        size_t n = 0;
+        intptr_t diff = 0;
+        while (n < count && n < queue->pcq_capacity) {
+            pcq_slot_t *slot = &ring->slots[(pos + n) % queue->pcq_capacity];
+            size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            diff = (intptr_t)seq - (intptr_t)(pos + n + 1);
+            if (diff != 0) {
+                break;
+            }
+            n++;
+        }
+
+        if (n == 0) {
+            if (diff < 0) {
+                return 0; // nothing published at this position yet
+            }
+            // Another consumer got here first
+            pos = __atomic_load_n(&queue->pcq_head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Claim the slots
+        if (__atomic_compare_exchange_n(&queue->pcq_head, &pos, pos + n, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            for (size_t i = 0; i < n; i++) {
+                pcq_slot_t *slot =
+                    &ring->slots[(pos + i) % queue->pcq_capacity];
+                elems[i] = slot->elem;
+                // Free the slot for the producer one lap ahead
+                __atomic_store_n(&slot->seq, pos + i + queue->pcq_capacity,
+                                 __ATOMIC_RELEASE);
+            }
+            return n;
+        }
+        // pos was reloaded by the failed CAS
+    }
+}
+
+/**
+ * Wake threads parked on a condvar (one per handed over slot), if any is.
+ *
+ * The fence pairs with the one in the parking paths: either the parked thread
+ * sees the slots we just handed over, or we see it counted as waiting.
+ */
+static void wake(size_t *waiting, pthread_mutex_t *lock,
+                 pthread_cond_t *condvar, size_t n) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(lock);
+        if (n == 1) {
+            pthread_cond_signal(condvar);
+        } else {
+            pthread_cond_broadcast(condvar);
+        }
+        pthread_mutex_unlock(lock);
+    }
+}
+
+int pcq_enqueue_many(pc_queue_t *queue, void **elems, size_t count) {
+    pcq_ring_t *ring = ring_of(queue);
+
+    // Counted before publishing, so the size never drops below zero
+    __atomic_fetch_add(&queue->pcq_current_size, count, __ATOMIC_RELAXED);
+
+    size_t done = 0;
+    while (done < count) {
+        size_t n = try_enqueue_many(queue, elems + done, count - done);
+        if (n == 0) {
+            // Full: park until a consumer frees a slot
+            pthread_mutex_lock(&queue->pcq_pusher_condvar_lock);
+            __atomic_fetch_add(&ring->waiting_pushers, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            while ((n = try_enqueue_many(queue, elems + done,
+                                         count - done)) == 0)
+                pthread_cond_wait(&queue->pcq_pusher_condvar,
+                                  &queue->pcq_pusher_condvar_lock);
+            __atomic_fetch_sub(&ring->waiting_pushers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock);
+        }
+
+        wake(&ring->waiting_poppers, &queue->pcq_popper_condvar_lock,
+             &queue->pcq_popper_condvar, n);
+        done += n;
+    }
+
+    return 0;
+}
+
+size_t pcq_dequeue_many(pc_queue_t *queue, void **elems, size_t count) {
+    pcq_ring_t *ring = ring_of(queue);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    size_t n = try_dequeue_many(queue, elems, count);
+    if (n == 0) {
+        // Empty: park until a producer publishes an element
+        pthread_mutex_lock(&queue->pcq_popper_condvar_lock);
+        __atomic_fetch_add(&ring->waiting_poppers, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while ((n = try_dequeue_many(queue, elems, count)) == 0)
+            pthread_cond_wait(&queue->pcq_popper_condvar,
+                              &queue->pcq_popper_condvar_lock);
+        __atomic_fetch_sub(&ring->waiting_poppers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&queue->pcq_popper_condvar_lock);
+    }
+
+    __atomic_fetch_sub(&queue->pcq_current_size, n, __ATOMIC_RELAXED);
+    wake(&ring->waiting_pushers, &queue->pcq_pusher_condvar_lock,
+         &queue->pcq_pusher_condvar, n);
+
+    return n;
+}
+
+int pcq_enqueue(pc_queue_t *queue, void *elem) {
+    return pcq_enqueue_many(queue, &elem, 1);
+}
+
+void *pcq_dequeue(pc_queue_t *queue) {
+    void *item;
+    pcq_dequeue_many(queue, &item, 1);
+    return item;
+}
+
+#endif // PCQ_LOCK_FREE
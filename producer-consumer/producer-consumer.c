@@ -1,5 +1,9 @@
 #include "producer-consumer.h"
 
+// Lock-based implementation; see producer-consumer-lockfree.c for the
+// alternative built with `make PCQ=lockfree`
+#ifndef PCQ_LOCK_FREE
+
 #include <stdlib.h>
 
 int pcq_create(pc_queue_t *queue, size_t capacity) {
@@ -77,4 +81,79 @@ void *pcq_dequeue(pc_queue_t *queue) {
     pthread_mutex_unlock(&queue->pcq_popper_condvar_lock);
 
     return item;
-}
\ No newline at end of file
+}
+
+int pcq_enqueue_many(pc_queue_t *queue, void **elems, size_t count) {
+    size_t done = 0;
+    pthread_mutex_lock(&queue->pcq_pusher_condvar_lock);
+    while (done < count) {
+        while (queue->pcq_current_size == queue->pcq_capacity)
+            pthread_cond_wait(&queue->pcq_pusher_condvar,
+                              &queue->pcq_pusher_condvar_lock);
+
+        // Moves as many elements as there is space for in a single round
+        size_t n = queue->pcq_capacity - queue->pcq_current_size;
+        if (n > count - done) {
+            n = count - done;
+        }
+
+        pthread_mutex_lock(&queue->pcq_tail_lock);
+        for (size_t i = 0; i < n; i++) {
+            queue->pcq_buffer[queue->pcq_tail] = elems[done + i];
+            queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+        }
+        pthread_mutex_unlock(&queue->pcq_tail_lock);
+
+        pthread_mutex_lock(&queue->pcq_current_size_lock);
+        queue->pcq_current_size += n;
+        pthread_mutex_unlock(&queue->pcq_current_size_lock);
+
+        if (n == 1) {
+            pthread_cond_signal(&queue->pcq_popper_condvar);
+        } else {
+            pthread_cond_broadcast(&queue->pcq_popper_condvar);
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock);
+
+    return 0;
+}
+
+size_t pcq_dequeue_many(pc_queue_t *queue, void **elems, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->pcq_popper_condvar_lock);
+    while (queue->pcq_current_size == 0)
+        pthread_cond_wait(&queue->pcq_popper_condvar,
+                          &queue->pcq_popper_condvar_lock);
+
+    size_t n = queue->pcq_current_size;
+    if (n > count) {
+        n = count;
+    }
+
+    pthread_mutex_lock(&queue->pcq_head_lock);
+    for (size_t i = 0; i < n; i++) {
+        elems[i] = queue->pcq_buffer[queue->pcq_head];
+        queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
+    }
+    pthread_mutex_unlock(&queue->pcq_head_lock);
+
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    queue->pcq_current_size -= n;
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
+
+    if (n == 1) {
+        pthread_cond_signal(&queue->pcq_pusher_condvar);
+    } else {
+        pthread_cond_broadcast(&queue->pcq_pusher_condvar);
+    }
+    pthread_mutex_unlock(&queue->pcq_popper_condvar_lock);
+
+    return n;
+}
+
+#endif // PCQ_LOCK_FREE
@@ -49,4 +49,17 @@ int pcq_enqueue(pc_queue_t *queue, void *elem);
 // If the queue is empty, sleep until the queue has an element
 void *pcq_dequeue(pc_queue_t *queue);
 
+// pcq_enqueue_many: insert count elements, in order, at the front of the queue
+//
+// Elements are moved in as few synchronization rounds as the free space
+// allows; if the queue is full, sleep until the queue has space
+int pcq_enqueue_many(pc_queue_t *queue, void **elems, size_t count);
+
+// pcq_dequeue_many: remove up to count elements, in order, from the back of
+// the queue
+//
+// If the queue is empty, sleep until the queue has an element
+// Returns the number of elements removed (at least 1, if count > 0)
+size_t pcq_dequeue_many(pc_queue_t *queue, void **elems, size_t count);
+
 #endif // __PRODUCER_CONSUMER_H__
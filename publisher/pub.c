@@ -1,38 +1,218 @@
+#include "frame.h"
 #include "logging.h"
 #include "operations.h"
 #include "pipes.h"
 #include "protocol.h"
+#include "shm_ring.h"
+#include "sockets.h"
 #include "utils.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+// Bytes of frames written to the pipe at once
+#define OUTPUT_BUFFER (64 * 1024)
+
+// The register pipe is -1 if registered through mbroker's socket, in which
+// case clientPipe is the connection to it
 static int registerPipe;
 static char *clientPipeName;
 static int clientPipe;
 
+// Messages sent together: at most maxBatch of them, waiting at most lingerMs
+// for more input once the first one is ready
+static size_t maxBatch = 1;
+static long lingerMs = 0;
+
+// Ring the frames are written to instead of the pipe, if shmSize is set
+static size_t shmSize = 0;
+static char shmName[SHM_RING_NAME_SIZE];
+static shm_ring_t shm;
+
+// Frames not yet written, and the batch frame being filled
+static char output[OUTPUT_BUFFER];
+static size_t outputSize;
+static packet_t batch;
+static size_t batchCount;
+// Set while queuing the lines read at once, whose frames a connection takes
+// together: unlike a pipe, it doesn't merge small writes, and holds only a few
+// of them
+static bool deferFlush;
+
 void close_publisher() {
     LOG("Closing publisher...");
-    pipe_close(registerPipe);
+    if (registerPipe != -1) {
+        pipe_close(registerPipe);
+        pipe_destroy(clientPipeName);
+    }
     pipe_close(clientPipe);
-    pipe_destroy(clientPipeName);
+    if (shmSize > 0) {
+        // In case mbroker never got to attach to it
+        shm_unlink(shmName);
+    }
     exit(EXIT_SUCCESS);
 }
 
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Writes the buffered frames to the pipe.
+ */
+static void flush_output() {
+    if (shmSize > 0) {
+        struct iovec iov = {.iov_base = output, .iov_len = outputSize};
+        if (outputSize > 0 && shm_ring_write_all(&shm, &iov, 1) == -1) {
+            WARN("mbroker closed the session");
+            close_publisher();
+        }
+        outputSize = 0;
+        return;
+    }
+
+    size_t done = 0;
+    while (done < outputSize) {
+        // A connection takes the frames in records of at most PIPE_BUF bytes
+        size_t size = registerPipe == -1
+                          ? socket_record_size(output + done, outputSize - done)
+                          : outputSize - done;
+        ssize_t written = write(clientPipe, output + done, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ECONNRESET) {
+                // A connection's SIGPIPE, if mbroker left unread frames
+                WARN("mbroker closed the session");
+                close_publisher();
+            }
+            PANIC("Failed to write to pipe");
+        }
+        done += (size_t)written;
+    }
+    outputSize = 0;
+}
+
+/**
+ * Adds a packet to the frames to be written.
+ */
+static void queue_packet(packet_t *packet) {
+    if (outputSize + FRAME_MAX_SIZE > OUTPUT_BUFFER) {
+        flush_output();
+    }
+    outputSize += frame_encode(packet, output + outputSize);
+}
+
+/**
+ * Queues the batch frame being filled, if it has any message.
+ */
+static void close_batch() {
+    if (batch.payload.batch_data.length > 0) {
+        queue_packet(&batch);
+        batch.payload.batch_data.length = 0;
+    }
+}
+
+/**
+ * Sends every message queued so far.
+ */
+static void send_batch() {
+    if (batchCount == 0) {
+        return;
+    }
+    if (maxBatch > 1) {
+        LOG("Sending %zu messages", batchCount);
+    }
+    close_batch();
+    if (!deferFlush) {
+        flush_output();
+    }
+    batchCount = 0;
+}
+
+/**
+ * Queues a message (len characters, without '\0'), sending the batch if it is
+ * full.
+ */
+static void queue_message(char const *message, size_t len) {
+    if (maxBatch == 1) {
+        // Unbatched: one message per frame, like it always was
+        packet_t packet;
+        memset(&packet, 0, sizeof(packet));
+        packet.opcode = PUBLISH_MESSAGE;
+        memcpy(packet.payload.message_data.message, message, len);
+        LOG("Sending message: %s", packet.payload.message_data.message);
+        queue_packet(&packet);
+    } else {
+        // Start a new batch frame if the message doesn't fit
+        uint16_t length = batch.payload.batch_data.length;
+        if (length + len + 1 > MESSAGE_SIZE) {
+            close_batch();
+            length = 0;
+        }
+        memcpy(batch.payload.batch_data.messages + length, message, len);
+        batch.payload.batch_data.messages[length + len] = '\0';
+        batch.payload.batch_data.length = (uint16_t)(length + len + 1);
+    }
+
+    if (++batchCount == maxBatch) {
+        send_batch();
+    }
+}
+
+/**
+ * Parses the options after the positional arguments.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int parse_options(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        if (i + 1 == argc) {
+            return -1;
+        }
+        char *end;
+        long value = strtol(argv[i + 1], &end, 10);
+        if (*end != '\0' || value < 0) {
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--batch") == 0 && value > 0) {
+            maxBatch = (size_t)value;
+        } else if (strcmp(argv[i], "--linger") == 0) {
+            lingerMs = value;
+        } else if (strcmp(argv[i], "--shm") == 0 && value > 0) {
+            shmSize = (size_t)value * 1024;
+        } else {
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     char *registerPipeName;
     char *boxName;
 
     // Checks if there are enough arguments
-    if (argc < 3) {
-        fprintf(stderr, "usage: pub <register_pipe_name> <box_name>\n");
+    if (argc < 4 || parse_options(argc - 4, argv + 4) == -1) {
+        fprintf(stderr, "usage: pub <register_pipe_name> <pipe_name> "
+                        "<box_name> [--batch <max messages>] "
+                        "[--linger <max ms>] [--shm <ring KB>]\n");
         return EXIT_FAILURE;
     }
 
@@ -49,45 +229,104 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    // Opens the register server pipe
-    registerPipe = pipe_open(registerPipeName, O_WRONLY);
-
     packet_t register_packet;
     registration_data_t registration_data;
 
     LOG("Registering publisher");
 
+    // Creates the ring before registering, for mbroker to find it
+    if (shmSize > 0) {
+        shm_ring_name(clientPipeName, shmName);
+        if (shm_ring_create(&shm, shmName, shmSize) == -1) {
+            WARN("Failed to create shared ring");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Creates the packet to register the publisher
-    register_packet.opcode = REGISTER_PUBLISHER;
+    register_packet.opcode =
+        shmSize > 0 ? REGISTER_PUBLISHER_SHM : REGISTER_PUBLISHER;
     memcpy(registration_data.client_pipe, clientPipeName,
            strlen(clientPipeName) + 1);
     memcpy(registration_data.box_name, boxName, strlen(boxName) + 1);
     register_packet.payload.registration_data = registration_data;
 
-    pipe_create(clientPipeName);
-
-    // Sends the packet to the server
-    pipe_write(registerPipe, &register_packet);
-
+    // Sends the packet to the server, through its socket or register pipe
     LOG("Opening session pipe %s", clientPipeName);
-    clientPipe = pipe_open(clientPipeName, O_WRONLY);
+    clientPipe =
+        socket_register_client(registerPipeName, clientPipeName,
+                               &register_packet, O_WRONLY, &registerPipe);
+    if (shmSize > 0) {
+        // mbroker attached to the ring before opening the pipe (and removes
+        // its name itself for a connection); the pipe now only wakes it up
+        if (registerPipe != -1) {
+            shm_unlink(shmName);
+        }
+        shm.doorbell = clientPipe;
+    }
 
     LOG("Waiting for user input");
-    // Send new message for every new line until EOF is reached
-    char buffer[MESSAGE_SIZE];
-    while (fgets(buffer, MESSAGE_SIZE, stdin) != NULL) {
-        packet_t packet;
-        message_data_t message_data;
-        packet.opcode = PUBLISH_MESSAGE;
-        memset(message_data.message, 0, MESSAGE_SIZE);
-        // copy the message and remove the newline character
-        memcpy(message_data.message, buffer, strcspn(buffer, "\n"));
-        packet.payload.message_data = message_data;
+    // Send a new message for every line (split every MESSAGE_SIZE - 1
+    // characters) until EOF is reached. Lines are read straight from stdin,
+    // so whether more input is ready can be polled for
+    batch.opcode = PUBLISH_MESSAGE_BATCH;
+    char input[OUTPUT_BUFFER];
+    size_t inputSize = 0;
+    long deadline = 0;
+    while (true) {
+        if (batchCount > 0) {
+            // Wait for more input only until the batch's deadline
+            long timeout = deadline - now_ms();
+            struct pollfd fds = {.fd = STDIN_FILENO, .events = POLLIN};
+            if (poll(&fds, 1, timeout > 0 ? (int)timeout : 0) == 0) {
+                send_batch();
+            }
+        }
 
-        LOG("Sending message: %s", packet.payload.message_data.message);
+        ssize_t bytes_read =
+            read(STDIN_FILENO, input + inputSize, sizeof(input) - inputSize);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            break;
+        }
+        inputSize += (size_t)bytes_read;
+
+        // Queue every whole line (or full message) read
+        deferFlush = registerPipe == -1;
+        char *line = input;
+        char *end = input + inputSize;
+        while (true) {
+            size_t left = (size_t)(end - line);
+            char *newline = memchr(line, '\n', left);
+            size_t len = newline != NULL ? (size_t)(newline - line) : left;
+            if (len > MESSAGE_SIZE - 1) {
+                len = MESSAGE_SIZE - 1;
+                newline = NULL;
+            } else if (newline == NULL) {
+                break; // the rest of the line is still to come
+            }
+
+            if (batchCount == 0) {
+                deadline = now_ms() + lingerMs;
+            }
+            queue_message(line, len);
+            line += newline != NULL ? len + 1 : len;
+        }
+        inputSize = (size_t)(end - line);
+        memmove(input, line, inputSize);
+        if (deferFlush) {
+            deferFlush = false;
+            flush_output();
+        }
+    }
 
-        pipe_write(clientPipe, &packet);
+    // A last line without a newline is still a message
+    if (inputSize > 0) {
+        queue_message(input, inputSize);
     }
+    send_batch();
 
     close_publisher();
     return 0;
@@ -1,44 +1,222 @@
+#include "frame.h"
 #include "logging.h"
 #include "operations.h"
 #include "pipes.h"
 #include "protocol.h"
+#include "shm_ring.h"
+#include "sockets.h"
 #include "unistd.h"
 #include "utils.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
+#include <time.h>
 
+// Bytes read from the pipe at once
+#define INPUT_BUFFER (256 * 1024)
+// Maximum number of messages written to stdout at once (each takes 2 iovecs:
+// the message and its newline)
+#define OUTPUT_BATCH 512
+
+// The register pipe is -1 if registered through mbroker's socket, in which
+// case clientPipe is the connection to it
 static int registerPipe;
 static char *clientPipeName;
 static int clientPipe;
 static int messagesReceived;
 
+// Messages received but not yet written to stdout, pointing into the reader's
+// buffer, and how long they may wait for more (0: until no more are ready)
+static struct iovec output[2 * OUTPUT_BATCH];
+static int outputCount;
+static long flushIntervalMs = 0;
+static long deadline = 0;
+
+// Ring the frames are read from instead of the pipe, if shmSize is set
+static size_t shmSize = 0;
+static char shmName[SHM_RING_NAME_SIZE];
+static shm_ring_t shm;
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Writes the pending messages to stdout.
+ */
+static void flush_output() {
+    struct iovec *iov = output;
+    int count = outputCount;
+    while (count > 0) {
+        ssize_t written = writev(STDOUT_FILENO, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PANIC("Failed to write to stdout");
+        }
+
+        // Skip what was written, which may end in the middle of an iovec
+        size_t left = (size_t)written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    outputCount = 0;
+}
+
 void close_subscriber() {
+    flush_output();
     printf("Received %d messages\n", messagesReceived);
     LOG("Closing subscriber...");
-    pipe_close(registerPipe);
+    if (registerPipe != -1) {
+        pipe_close(registerPipe);
+        pipe_destroy(clientPipeName);
+    }
     pipe_close(clientPipe);
-    pipe_destroy(clientPipeName);
+    if (shmSize > 0) {
+        // In case mbroker never got to attach to it
+        shm_unlink(shmName);
+    }
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * Adds a message frame to the output, writing the output if it is full.
+ */
+static void add_message(frame_header_t const *header, char const *payload) {
+    if (header->opcode != SEND_MESSAGE) {
+        WARN("Unexpected opcode %d", header->opcode);
+        return;
+    }
+
+    if (outputCount == 0) {
+        deadline = now_ms() + flushIntervalMs;
+    }
+    output[outputCount].iov_base = (void *)payload;
+    output[outputCount++].iov_len = strnlen(payload, header->length);
+    output[outputCount].iov_base = "\n";
+    output[outputCount++].iov_len = 1;
+    messagesReceived++;
+
+    if (outputCount == 2 * OUTPUT_BATCH) {
+        flush_output();
+    }
+}
+
+/**
+ * Receives messages through the shared ring until mbroker ends the session,
+ * writing them to stdout straight from the ring.
+ */
+static void receive_shm() {
+    // Bytes of frames in the output, which stay in the ring until written
+    size_t parsed = 0;
+    while (true) {
+        char const *data;
+        ssize_t available = shm_ring_peek(&shm, &data);
+        ssize_t size = 0;
+        // Short of a full output, which add_message would write before the
+        // frames could be consumed
+        while (available > 0 && outputCount < 2 * OUTPUT_BATCH - 2) {
+            frame_header_t header;
+            char const *payload;
+            size = frame_parse(data + parsed, (size_t)available - parsed,
+                               &header, &payload);
+            if (size <= 0) {
+                break;
+            }
+            add_message(&header, payload);
+            parsed += (size_t)size;
+        }
+        if (available < 0 || size < 0) {
+            WARN("Invalid frame in shared ring");
+            return;
+        }
+
+        // Wait for more messages only until the pending ones are due
+        int ret;
+        if (outputCount > 0) {
+            long timeout = deadline - now_ms();
+            ret = outputCount == 2 * OUTPUT_BATCH - 2 || timeout <= 0
+                      ? 0
+                      : shm_ring_wait_data(&shm, parsed, (int)timeout);
+            if (ret == 0) {
+                flush_output();
+                shm_ring_consume(&shm, parsed);
+                parsed = 0;
+                continue;
+            }
+        } else {
+            ret = shm_ring_wait_data(&shm, parsed, -1);
+        }
+
+        if (ret < 0) {
+            WARN("mbroker closed the session");
+            return;
+        }
+    }
+}
+
+/**
+ * Parses the options after the positional arguments.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int parse_options(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        if (i + 1 == argc) {
+            return -1;
+        }
+        char *end;
+        long value = strtol(argv[i + 1], &end, 10);
+        if (*end != '\0' || value < 0) {
+            return -1;
+        }
+
+        if (strcmp(argv[i], "--flush-interval") == 0) {
+            flushIntervalMs = value;
+        } else if (strcmp(argv[i], "--shm") == 0 && value > 0) {
+            shmSize = (size_t)value * 1024;
+        } else {
+            return -1;
+        }
+        i++;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     char *boxName;
     char *registerPipeName;
 
     // Checks if there are enough arguments
-    if (argc < 3) {
-        fprintf(stderr, "usage: sub <register_pipe_name> <box_name>\n");
+    if (argc < 4 || parse_options(argc - 4, argv + 4) == -1) {
+        fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> "
+                        "<box_name> [--flush-interval <ms>] "
+                        "[--shm <ring KB>]\n");
         return EXIT_FAILURE;
     }
 
     signal(SIGINT, close_subscriber);
+    signal(SIGPIPE, close_subscriber);
 
     registerPipeName = argv[1];
     clientPipeName = argv[2];
@@ -50,48 +228,87 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    // Opens the register server pipe
-    registerPipe = pipe_open(registerPipeName, O_WRONLY);
-
     // Creates the packet to register the subscriber
     packet_t register_packet;
     registration_data_t registration_data;
 
     LOG("Registering subscriber");
 
-    register_packet.opcode = REGISTER_SUBSCRIBER;
+    // Creates the ring before registering, for mbroker to find it
+    if (shmSize > 0) {
+        shm_ring_name(clientPipeName, shmName);
+        if (shm_ring_create(&shm, shmName, shmSize) == -1) {
+            WARN("Failed to create shared ring");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    register_packet.opcode =
+        shmSize > 0 ? REGISTER_SUBSCRIBER_SHM : REGISTER_SUBSCRIBER;
     memcpy(registration_data.client_pipe, clientPipeName,
            strlen(clientPipeName) + 1);
     memcpy(registration_data.box_name, boxName, strlen(boxName) + 1);
     register_packet.payload.registration_data = registration_data;
 
-    pipe_create(clientPipeName);
-    
-    // Sends the packet to the server
-    pipe_write(registerPipe, &register_packet);
+    // Sends the packet to the server, through its socket or register pipe,
+    // and opens the client pipe (written to with a shared ring) or connection
+    clientPipe = socket_register_client(registerPipeName, clientPipeName,
+                                        &register_packet,
+                                        shmSize > 0 ? O_WRONLY : O_RDONLY,
+                                        &registerPipe);
 
     LOG("Listening for Publisher messages");
 
-    // Opens the client pipe to read messages
-    clientPipe = pipe_open(clientPipeName, O_RDONLY);
+    if (shmSize > 0) {
+        // mbroker attached to the ring before opening the pipe (and removes
+        // its name itself for a connection), which now only wakes it up when
+        // the ring is no longer full
+        if (registerPipe != -1) {
+            shm_unlink(shmName);
+        }
+        shm.doorbell = clientPipe;
+        receive_shm();
+        close_subscriber();
+    }
 
-    // Reads messages from the client pipe
+    // Reads messages from the client pipe in large chunks, and writes them
+    // to stdout straight from there, in batches
+    static char input[INPUT_BUFFER];
+    static frame_reader_t reader;
+    frame_reader_init_buffer(&reader, clientPipe, input, sizeof(input));
     while (true) {
-        packet_t packet;
-        ssize_t bytesRead = read(clientPipe, &packet, sizeof(packet_t));
-        if (bytesRead < 0) {
+        frame_header_t header;
+        char const *payload;
+        int ret;
+        while ((ret = frame_next_raw(&reader, &header, &payload)) == 1) {
+            add_message(&header, payload);
+        }
+        if (ret < 0) {
+            WARN("Invalid frame from client pipe");
+            break;
+        }
+
+        // Wait for more messages only until the pending ones are due, and
+        // write them before the reader reuses the buffer they are in
+        if (outputCount > 0) {
+            long timeout = deadline - now_ms();
+            struct pollfd fds = {.fd = clientPipe, .events = POLLIN};
+            if (frame_reader_room(&reader) == 0 ||
+                poll(&fds, 1, timeout > 0 ? (int)timeout : 0) == 0) {
+                flush_output();
+            }
+        }
+
+        ssize_t bytes_read = frame_fill(&reader);
+        if (bytes_read < 0) {
             WARN("Failed to read from client pipe");
             break;
         }
 
-        if (bytesRead == 0) {
+        if (bytes_read == 0) {
             WARN("Client pipe closed");
             break;
         }
-
-        fprintf(stdout, "%s\n", packet.payload.message_data.message);
-
-        messagesReceived++;
     }
 
     close_subscriber();
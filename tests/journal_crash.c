@@ -0,0 +1,105 @@
+#include "operations.h"
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Crashes a process in the middle of writing to a journaled image, and checks
+// that mounting the image again gets back everything written before the crash.
+
+#define IMAGE_PATH "journal_crash.img"
+#define JOURNAL_PATH IMAGE_PATH ".journal"
+#define N_FILES 8
+#define N_WRITES 200
+
+static tfs_params image_params(void) {
+    tfs_params params = tfs_default_params();
+    params.image_path = IMAGE_PATH;
+    params.sync_policy = TFS_SYNC_JOURNAL;
+    return params;
+}
+
+static void fill_line(char *line, size_t size, size_t file, size_t write) {
+    snprintf(line, size, "file %zu, write %zu\n", file, write);
+}
+
+/**
+ * Writes the files, leaving the last write of each unclosed, then dies.
+ */
+static void crash_while_writing(void) {
+    tfs_params params = image_params();
+    assert(tfs_init(&params) == 0);
+
+    int handles[N_FILES];
+    char name[16];
+    for (size_t f = 0; f < N_FILES; f++) {
+        snprintf(name, sizeof(name), "/f%zu", f);
+        handles[f] = tfs_open(name, TFS_O_CREAT);
+        assert(handles[f] != -1);
+    }
+
+    char line[64];
+    for (size_t w = 0; w < N_WRITES; w++) {
+        for (size_t f = 0; f < N_FILES; f++) {
+            fill_line(line, sizeof(line), f, w);
+            size_t len = strlen(line);
+            assert(tfs_write(handles[f], line, len) == (ssize_t)len);
+        }
+    }
+
+    raise(SIGKILL);
+}
+
+static void check_files(void) {
+    char expected[64];
+    char line[64];
+    char name[16];
+    for (size_t f = 0; f < N_FILES; f++) {
+        snprintf(name, sizeof(name), "/f%zu", f);
+        int fd = tfs_open(name, 0);
+        assert(fd != -1);
+        for (size_t w = 0; w < N_WRITES; w++) {
+            fill_line(expected, sizeof(expected), f, w);
+            size_t len = strlen(expected);
+            assert(tfs_read(fd, line, len) == (ssize_t)len);
+            assert(memcmp(line, expected, len) == 0);
+        }
+        assert(tfs_read(fd, line, sizeof(line)) == 0);
+        assert(tfs_close(fd) == 0);
+    }
+}
+
+int main() {
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+
+    pid_t child = fork();
+    assert(child != -1);
+    if (child == 0) {
+        crash_while_writing();
+        _exit(EXIT_FAILURE);
+    }
+    int status;
+    assert(waitpid(child, &status, 0) == child);
+    assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+    // Everything is replayed from the journal
+    tfs_params params = image_params();
+    assert(tfs_init(&params) == 0);
+    check_files();
+    assert(tfs_destroy() == 0);
+
+    // A clean unmount writes it all back to the image, without the journal
+    assert(unlink(JOURNAL_PATH) == 0);
+    assert(tfs_init(&params) == 0);
+    check_files();
+    assert(tfs_destroy() == 0);
+
+    unlink(IMAGE_PATH);
+    unlink(JOURNAL_PATH);
+    printf("Successful test.\n");
+    return 0;
+}
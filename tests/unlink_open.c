@@ -0,0 +1,39 @@
+#include "operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Unlinks a file that is still open, and checks that the open handle can no
+// longer reach its inode, not even once a new file reuses it.
+
+int main() {
+    assert(tfs_init(NULL) == 0);
+
+    int old = tfs_open("/old", TFS_O_CREAT);
+    assert(old != -1);
+    assert(tfs_write(old, "old", 3) == 3);
+    assert(tfs_unlink("/old") == 0);
+
+    // Writing to the deleted file would take blocks from a free inode
+    assert(tfs_write(old, "stale", 5) == -1);
+
+    int new = tfs_open("/new", TFS_O_CREAT);
+    assert(new != -1);
+    assert(tfs_write(new, "new", 3) == 3);
+
+    // The new file (probably in the same inode) is out of the old handle's
+    // reach
+    char buffer[16];
+    assert(tfs_write(old, "stale", 5) == -1);
+    assert(tfs_pread(old, buffer, sizeof(buffer), 0) == -1);
+    assert(tfs_read(old, buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(old) == 0);
+
+    assert(tfs_pread(new, buffer, sizeof(buffer), 0) == 3);
+    assert(memcmp(buffer, "new", 3) == 0);
+    assert(tfs_close(new) == 0);
+
+    assert(tfs_destroy() == 0);
+    printf("Successful test.\n");
+    return 0;
+}
@@ -0,0 +1,315 @@
+#include "frame.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Appends len bytes to the frame being built at *pos.
+ */
+static void put(char *frame, size_t *pos, void const *data, size_t len) {
+    memcpy(frame + *pos, data, len);
+    *pos += len;
+}
+
+/**
+ * Appends a string (without its '\0') of at most size - 1 characters.
+ */
+static void put_string(char *frame, size_t *pos, char const *str,
+                       size_t size) {
+    put(frame, pos, str, strnlen(str, size - 1));
+}
+
+size_t frame_encode(packet_t const *packet, char *frame) {
+    size_t pos = sizeof(frame_header_t);
+
+    switch (packet->opcode) {
+    case REGISTER_PUBLISHER:
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_PUBLISHER_SHM:
+    case REGISTER_SUBSCRIBER_SHM:
+    case CREATE_MAILBOX:
+    case REMOVE_MAILBOX: {
+        // "<client pipe>\0<box name>"
+        registration_data_t const *data = &packet->payload.registration_data;
+        put_string(frame, &pos, data->client_pipe, PIPE_NAME_SIZE);
+        put(frame, &pos, "", 1);
+        put_string(frame, &pos, data->box_name, BOX_NAME_SIZE);
+        break;
+    }
+    case LIST_MAILBOXES:
+    case STATS: {
+        put_string(frame, &pos, packet->payload.list_box_data.client_pipe,
+                   PIPE_NAME_SIZE);
+        break;
+    }
+    case CREATE_MAILBOX_ANSWER:
+    case REMOVE_MAILBOX_ANSWER: {
+        // Copied out of the packed packet, for its fields to be aligned. The
+        // error message only matters for failures
+        answer_data_t data = packet->payload.answer_data;
+        put(frame, &pos, &data.return_code, sizeof(data.return_code));
+        if (data.return_code != 0) {
+            put_string(frame, &pos, data.error_message, MESSAGE_SIZE);
+        }
+        break;
+    }
+    case LIST_MAILBOXES_ANSWER: {
+        mailbox_data_t data = packet->payload.mailbox_data;
+        put(frame, &pos, &data.last, sizeof(data.last));
+        put(frame, &pos, &data.box_size, sizeof(data.box_size));
+        put(frame, &pos, &data.n_subscribers, sizeof(data.n_subscribers));
+        put(frame, &pos, &data.n_publishers, sizeof(data.n_publishers));
+        put_string(frame, &pos, data.box_name, BOX_NAME_SIZE);
+        break;
+    }
+    case STATS_ANSWER: {
+        stats_data_t data = packet->payload.stats_data;
+        put(frame, &pos, &data.last, sizeof(data.last));
+        put(frame, &pos, &data.kind, sizeof(data.kind));
+        put(frame, &pos, data.values, sizeof(data.values));
+        put_string(frame, &pos, data.name, BOX_NAME_SIZE);
+        break;
+    }
+    case PUBLISH_MESSAGE:
+    case SEND_MESSAGE: {
+        put_string(frame, &pos, packet->payload.message_data.message,
+                   MESSAGE_SIZE);
+        break;
+    }
+    case PUBLISH_MESSAGE_BATCH: {
+        size_t length = packet->payload.batch_data.length;
+        if (length > MESSAGE_SIZE) {
+            length = MESSAGE_SIZE;
+        }
+        put(frame, &pos, packet->payload.batch_data.messages, length);
+        break;
+    }
+    default:
+        break;
+    }
+
+    frame_header_t header = {
+        .opcode = packet->opcode,
+        .length = (uint16_t)(pos - sizeof(frame_header_t)),
+    };
+    memcpy(frame, &header, sizeof(header));
+    return pos;
+}
+
+/**
+ * Copies the next len bytes of the payload, or zeroes if there are less left.
+ */
+static void get(char const *payload, size_t length, size_t *pos, void *data,
+                size_t len) {
+    if (*pos + len <= length) {
+        memcpy(data, payload + *pos, len);
+    } else {
+        memset(data, 0, len);
+    }
+    *pos += len;
+}
+
+/**
+ * Copies a string from the payload, up to its '\0' or the end of the payload,
+ * truncated to size - 1 characters.
+ */
+static void get_string(char const *payload, size_t length, size_t *pos,
+                       char *str, size_t size) {
+    if (*pos >= length) {
+        return;
+    }
+
+    char const *start = payload + *pos;
+    char const *end = memchr(start, '\0', length - *pos);
+    size_t len = end != NULL ? (size_t)(end - start) : length - *pos;
+    *pos += end != NULL ? len + 1 : len;
+
+    if (len > size - 1) {
+        len = size - 1;
+    }
+    memcpy(str, start, len);
+    str[len] = '\0';
+}
+
+void frame_decode(frame_header_t const *header, char const *payload,
+                  packet_t *packet) {
+    memset(packet, 0, sizeof(packet_t));
+    packet->opcode = header->opcode;
+
+    size_t length = header->length;
+    size_t pos = 0;
+    switch (header->opcode) {
+    case REGISTER_PUBLISHER:
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_PUBLISHER_SHM:
+    case REGISTER_SUBSCRIBER_SHM:
+    case CREATE_MAILBOX:
+    case REMOVE_MAILBOX: {
+        registration_data_t *data = &packet->payload.registration_data;
+        get_string(payload, length, &pos, data->client_pipe, PIPE_NAME_SIZE);
+        get_string(payload, length, &pos, data->box_name, BOX_NAME_SIZE);
+        break;
+    }
+    case LIST_MAILBOXES:
+    case STATS: {
+        get_string(payload, length, &pos,
+                   packet->payload.list_box_data.client_pipe, PIPE_NAME_SIZE);
+        break;
+    }
+    case CREATE_MAILBOX_ANSWER:
+    case REMOVE_MAILBOX_ANSWER: {
+        // Decoded aside, for its fields to be aligned
+        answer_data_t data = {0};
+        get(payload, length, &pos, &data.return_code,
+            sizeof(data.return_code));
+        get_string(payload, length, &pos, data.error_message, MESSAGE_SIZE);
+        packet->payload.answer_data = data;
+        break;
+    }
+    case LIST_MAILBOXES_ANSWER: {
+        mailbox_data_t data = {0};
+        get(payload, length, &pos, &data.last, sizeof(data.last));
+        get(payload, length, &pos, &data.box_size, sizeof(data.box_size));
+        get(payload, length, &pos, &data.n_subscribers,
+            sizeof(data.n_subscribers));
+        get(payload, length, &pos, &data.n_publishers,
+            sizeof(data.n_publishers));
+        get_string(payload, length, &pos, data.box_name, BOX_NAME_SIZE);
+        packet->payload.mailbox_data = data;
+        break;
+    }
+    case STATS_ANSWER: {
+        stats_data_t data = {0};
+        get(payload, length, &pos, &data.last, sizeof(data.last));
+        get(payload, length, &pos, &data.kind, sizeof(data.kind));
+        get(payload, length, &pos, data.values, sizeof(data.values));
+        get_string(payload, length, &pos, data.name, BOX_NAME_SIZE);
+        packet->payload.stats_data = data;
+        break;
+    }
+    case PUBLISH_MESSAGE:
+    case SEND_MESSAGE: {
+        get_string(payload, length, &pos, packet->payload.message_data.message,
+                   MESSAGE_SIZE);
+        break;
+    }
+    case PUBLISH_MESSAGE_BATCH: {
+        // Copied as is; publishers split (and terminate) the messages
+        if (length > MESSAGE_SIZE) {
+            length = MESSAGE_SIZE;
+        }
+        memcpy(packet->payload.batch_data.messages, payload, length);
+        packet->payload.batch_data.length = (uint16_t)length;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+void frame_reader_init(frame_reader_t *reader, int fd) {
+    frame_reader_init_buffer(reader, fd, reader->storage,
+                             sizeof(reader->storage));
+}
+
+void frame_reader_init_buffer(frame_reader_t *reader, int fd, char *buffer,
+                              size_t capacity) {
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->capacity = capacity;
+    reader->buffer = buffer;
+}
+
+ssize_t frame_parse(char const *data, size_t size, frame_header_t *header,
+                    char const **payload) {
+    if (size < sizeof(frame_header_t)) {
+        return 0;
+    }
+
+    memcpy(header, data, sizeof(frame_header_t));
+    if (header->length > sizeof(packet_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (size < sizeof(frame_header_t) + header->length) {
+        return 0;
+    }
+
+    *payload = data + sizeof(frame_header_t);
+    return (ssize_t)(sizeof(frame_header_t) + header->length);
+}
+
+int frame_next_raw(frame_reader_t *reader, frame_header_t *header,
+                   char const **payload) {
+    ssize_t size = frame_parse(reader->buffer + reader->start,
+                               reader->end - reader->start, header, payload);
+    if (size <= 0) {
+        return (int)size;
+    }
+
+    reader->start += (size_t)size;
+    return 1;
+}
+
+int frame_next(frame_reader_t *reader, packet_t *packet) {
+    frame_header_t header;
+    char const *payload;
+    int ret = frame_next_raw(reader, &header, &payload);
+    if (ret == 1) {
+        frame_decode(&header, payload, packet);
+    }
+    return ret;
+}
+
+size_t frame_reader_room(frame_reader_t const *reader) {
+    size_t room = reader->capacity - reader->end;
+    // Less room than a read needs is made by moving the data
+    return room < FRAME_READ_ROOM ? 0 : room;
+}
+
+char *frame_reader_space(frame_reader_t *reader, size_t *size) {
+    if (frame_reader_room(reader) == 0) {
+        // Move the partial frame (if any) to the front, to make room
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    *size = reader->capacity - reader->end;
+    return reader->buffer + reader->end;
+}
+
+void frame_reader_add(frame_reader_t *reader, size_t size) {
+    reader->end += size;
+}
+
+ssize_t frame_fill(frame_reader_t *reader) {
+    size_t size;
+    char *space = frame_reader_space(reader, &size);
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = read(reader->fd, space, size);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read > 0) {
+        frame_reader_add(reader, (size_t)bytes_read);
+    }
+    return bytes_read;
+}
+
+int frame_read(frame_reader_t *reader, packet_t *packet) {
+    while (true) {
+        int ret = frame_next(reader, packet);
+        if (ret != 0) {
+            return ret;
+        }
+
+        ssize_t bytes_read = frame_fill(reader);
+        if (bytes_read <= 0) {
+            return (int)bytes_read;
+        }
+    }
+}
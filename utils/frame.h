@@ -0,0 +1,164 @@
+#ifndef __UTILS_FRAME_H__
+#define __UTILS_FRAME_H__
+
+#include "protocol.h"
+#include <limits.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Frames are how packets travel through the pipes: a header with the opcode
+ * and the length of the payload, followed by only the payload bytes in use
+ * (strings without their padding, messages without the rest of the
+ * MESSAGE_SIZE buffer). A 10 byte message costs 13 bytes of pipe instead of a
+ * whole packet_t.
+ *
+ * Frames are at most FRAME_MAX_SIZE bytes, less than PIPE_BUF, so a frame
+ * written with a single write() is never interleaved with others (and, on a
+ * non-blocking pipe, is either written whole or not at all).
+ */
+typedef struct __attribute__((packed)) frame_header_t {
+    uint8_t opcode;
+    uint16_t length;
+} frame_header_t;
+
+#define FRAME_MAX_SIZE (sizeof(frame_header_t) + sizeof(packet_t))
+
+/**
+ * Encodes a packet as a frame.
+ *
+ * Input:
+ *   - packet: packet to encode
+ *   - frame: destination, with room for FRAME_MAX_SIZE bytes
+ *
+ * Returns the size of the frame.
+ */
+size_t frame_encode(packet_t const *packet, char *frame);
+
+/**
+ * Decodes a frame's payload into a packet (zeroing the unused bytes).
+ *
+ * Input:
+ *   - header: header of the frame
+ *   - payload: header->length bytes of payload
+ *   - packet: destination packet
+ */
+void frame_decode(frame_header_t const *header, char const *payload,
+                  packet_t *packet);
+
+/**
+ * Finds the frame at the start of a buffer.
+ *
+ * Input:
+ *   - data: the buffer
+ *   - size: number of bytes in the buffer
+ *   - header: where to store the frame's header
+ *   - payload: where to store a pointer to the frame's header->length bytes
+ *     of payload, inside data
+ *
+ * Returns the size of the frame, 0 if the buffer doesn't hold all of it, or
+ * -1 (with errno set to EPROTO) if the data is not a valid frame.
+ */
+ssize_t frame_parse(char const *data, size_t size, frame_header_t *header,
+                    char const **payload);
+
+// Bytes buffered by a frame reader
+#define FRAME_READER_BUFFER (8 * FRAME_MAX_SIZE)
+// Room a reader keeps for each read(): a whole frame, and a whole record of a
+// socket connection, which a smaller read would cut short (see sockets.h)
+#define FRAME_READ_ROOM PIPE_BUF
+
+/**
+ * Reads frames from a pipe in chunks of up to FRAME_READER_BUFFER bytes (or
+ * the size of the caller's buffer), so several small frames cost a single
+ * read(), and frames split across reads are put back together.
+ */
+typedef struct {
+    int fd;
+    size_t start;
+    size_t end;
+    size_t capacity;
+    char *buffer;
+    char storage[FRAME_READER_BUFFER];
+} frame_reader_t;
+
+/**
+ * Initializes a reader for the given file descriptor.
+ */
+void frame_reader_init(frame_reader_t *reader, int fd);
+
+/**
+ * Initializes a reader that buffers into the caller's buffer instead.
+ *
+ * Input:
+ *   - reader: reader to initialize
+ *   - fd: file descriptor to read from
+ *   - buffer: buffer to use, which must outlive the reader
+ *   - capacity: size of the buffer, at least FRAME_READ_ROOM
+ */
+void frame_reader_init_buffer(frame_reader_t *reader, int fd, char *buffer,
+                              size_t capacity);
+
+/**
+ * Decodes the next frame, if it was already read whole (never calls read()).
+ *
+ * Returns 1 if a packet was decoded, 0 if no whole frame is buffered, or -1
+ * (with errno set to EPROTO) if the buffered data is not a valid frame.
+ */
+int frame_next(frame_reader_t *reader, packet_t *packet);
+
+/**
+ * Like frame_next, but returns the frame as it is in the reader's buffer
+ * instead of decoding it.
+ *
+ * Input:
+ *   - reader: reader to take the frame from
+ *   - header: where to store the frame's header
+ *   - payload: where to store a pointer to the frame's header->length bytes
+ *     of payload, valid until frame_fill moves the buffered data
+ */
+int frame_next_raw(frame_reader_t *reader, frame_header_t *header,
+                   char const **payload);
+
+/**
+ * Returns how many bytes the next frame_fill can read without moving the
+ * buffered data (and so invalidating the payloads from frame_next_raw), or 0
+ * if it will move it.
+ */
+size_t frame_reader_room(frame_reader_t const *reader);
+
+/**
+ * Makes room for the next read (like frame_fill) and returns where it goes,
+ * for the caller to read into itself and hand the bytes to frame_reader_add.
+ *
+ * Input:
+ *   - reader: the reader
+ *   - size: where to store how many bytes the read may take (at least
+ *     FRAME_READ_ROOM)
+ */
+char *frame_reader_space(frame_reader_t *reader, size_t *size);
+
+/**
+ * Appends the bytes the caller read into frame_reader_space to the buffered
+ * data.
+ */
+void frame_reader_add(frame_reader_t *reader, size_t size);
+
+/**
+ * Calls read() once, appending whatever it returns to the buffered data.
+ *
+ * Returns the number of bytes read, 0 if the writer closed the pipe, or -1
+ * with errno set on error.
+ */
+ssize_t frame_fill(frame_reader_t *reader);
+
+/**
+ * Reads the next frame, calling read() as many times as needed.
+ *
+ * Returns 1 if a packet was read, 0 if the writer closed the pipe (any
+ * partial frame is dropped), or -1 with errno set on error (EAGAIN if the
+ * pipe is non-blocking and no whole frame is available yet).
+ */
+int frame_read(frame_reader_t *reader, packet_t *packet);
+
+#endif // __UTILS_FRAME_H__
@@ -0,0 +1,115 @@
+#include "histogram.h"
+#include <string.h>
+
+/**
+ * Returns the index of the bucket a value is counted in.
+ */
+static size_t bucket_of(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (size_t)value;
+    }
+
+    unsigned int bit = 63 - (unsigned int)__builtin_clzll(value);
+    if (bit > HISTOGRAM_MAX_BIT) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    unsigned int shift = bit - HISTOGRAM_SUB_BITS;
+    size_t sub = (size_t)(value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return HISTOGRAM_SUB_BUCKETS + shift * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+/**
+ * Returns the middle of the range of values counted in a bucket.
+ */
+static uint64_t bucket_value(size_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    size_t shift = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = (bucket - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    uint64_t lowest = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return lowest + ((1ULL << shift) >> 1);
+}
+
+void histogram_init(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(histogram_t));
+    histogram->min = UINT64_MAX;
+}
+
+// Stores of a single writer; the relaxed atomics only keep readers from seeing
+// torn values
+#define BUMP(field, delta)                                                     \
+    __atomic_store_n(&(field), (field) + (delta), __ATOMIC_RELAXED)
+
+void histogram_record(histogram_t *histogram, uint64_t value) {
+    BUMP(histogram->buckets[bucket_of(value)], 1);
+    BUMP(histogram->sum, value);
+    if (value < histogram->min) {
+        __atomic_store_n(&histogram->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > histogram->max) {
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+    }
+    // Last, so readers that see the count also see its bucket (or a newer one)
+    __atomic_store_n(&histogram->count, histogram->count + 1,
+                     __ATOMIC_RELEASE);
+}
+
+void histogram_merge(histogram_t *into, histogram_t const *from) {
+    uint64_t count = __atomic_load_n(&from->count, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return;
+    }
+
+    // The buckets may get ahead of the count while copying; the count is
+    // recomputed from them, for quantiles to add up
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t n = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+        into->buckets[i] += n;
+        into->count += n;
+    }
+    into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+
+    uint64_t min = __atomic_load_n(&from->min, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+    if (min < into->min) {
+        into->min = min;
+    }
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+uint64_t histogram_quantile(histogram_t const *histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    // Rank of the value wanted, from 1 to count
+    uint64_t rank = (uint64_t)(quantile * (double)histogram->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank > histogram->count) {
+        rank = histogram->count;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            // Never beyond the values actually recorded
+            uint64_t value = bucket_value(i);
+            if (value > histogram->max) {
+                value = histogram->max;
+            }
+            return value < histogram->min ? histogram->min : value;
+        }
+    }
+    return histogram->max;
+}
+
+uint64_t histogram_mean(histogram_t const *histogram) {
+    return histogram->count == 0 ? 0 : histogram->sum / histogram->count;
+}
@@ -0,0 +1,72 @@
+#ifndef __UTILS_HISTOGRAM_H__
+#define __UTILS_HISTOGRAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Log-linear (HDR-style) histogram of non-negative values, such as latencies
+ * in nanoseconds.
+ *
+ * Values below 32 get a bucket each; above that, every power of two is split
+ * into 32 buckets, so a value is known to within about 3% whatever its
+ * magnitude, in a fixed amount of memory. Values of 2^40 and above (about 18
+ * minutes, in nanoseconds) are counted in the last bucket.
+ *
+ * Recording is not synchronized: a histogram must have a single writer.
+ * Readers may merge it into their own copy at any time (every field is read
+ * and written atomically, so they see a recent, if not exact, state).
+ */
+
+// Bits of a value kept past its most significant one
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+// Most significant bit of the largest value with a bucket of its own
+#define HISTOGRAM_MAX_BIT 39
+#define HISTOGRAM_BUCKETS                                                      \
+    (HISTOGRAM_SUB_BUCKETS +                                                   \
+     (HISTOGRAM_MAX_BIT - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/**
+ * Initializes an empty histogram.
+ */
+void histogram_init(histogram_t *histogram);
+
+/**
+ * Counts a value.
+ */
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+/**
+ * Adds the values counted in one histogram to another.
+ *
+ * Input:
+ *   - into: histogram to add to (only touched by the caller)
+ *   - from: histogram to add, which may be recorded to meanwhile
+ */
+void histogram_merge(histogram_t *into, histogram_t const *from);
+
+/**
+ * Returns the value below which the given fraction of the values fall (the
+ * middle of its bucket), or 0 if the histogram is empty.
+ *
+ * Input:
+ *   - histogram: histogram to look into
+ *   - quantile: between 0 and 1 (0.5 for the median, 0.99 for p99...)
+ */
+uint64_t histogram_quantile(histogram_t const *histogram, double quantile);
+
+/**
+ * Returns the mean of the values, or 0 if the histogram is empty.
+ */
+uint64_t histogram_mean(histogram_t const *histogram);
+
+#endif // __UTILS_HISTOGRAM_H__
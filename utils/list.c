@@ -8,6 +8,7 @@
 void list_init(List *list) {
     list->head = NULL;
     list->tail = NULL;
+    list->size = 0;
     pthread_mutex_init(&list->lock, NULL);
 }
 
@@ -18,8 +19,7 @@ void list_add(List *list, tfs_file file) {
     ListNode *node = malloc(sizeof(ListNode));
     node->file = file;
     node->next = NULL;
-    pthread_mutex_init(&file.lock, NULL);
-    pthread_cond_init(&file.cond, NULL);
+    pthread_mutex_init(&node->file.lock, NULL);
 
     // if the list is empty, the new node is the head and the tail
     if (list->head == NULL) {
@@ -50,6 +50,10 @@ void list_remove(List *list, ListNode *prev, ListNode *node) {
     } else {
         prev->next = node->next;
     }
+    // if the node is the tail, the previous node is the new tail
+    if (list->tail == node) {
+        list->tail = prev;
+    }
 
     free(node);
     list->size--;
@@ -1,5 +1,789 @@
 #include "logging.h"
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 log_level_t g_level = LOG_VERBOSE;
 
 void set_log_level(log_level_t level) { g_level = level; }
+
+// Bytes of queued messages per thread
+#define RING_SIZE (64 * 1024)
+// Largest queued message (header and arguments); longer strings are cut
+#define MAX_RECORD 2048
+// Longest formatted message, like the old stack buffers
+#define MAX_MESSAGE 2048
+// How long the drain thread sleeps when there's nothing to write, unless woken
+#define IDLE_WAIT_MS 100
+
+// Marks the rest of the ring as unused, the next record is at its start
+#define KIND_WRAP UINT32_MAX
+
+// Records are aligned to this, so a wrap marker always fits at the end
+#define ALIGN 8
+
+// The start of every record (all a wrap marker has room for)
+typedef struct {
+    uint32_t size; // of the whole record, aligned
+    uint32_t kind;
+} record_prefix_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t kind;
+    char const *file;
+    char const *func;
+    char const *fmt;
+    int line;
+} record_header_t;
+
+/**
+ * A thread's queued messages: the thread writes records at head, the drain
+ * thread consumes them from tail (both only ever grow; positions in data are
+ * taken modulo RING_SIZE).
+ */
+typedef struct log_ring {
+    uint64_t head;
+    uint64_t tail;
+    // Set once the thread exits; the ring is freed after being drained
+    bool closed;
+    struct log_ring *next;
+    _Alignas(ALIGN) char data[RING_SIZE];
+} log_ring_t;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static _Thread_local log_ring_t *my_ring;
+// Set while the thread is in log_write or drains the rings, and so may hold
+// the locks below: a signal handler logging on the thread then writes its
+// message right away instead (the clients clean up and log from SIGINT)
+static _Thread_local volatile sig_atomic_t in_log;
+
+// Guards the list of rings and the sleeping flag
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static log_ring_t *rings;
+static bool sleeping;
+
+// Serializes draining (the drain thread and log_flush); only whoever holds it
+// removes rings from the list
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Formatted lines not yet written to stderr (which is unbuffered), guarded by
+// output_lock
+static char output[64 * 1024];
+static size_t output_size;
+
+static char const *const prefixes[] = {
+    [LOG_KIND_INFO] = "[INFO]:  ",
+    [LOG_KIND_WARN] = "[WARN]:  ",
+    [LOG_KIND_LOG] = "[LOG]:   ",
+    [LOG_KIND_DEBUG] = "[DEBUG]: ",
+};
+
+/**
+ * The parts of a printf conversion specification that decide which argument
+ * it takes.
+ */
+typedef struct {
+    char const *start; // the '%'
+    size_t len;        // up to and including the conversion character
+    bool star_width;
+    bool star_precision;
+    char length; // 'H' for hh, 'h', 'l', 'q' for ll, 'L', 'j', 'z', 't' or 0
+    size_t length_chars;
+    char conversion;
+} spec_t;
+
+/**
+ * Parses the conversion specification starting at fmt (a '%').
+ */
+static spec_t parse_spec(char const *fmt) {
+    spec_t spec = {.start = fmt};
+    char const *p = fmt + 1;
+    while (strchr("-+ #0'", *p) != NULL && *p != '\0') {
+        p++;
+    }
+    if (*p == '*') {
+        spec.star_width = true;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec.star_precision = true;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (p[0] == 'h' && p[1] == 'h') {
+        spec.length = 'H';
+        spec.length_chars = 2;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        spec.length = 'q';
+        spec.length_chars = 2;
+    } else if (*p != '\0' && strchr("hlLjzt", *p) != NULL) {
+        spec.length = *p;
+        spec.length_chars = 1;
+    }
+    p += spec.length_chars;
+    spec.conversion = *p;
+    spec.len = (size_t)(p - fmt) + (*p != '\0');
+    return spec;
+}
+
+/**
+ * Appends len bytes of data to the record being encoded, if they fit.
+ */
+static bool put(char *record, size_t *pos, void const *data, size_t len) {
+    if (*pos + len > MAX_RECORD) {
+        return false;
+    }
+    memcpy(record + *pos, data, len);
+    *pos += len;
+    return true;
+}
+
+/**
+ * Copies the arguments of a message into record, after its header, following
+ * fmt.
+ *
+ * Integers are stored as 64 bits, floating point numbers as double (or long
+ * double), pointers as 64 bits and strings as a 32 bit length followed by
+ * their characters.
+ *
+ * Returns the size of the record.
+ */
+static size_t encode_args(char *record, char const *fmt, va_list args) {
+    size_t pos = sizeof(record_header_t);
+    for (char const *p = strchr(fmt, '%'); p != NULL; p = strchr(p, '%')) {
+        spec_t spec = parse_spec(p);
+        p += spec.len;
+        if (spec.conversion == '%' || spec.conversion == '\0') {
+            continue;
+        }
+
+        if (spec.star_width) {
+            int64_t width = va_arg(args, int);
+            put(record, &pos, &width, sizeof(width));
+        }
+        if (spec.star_precision) {
+            int64_t precision = va_arg(args, int);
+            put(record, &pos, &precision, sizeof(precision));
+        }
+
+        switch (spec.conversion) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'c': {
+            uint64_t value;
+            switch (spec.length) {
+            case 'l':
+                value = (uint64_t)va_arg(args, long);
+                break;
+            case 'q':
+                value = (uint64_t)va_arg(args, long long);
+                break;
+            case 'j':
+                value = (uint64_t)va_arg(args, intmax_t);
+                break;
+            case 'z':
+                value = (uint64_t)va_arg(args, size_t);
+                break;
+            case 't':
+                value = (uint64_t)va_arg(args, ptrdiff_t);
+                break;
+            default:
+                value = (uint64_t)va_arg(args, int);
+                break;
+            }
+            put(record, &pos, &value, sizeof(value));
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            if (spec.length == 'L') {
+                long double value = va_arg(args, long double);
+                put(record, &pos, &value, sizeof(value));
+            } else {
+                double value = va_arg(args, double);
+                put(record, &pos, &value, sizeof(value));
+            }
+            break;
+        }
+        case 's': {
+            char const *str = va_arg(args, char const *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            size_t left = MAX_RECORD - pos;
+            uint32_t len = (uint32_t)strnlen(str, MAX_MESSAGE);
+            if (sizeof(len) + len > left) {
+                len = left > sizeof(len) ? (uint32_t)(left - sizeof(len)) : 0;
+            }
+            if (put(record, &pos, &len, sizeof(len))) {
+                put(record, &pos, str, len);
+            }
+            break;
+        }
+        case 'p': {
+            uint64_t value = (uintptr_t)va_arg(args, void *);
+            put(record, &pos, &value, sizeof(value));
+            break;
+        }
+        default:
+            // %n and unknown conversions take no argument here
+            break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Reads the next len bytes of arguments (zeroes if the record was cut short).
+ */
+static void get(char const *record, size_t size, size_t *pos, void *data,
+                size_t len) {
+    if (*pos + len <= size) {
+        memcpy(data, record + *pos, len);
+    } else {
+        memset(data, 0, len);
+    }
+    *pos += len;
+}
+
+/**
+ * Rewrites a conversion specification for the argument as stored in the
+ * record: '*' widths and precisions become their values, and the length
+ * modifier is replaced by the given one.
+ *
+ * Returns false if it doesn't fit in format.
+ */
+static bool normalize_spec(spec_t const *spec, int64_t const *stars,
+                           char const *length, char *format, size_t size) {
+    size_t len = 0;
+    size_t used_stars = 0;
+    char const *end = spec->start + spec->len - 1 - spec->length_chars;
+    for (char const *c = spec->start; c < end; c++) {
+        if (*c != '*') {
+            if (len + 1 >= size) {
+                return false;
+            }
+            format[len++] = *c;
+            continue;
+        }
+        int n = snprintf(format + len, size - len, "%lld",
+                         (long long)stars[used_stars++]);
+        if (n < 0 || (size_t)n >= size - len) {
+            return false;
+        }
+        len += (size_t)n;
+    }
+
+    int n = snprintf(format + len, size - len, "%s%c", length,
+                     spec->conversion);
+    return n >= 0 && (size_t)n < size - len;
+}
+
+/**
+ * Writes value in decimal to out, without the snprintf overhead, for the
+ * plain %d and %u conversions most messages use.
+ *
+ * Returns the number of characters written (at most room - 1).
+ */
+static size_t format_decimal(char *out, size_t room, uint64_t value,
+                             bool negative) {
+    char digits[21];
+    size_t n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    if (negative) {
+        digits[n++] = '-';
+    }
+
+    size_t len = 0;
+    while (n > 0 && len + 1 < room) {
+        out[len++] = digits[--n];
+    }
+    out[len] = '\0';
+    return len;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+/**
+ * Formats a message from its format and the arguments copied into the record.
+ */
+static void format_message(char *out, size_t out_size, char const *fmt,
+                           char const *record, size_t size) {
+    size_t pos = sizeof(record_header_t);
+    size_t len = 0;
+    char const *p = fmt;
+    while (*p != '\0' && len + 1 < out_size) {
+        if (*p != '%') {
+            out[len++] = *p++;
+            continue;
+        }
+
+        spec_t spec = parse_spec(p);
+        p += spec.len;
+        if (spec.conversion == '%') {
+            out[len++] = '%';
+            continue;
+        }
+        if (spec.conversion == '\0') {
+            break;
+        }
+
+        int64_t stars[2];
+        size_t n_stars = 0;
+        if (spec.star_width) {
+            get(record, size, &pos, &stars[n_stars++], sizeof(int64_t));
+        }
+        if (spec.star_precision) {
+            get(record, size, &pos, &stars[n_stars++], sizeof(int64_t));
+        }
+
+        // Every conversion is formatted on its own, with the argument type it
+        // was stored as
+        char format[64];
+        char *dest = out + len;
+        size_t room = out_size - len;
+        // No flags, width or precision
+        bool plain = spec.len == 2 + spec.length_chars;
+        switch (spec.conversion) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X': {
+            uint64_t value;
+            get(record, size, &pos, &value, sizeof(value));
+            if (plain && spec.conversion == 'u' && spec.length != 'H' &&
+                spec.length != 'h') {
+                if (spec.length == 0) {
+                    value = (unsigned int)value;
+                }
+                len += format_decimal(dest, room, value, false);
+                continue;
+            }
+            if (plain &&
+                (spec.conversion == 'd' || spec.conversion == 'i') &&
+                spec.length != 'H' && spec.length != 'h') {
+                int64_t signed_value =
+                    spec.length == 0 ? (int)value : (int64_t)value;
+                uint64_t magnitude = signed_value < 0
+                                         ? 0 - (uint64_t)signed_value
+                                         : (uint64_t)signed_value;
+                len += format_decimal(dest, room, magnitude, signed_value < 0);
+                continue;
+            }
+            // Narrower arguments are narrowed again, as printf would
+            char const *length = spec.length == 'H'   ? "hh"
+                                 : spec.length == 'h' ? "h"
+                                 : spec.length == 0   ? ""
+                                                      : "ll";
+            if (normalize_spec(&spec, stars, length, format, sizeof(format))) {
+                if (spec.length == 'H' || spec.length == 'h' ||
+                    spec.length == 0) {
+                    snprintf(dest, room, format, (int)value);
+                } else {
+                    snprintf(dest, room, format, (long long)value);
+                }
+            }
+            break;
+        }
+        case 'c': {
+            uint64_t value;
+            get(record, size, &pos, &value, sizeof(value));
+            if (normalize_spec(&spec, stars, "", format, sizeof(format))) {
+                snprintf(dest, room, format, (int)value);
+            }
+            break;
+        }
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            if (spec.length == 'L') {
+                long double value;
+                get(record, size, &pos, &value, sizeof(value));
+                if (normalize_spec(&spec, stars, "L", format,
+                                   sizeof(format))) {
+                    snprintf(dest, room, format, value);
+                }
+            } else {
+                double value;
+                get(record, size, &pos, &value, sizeof(value));
+                if (normalize_spec(&spec, stars, "", format, sizeof(format))) {
+                    snprintf(dest, room, format, value);
+                }
+            }
+            break;
+        }
+        case 's': {
+            uint32_t str_len;
+            get(record, size, &pos, &str_len, sizeof(str_len));
+            if (pos + str_len > size) {
+                str_len = pos < size ? (uint32_t)(size - pos) : 0;
+            }
+            char str[MAX_MESSAGE];
+            if (str_len >= sizeof(str)) {
+                str_len = sizeof(str) - 1;
+            }
+            if (plain) {
+                size_t n = str_len < room - 1 ? str_len : room - 1;
+                memcpy(dest, record + pos, n);
+                pos += str_len;
+                len += strnlen(dest, n);
+                continue;
+            }
+            memcpy(str, record + pos, str_len);
+            str[str_len] = '\0';
+            pos += str_len;
+            if (normalize_spec(&spec, stars, "", format, sizeof(format))) {
+                snprintf(dest, room, format, str);
+            }
+            break;
+        }
+        case 'p': {
+            uint64_t value;
+            get(record, size, &pos, &value, sizeof(value));
+            if (normalize_spec(&spec, stars, "", format, sizeof(format))) {
+                snprintf(dest, room, format, (void *)(uintptr_t)value);
+            }
+            break;
+        }
+        default:
+            // Printed as is
+            snprintf(dest, room, "%.*s", (int)spec.len, spec.start);
+            break;
+        }
+        len += strnlen(dest, room - 1);
+    }
+    out[len] = '\0';
+}
+
+#pragma GCC diagnostic pop
+
+static void flush_output() {
+    fwrite(output, 1, output_size, stderr);
+    output_size = 0;
+}
+
+/**
+ * Formats a record as a line in out, cut to fit its room (of at least
+ * 2 * MAX_MESSAGE bytes), like the message was cut to the message buffer.
+ *
+ * Returns the length of the line.
+ */
+static size_t format_line(char *out, size_t room, char const *record,
+                          size_t size) {
+    record_header_t header;
+    memcpy(&header, record, sizeof(header));
+
+    char message[MAX_MESSAGE];
+    format_message(message, sizeof(message), header.fmt, record, size);
+
+    int len = snprintf(out, room, "%s%s:%d :: %s :: %s\n",
+                       prefixes[header.kind], header.file, header.line,
+                       header.func, message);
+    if (len <= 0) {
+        return 0;
+    }
+    return (size_t)len < room ? (size_t)len : room - 1;
+}
+
+/**
+ * Formats a record and appends the line to the output.
+ *
+ * The caller must hold output_lock.
+ */
+static void output_record(char const *record, size_t size) {
+    if (sizeof(output) - output_size < 2 * MAX_MESSAGE) {
+        flush_output();
+    }
+    output_size += format_line(output + output_size,
+                               sizeof(output) - output_size, record, size);
+}
+
+/**
+ * Writes the records queued in a ring.
+ *
+ * Returns true if there were any.
+ */
+static bool drain_ring(log_ring_t *ring) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    bool any = tail != head;
+
+    while (tail != head) {
+        char const *record = ring->data + tail % RING_SIZE;
+        record_prefix_t prefix;
+        memcpy(&prefix, record, sizeof(prefix));
+        if (prefix.kind != KIND_WRAP) {
+            output_record(record, prefix.size);
+        }
+        tail += prefix.size;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return any;
+}
+
+/**
+ * Writes every queued record, freeing the rings of threads that exited.
+ *
+ * Returns true if anything was written.
+ */
+static bool drain_all() {
+    bool any = false;
+    pthread_mutex_lock(&output_lock);
+
+    // Rings are only added at the head, so the rest of the list is stable
+    pthread_mutex_lock(&lock);
+    log_ring_t *ring = rings;
+    pthread_mutex_unlock(&lock);
+
+    while (ring != NULL) {
+        log_ring_t *next = ring->next;
+        // Once closed, the thread won't queue anything else
+        bool closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        any |= drain_ring(ring);
+        if (closed) {
+            pthread_mutex_lock(&lock);
+            log_ring_t **link = &rings;
+            while (*link != ring) {
+                link = &(*link)->next;
+            }
+            *link = next;
+            pthread_mutex_unlock(&lock);
+            free(ring);
+        }
+        ring = next;
+    }
+
+    flush_output();
+    pthread_mutex_unlock(&output_lock);
+    return any;
+}
+
+static void *drain_thread(void *arg) {
+    (void)arg;
+    in_log = true;
+    while (true) {
+        if (drain_all()) {
+            continue;
+        }
+
+        // Nothing queued: sleep until a thread logs (or a while, to free the
+        // rings of exited threads)
+        pthread_mutex_lock(&lock);
+        __atomic_store_n(&sleeping, true, __ATOMIC_SEQ_CST);
+        bool pending = false;
+        for (log_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+            pending |= __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) !=
+                       __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+        if (!pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += IDLE_WAIT_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wakeup, &lock, &deadline);
+        }
+        __atomic_store_n(&sleeping, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void close_ring(void *ring) {
+    __atomic_store_n(&((log_ring_t *)ring)->closed, true, __ATOMIC_RELEASE);
+}
+
+static void at_exit() { log_flush(); }
+
+static void start() {
+    pthread_key_create(&ring_key, close_ring);
+
+    // Log messages must be written even if the drain thread isn't the one
+    // exiting, and must not keep the process alive
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, drain_thread, NULL);
+    pthread_attr_destroy(&attr);
+    atexit(at_exit);
+}
+
+/**
+ * Returns the calling thread's ring, creating it on its first message.
+ */
+static log_ring_t *get_ring() {
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    pthread_once(&once, start);
+    log_ring_t *ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    pthread_setspecific(ring_key, ring);
+
+    pthread_mutex_lock(&lock);
+    ring->next = rings;
+    __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    my_ring = ring;
+    return ring;
+}
+
+/**
+ * Wakes up the drain thread if it's sleeping (it checks the rings after saying
+ * so, so one of the two sees the other), or in any case if forced.
+ */
+static void wake_drain(bool force) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (force || __atomic_load_n(&sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&wakeup);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+/**
+ * Copies a record into the ring, unless there's no room for it.
+ *
+ * Returns true if it was queued.
+ */
+static bool push(log_ring_t *ring, char const *record, size_t size) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    // A record that doesn't fit before the end of the ring goes at its start,
+    // after a wrap marker taking up the rest
+    size_t offset = head % RING_SIZE;
+    size_t skip = offset + size > RING_SIZE ? RING_SIZE - offset : 0;
+    if (head + skip + size - tail > RING_SIZE) {
+        return false;
+    }
+
+    if (skip > 0) {
+        record_prefix_t wrap = {.size = (uint32_t)skip, .kind = KIND_WRAP};
+        memcpy(ring->data + offset, &wrap, sizeof(wrap));
+        offset = 0;
+    }
+    memcpy(ring->data + offset, record, size);
+    __atomic_store_n(&ring->head, head + skip + size, __ATOMIC_RELEASE);
+    return true;
+}
+
+void log_write(log_kind_t kind, char const *file, int line, char const *func,
+               char const *fmt, ...) {
+    _Alignas(ALIGN) char record[MAX_RECORD];
+    va_list args;
+    va_start(args, fmt);
+    size_t size = encode_args(record, fmt, args);
+    va_end(args);
+
+    size = (size + ALIGN - 1) / ALIGN * ALIGN;
+    record_header_t header = {
+        .size = (uint32_t)size,
+        .kind = kind,
+        .file = file,
+        .func = func,
+        .fmt = fmt,
+        .line = line,
+    };
+    memcpy(record, &header, sizeof(header));
+
+    if (in_log) {
+        // From a signal handler that interrupted the thread while logging,
+        // with no locks to take: written right away (maybe ahead of messages
+        // still queued)
+        char text[2 * MAX_MESSAGE];
+        size_t len = format_line(text, sizeof(text), record, size);
+        for (size_t done = 0; done < len;) {
+            ssize_t n = write(STDERR_FILENO, text + done, len - done);
+            if (n <= 0) {
+                break;
+            }
+            done += (size_t)n;
+        }
+        return;
+    }
+    in_log = true;
+
+    log_ring_t *ring = get_ring();
+    if (ring == NULL) {
+        // No memory for a ring: written right away instead
+        pthread_mutex_lock(&output_lock);
+        output_record(record, size);
+        flush_output();
+        pthread_mutex_unlock(&output_lock);
+        in_log = false;
+        return;
+    }
+
+    bool full = false;
+    while (!push(ring, record, size)) {
+        // Wait for the drain thread to make room, rather than lose messages
+        full = true;
+        wake_drain(true);
+        sched_yield();
+    }
+    if (!full) {
+        wake_drain(false);
+    }
+    in_log = false;
+}
+
+void log_flush(void) {
+    if (__atomic_load_n(&rings, __ATOMIC_ACQUIRE) == NULL) {
+        return; // nothing was ever logged
+    }
+    if (in_log) {
+        // Called (through exit) from a signal handler that interrupted the
+        // thread while logging, holding locks drain_all would wait for
+        return;
+    }
+    in_log = true;
+    drain_all();
+    in_log = false;
+}
@@ -13,18 +13,51 @@ typedef enum {
 void set_log_level(log_level_t level);
 extern log_level_t g_level;
 
+// Most verbose level compiled in: calls above it are dead code, removed by the
+// compiler (but still type-checked). Set with make LOG_LEVEL=quiet|normal
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_VERBOSE
+#endif
+
+// Kinds of log messages (their prefix)
+typedef enum {
+    LOG_KIND_INFO,
+    LOG_KIND_WARN,
+    LOG_KIND_LOG,
+    LOG_KIND_DEBUG,
+} log_kind_t;
+
+/**
+ * Queues a log message, to be formatted and written to stderr by a background
+ * thread.
+ *
+ * Only the arguments are copied here (strings by value); the message is
+ * formatted later, from fmt, which must be a string literal. Each thread queues
+ * into its own ring, so logging threads don't contend; a thread whose ring is
+ * full waits for the background thread to make room.
+ *
+ * A signal handler that interrupts its thread while logging may log too: its
+ * messages are written right away, without the locks its thread may hold.
+ */
+void log_write(log_kind_t kind, char const *file, int line, char const *func,
+               char const *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+/**
+ * Writes every queued log message to stderr (unless called from a signal
+ * handler that interrupted its thread while logging).
+ */
+void log_flush(void);
+
 #define INFO(...)                                                              \
     do {                                                                       \
-        char buf[2048];                                                        \
-        snprintf(buf, 2048, __VA_ARGS__);                                      \
-        fprintf(stderr, "[INFO]:  %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
-                __func__, buf);                                                \
+        log_write(LOG_KIND_INFO, __FILE__, __LINE__, __func__, __VA_ARGS__);   \
     } while (0);
 
 #define PANIC(...)                                                             \
     do {                                                                       \
         char buf[2048];                                                        \
         snprintf(buf, 2048, __VA_ARGS__);                                      \
+        log_flush();                                                           \
         fprintf(stderr, "[PANIC]: %s:%d :: %s :: %s\n", __FILE__, __LINE__,    \
                 __func__, buf);                                                \
         exit(EXIT_FAILURE);                                                    \
@@ -32,31 +65,25 @@ extern log_level_t g_level;
 
 #define WARN(...)                                                              \
     do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[WARN]:  %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
+        if (LOG_COMPILE_LEVEL >= LOG_NORMAL && g_level >= LOG_NORMAL) {        \
+            log_write(LOG_KIND_WARN, __FILE__, __LINE__, __func__,             \
+                      __VA_ARGS__);                                            \
         }                                                                      \
     } while (0);
 
 #define LOG(...)                                                               \
     do {                                                                       \
-        if (g_level == LOG_NORMAL || g_level == LOG_VERBOSE) {                 \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[LOG]:   %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
+        if (LOG_COMPILE_LEVEL >= LOG_NORMAL && g_level >= LOG_NORMAL) {        \
+            log_write(LOG_KIND_LOG, __FILE__, __LINE__, __func__,              \
+                      __VA_ARGS__);                                            \
         }                                                                      \
     } while (0);
 
 #define DEBUG(...)                                                             \
     do {                                                                       \
-        if (g_level == LOG_VERBOSE) {                                          \
-            char buf[2048];                                                    \
-            snprintf(buf, 2048, __VA_ARGS__);                                  \
-            fprintf(stderr, "[DEBUG]: %s:%d :: %s :: %s\n", __FILE__,          \
-                    __LINE__, __func__, buf);                                  \
+        if (LOG_COMPILE_LEVEL >= LOG_VERBOSE && g_level >= LOG_VERBOSE) {      \
+            log_write(LOG_KIND_DEBUG, __FILE__, __LINE__, __func__,            \
+                      __VA_ARGS__);                                            \
         }                                                                      \
     } while (0);
 
@@ -0,0 +1,130 @@
+#include "message_ring.h"
+#include "frame.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Bytes of message contents kept per box
+#define RING_BYTES (256 * 1024)
+// Messages kept per box
+#define RING_MESSAGES 4096
+
+struct message_ring {
+    pthread_rwlock_t lock;
+    // Messages [first_seq, next_seq) are in the ring, message seq in
+    // messages[seq % RING_MESSAGES] (NULL if it couldn't be allocated)
+    uint64_t first_seq;
+    uint64_t next_seq;
+    ring_message_t *messages[RING_MESSAGES];
+    size_t bytes_used;
+};
+
+message_ring_t *message_ring_create(uint64_t first_seq) {
+    message_ring_t *ring = malloc(sizeof(message_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    pthread_rwlock_init(&ring->lock, NULL);
+    ring->first_seq = first_seq;
+    ring->next_seq = first_seq;
+    ring->bytes_used = 0;
+    return ring;
+}
+
+void message_ring_destroy(message_ring_t *ring) {
+    for (uint64_t seq = ring->first_seq; seq < ring->next_seq; seq++) {
+        ring_message_t *message = ring->messages[seq % RING_MESSAGES];
+        if (message != NULL) {
+            message_release(message);
+        }
+    }
+    pthread_rwlock_destroy(&ring->lock);
+    free(ring);
+}
+
+/**
+ * Allocates a message holding its SEND_MESSAGE frame, with a single reference
+ * (the ring's).
+ *
+ * Returns the message, or NULL if out of memory.
+ */
+static ring_message_t *message_new(char const *contents, size_t len,
+                                   uint64_t offset, uint64_t published) {
+    // The frame carries the message without its '\0', like frame_encode
+    size_t length = strnlen(contents, len > 0 ? len - 1 : 0);
+    frame_header_t header = {.opcode = SEND_MESSAGE,
+                             .length = (uint16_t)length};
+
+    ring_message_t *message =
+        malloc(sizeof(ring_message_t) + sizeof(header) + length);
+    if (message == NULL) {
+        return NULL;
+    }
+
+    message->refs = 1;
+    message->len = len;
+    message->offset = offset;
+    message->published = published;
+    message->frame_size = sizeof(header) + length;
+    memcpy(message->frame, &header, sizeof(header));
+    memcpy(message->frame + sizeof(header), contents, length);
+    return message;
+}
+
+uint64_t message_ring_append(message_ring_t *ring, char const *message,
+                             size_t len, uint64_t offset, uint64_t published) {
+    // Allocated and filled in before taking the lock, to keep readers waiting
+    // only for the few pointers changed below
+    ring_message_t *added = message_new(message, len, offset, published);
+    size_t bytes = added != NULL ? len : 0;
+
+    pthread_rwlock_wrlock(&ring->lock);
+
+    // Evict the oldest messages until the new one fits (sessions still
+    // writing them keep them alive)
+    while (ring->next_seq - ring->first_seq == RING_MESSAGES ||
+           ring->bytes_used + bytes > RING_BYTES) {
+        ring_message_t *evicted =
+            ring->messages[ring->first_seq % RING_MESSAGES];
+        if (evicted != NULL) {
+            ring->bytes_used -= evicted->len;
+            message_release(evicted);
+        }
+        ring->first_seq++;
+    }
+
+    uint64_t seq = ring->next_seq++;
+    ring->messages[seq % RING_MESSAGES] = added;
+    ring->bytes_used += bytes;
+
+    pthread_rwlock_unlock(&ring->lock);
+    return seq;
+}
+
+ring_result_t message_ring_acquire(message_ring_t *ring, uint64_t seq,
+                                   ring_message_t **message) {
+    pthread_rwlock_rdlock(&ring->lock);
+
+    if (seq >= ring->next_seq) {
+        pthread_rwlock_unlock(&ring->lock);
+        return RING_NOT_YET;
+    }
+    ring_message_t *found =
+        seq < ring->first_seq ? NULL : ring->messages[seq % RING_MESSAGES];
+    if (found == NULL) {
+        pthread_rwlock_unlock(&ring->lock);
+        return RING_EVICTED;
+    }
+
+    __atomic_fetch_add(&found->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&ring->lock);
+
+    *message = found;
+    return RING_OK;
+}
+
+void message_release(ring_message_t *message) {
+    if (__atomic_sub_fetch(&message->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(message);
+    }
+}
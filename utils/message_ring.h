@@ -0,0 +1,97 @@
+#ifndef __UTILS_MESSAGE_RING_H__
+#define __UTILS_MESSAGE_RING_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Bounded in-memory copy of the most recent messages of a box.
+ *
+ * Every message gets the next sequence number (its index among all the
+ * messages ever published to the box) and remembers where it starts in the
+ * box, so readers that fall behind the ring can resume from the box itself.
+ * The oldest messages are evicted when the ring runs out of bytes or entries.
+ */
+typedef struct message_ring message_ring_t;
+
+typedef enum {
+    RING_OK = 0,
+    // The message was not published yet
+    RING_NOT_YET = 1,
+    // The message was already evicted (read it from the box instead)
+    RING_EVICTED = 2,
+} ring_result_t;
+
+/**
+ * Creates an empty ring.
+ *
+ * Input:
+ *   - first_seq: sequence number of the first message to be appended (the
+ *     number of messages already in the box)
+ *
+ * Returns the ring, or NULL if out of memory.
+ */
+message_ring_t *message_ring_create(uint64_t first_seq);
+
+/**
+ * Frees the ring.
+ */
+void message_ring_destroy(message_ring_t *ring);
+
+/**
+ * A message kept by a ring, already encoded as the SEND_MESSAGE frame that
+ * delivers it, so every subscriber writes the same bytes to its pipe.
+ *
+ * Shared by the ring and the sessions writing it: message_ring_acquire takes
+ * a reference to it and message_release drops one, freeing the message once
+ * neither the ring nor any session holds it.
+ */
+typedef struct {
+    unsigned refs;
+    // Length of the message in the box (including the terminating '\0')
+    size_t len;
+    uint64_t offset;
+    uint64_t published;
+    size_t frame_size;
+    char frame[];
+} ring_message_t;
+
+/**
+ * Appends a message, evicting the oldest ones if needed.
+ *
+ * Input:
+ *   - ring: ring to append to
+ *   - message: message contents (including the terminating '\0')
+ *   - len: length of the message, at most MESSAGE_SIZE
+ *   - offset: position of the message in the box
+ *   - published: when the message was published (kept in the message, for
+ *     measuring how long delivery took)
+ *
+ * Returns the message's sequence number. If out of memory, the message still
+ * gets one but is left out of the ring (as if already evicted).
+ */
+uint64_t message_ring_append(message_ring_t *ring, char const *message,
+                             size_t len, uint64_t offset, uint64_t published);
+
+/**
+ * Takes a reference to the message with the given sequence number, which
+ * stays valid (even once evicted) until released with message_release.
+ *
+ * Input:
+ *   - ring: ring to read from
+ *   - seq: sequence number of the message
+ *   - message: where to store the message
+ *
+ * Returns RING_OK if the message was acquired, or why it wasn't.
+ */
+ring_result_t message_ring_acquire(message_ring_t *ring, uint64_t seq,
+                                   ring_message_t **message);
+
+/**
+ * Drops a reference to a message taken with message_ring_acquire.
+ */
+void message_release(ring_message_t *message);
+
+#endif // __UTILS_MESSAGE_RING_H__
@@ -1,6 +1,9 @@
+#include "frame.h"
 #include "logging.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -42,9 +45,12 @@ int pipe_open(char *pipeName, int mode) {
 }
 
 void pipe_write(int pipe, packet_t *packet) {
+    char frame[FRAME_MAX_SIZE];
+    size_t size = frame_encode(packet, frame);
+
     int i;
     for (i = 0; i < RETRY_COUNT; i++) {
-        if (write(pipe, packet, sizeof(packet_t)) >= 0) {
+        if (write(pipe, frame, size) >= 0) {
             return;
         }
         WARN("Failed to write to pipe, retrying...");
@@ -53,17 +59,47 @@ void pipe_write(int pipe, packet_t *packet) {
     PANIC("Failed to write to pipe");
 }
 
+/**
+ * Reads exactly len bytes, unless the pipe is closed first.
+ *
+ * Returns true if all len bytes were read.
+ */
+static bool read_exactly(int pipe, void *data, size_t len) {
+    size_t done = 0;
+    int failures = 0;
+    while (done < len) {
+        ssize_t bytes_read = read(pipe, (char *)data + done, len - done);
+        if (bytes_read == 0) {
+            return false;
+        }
+        if (bytes_read < 0) {
+            if (errno != EINTR && ++failures == RETRY_COUNT) {
+                PANIC("Failed to read from pipe");
+            }
+            WARN("Failed to read from pipe, retrying...");
+            wait_retry();
+            continue;
+        }
+        done += (size_t)bytes_read;
+    }
+    return true;
+}
+
 packet_t pipe_read(int pipe) {
     packet_t packet;
-    int i;
-    for (i = 0; i < RETRY_COUNT; i++) {
-        if (read(pipe, &packet, sizeof(packet_t)) >= 0) {
-            return packet;
-        }
-        WARN("Failed to read from pipe, retrying...");
-        wait_retry();
+    frame_header_t header;
+    char payload[sizeof(packet_t)];
+
+    // Only the frame is read, so whatever follows it stays in the pipe
+    if (!read_exactly(pipe, &header, sizeof(header)) ||
+        header.length > sizeof(payload) ||
+        !read_exactly(pipe, payload, header.length)) {
+        memset(&packet, 0, sizeof(packet));
+        return packet;
     }
-    PANIC("Failed to read from pipe");
+
+    frame_decode(&header, payload, &packet);
+    return packet;
 }
 
 void pipe_close(int pipe) {
@@ -17,7 +17,7 @@ void pipe_create(char *pipeName);
 int pipe_open(char *pipeName, int mode);
 
 /**
- * Writes a packet to the given pipe.
+ * Writes a packet to the given pipe, as a frame (see frame.h).
  */
 void pipe_write(int pipe, packet_t *packet);
 
@@ -27,7 +27,10 @@ void pipe_write(int pipe, packet_t *packet);
 void pipe_close(int pipe);
 
 /**
- * Reads a packet from the given pipe.
+ * Reads a packet (one frame) from the given pipe.
+ *
+ * Returns a packet with opcode 0 if the pipe was closed before a whole frame
+ * was read.
  */
 packet_t pipe_read(int pipe);
 
@@ -2,6 +2,7 @@
 #define __PROTOCOL_H__
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PIPE_NAME_SIZE 256
@@ -19,7 +20,14 @@ enum packet_opcode_t {
     LIST_MAILBOXES = 7,
     LIST_MAILBOXES_ANSWER = 8,
     PUBLISH_MESSAGE = 9,
-    SEND_MESSAGE = 10
+    SEND_MESSAGE = 10,
+    PUBLISH_MESSAGE_BATCH = 11,
+    STATS = 12,
+    STATS_ANSWER = 13,
+    // Like REGISTER_PUBLISHER and REGISTER_SUBSCRIBER, for clients that pass
+    // messages through a shared ring instead of their pipe (see shm_ring.h)
+    REGISTER_PUBLISHER_SHM = 14,
+    REGISTER_SUBSCRIBER_SHM = 15
 };
 
 typedef struct registration_data_t {
@@ -48,6 +56,33 @@ typedef struct message_data_t {
     char message[MESSAGE_SIZE];
 } message_data_t;
 
+// Several messages published at once, each with its terminating '\0', back to
+// back in the first length bytes of messages
+typedef struct batch_data_t {
+    uint16_t length;
+    char messages[MESSAGE_SIZE];
+} batch_data_t;
+
+// Kinds of entries in the answer to STATS, and what their values are
+typedef enum {
+    // values[0]: the counter
+    STATS_COUNTER = 0,
+    // values: count, mean, min, p50, p90, p99, p99.9 and max, in nanoseconds
+    STATS_LATENCY = 1,
+    // values: messages in, messages out, bytes in, bytes out, publishers and
+    // subscribers of the box called name
+    STATS_BOX = 2,
+} stats_kind_t;
+
+#define STATS_VALUES 8
+
+typedef struct stats_data_t {
+    uint8_t last;
+    uint8_t kind;
+    char name[BOX_NAME_SIZE];
+    uint64_t values[STATS_VALUES];
+} stats_data_t;
+
 typedef struct __attribute__((packed)) packet_t {
     uint8_t opcode;
     union {
@@ -56,16 +91,36 @@ typedef struct __attribute__((packed)) packet_t {
         list_box_data_t list_box_data;
         mailbox_data_t mailbox_data;
         message_data_t message_data;
+        batch_data_t batch_data;
+        stats_data_t stats_data;
     } payload;
 } packet_t;
 
+// Publisher/subscriber session attached to a box (defined by mbroker)
+struct session;
+// Recent messages of a box (see message_ring.h)
+struct message_ring;
+
 typedef struct tfs_file {
     char box_name[BOX_NAME_SIZE + 1];
     uint64_t n_publishers;
     uint64_t n_subscribers;
     uint64_t box_size;
-    pthread_cond_t cond;
+    uint64_t n_messages;
+    // Delivered to subscribers (updated without the lock)
+    uint64_t messages_out;
+    uint64_t bytes_out;
+    // Guards the counters above and the fields below
     pthread_mutex_t lock;
+    // Created on the first message published
+    struct message_ring *ring;
+    struct session *publisher;
+    struct session *subscribers;
+    // Set once the box is removed, for the sessions still attached to it
+    bool removed;
+    // References held by the registry and by sessions; the node is freed when
+    // the last one is released
+    int refs;
 } tfs_file;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+#include "registry.h"
+#include "message_ring.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_BUCKETS (4 * REGISTRY_STRIPES)
+
+/**
+ * FNV-1a hash of a box name.
+ */
+static size_t hash_name(char const *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < BOX_NAME_SIZE && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+static pthread_mutex_t *stripe(box_registry_t *registry, size_t hash) {
+    return &registry->locks[hash % REGISTRY_STRIPES];
+}
+
+/**
+ * Finds the link pointing to the node with the given name (or the NULL link at
+ * the end of its bucket if there is none).
+ *
+ * The caller must hold the name's stripe lock.
+ */
+static box_node_t **find_link(box_registry_t *registry, char const *name,
+                              size_t hash) {
+    box_node_t **link = &registry->buckets[hash & (registry->n_buckets - 1)];
+    while (*link != NULL && ((*link)->hash != hash ||
+                             strcmp((*link)->file.box_name, name) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void lock_all(box_registry_t *registry) {
+    for (size_t i = 0; i < REGISTRY_STRIPES; i++) {
+        pthread_mutex_lock(&registry->locks[i]);
+    }
+}
+
+static void unlock_all(box_registry_t *registry) {
+    for (size_t i = REGISTRY_STRIPES; i > 0; i--) {
+        pthread_mutex_unlock(&registry->locks[i - 1]);
+    }
+}
+
+/**
+ * Doubles the number of buckets if the registry holds more boxes than that.
+ * The nodes themselves are relinked, not moved.
+ */
+static void grow(box_registry_t *registry) {
+    lock_all(registry);
+
+    // Someone else may have grown it meanwhile
+    if (registry->size > registry->n_buckets) {
+        size_t n_buckets = registry->n_buckets * 2;
+        box_node_t **buckets = calloc(n_buckets, sizeof(box_node_t *));
+        // Out of memory: keep the longer chains
+        if (buckets != NULL) {
+            for (size_t i = 0; i < registry->n_buckets; i++) {
+                box_node_t *node = registry->buckets[i];
+                while (node != NULL) {
+                    box_node_t *next = node->next;
+                    size_t bucket = node->hash & (n_buckets - 1);
+                    node->next = buckets[bucket];
+                    buckets[bucket] = node;
+                    node = next;
+                }
+            }
+            free(registry->buckets);
+            registry->buckets = buckets;
+            registry->n_buckets = n_buckets;
+        }
+    }
+
+    unlock_all(registry);
+}
+
+static void free_node(box_node_t *node) {
+    if (node->file.ring != NULL) {
+        message_ring_destroy(node->file.ring);
+    }
+    pthread_mutex_destroy(&node->file.lock);
+    free(node);
+}
+
+int registry_init(box_registry_t *registry) {
+    registry->buckets = calloc(INITIAL_BUCKETS, sizeof(box_node_t *));
+    if (registry->buckets == NULL) {
+        return -1;
+    }
+    registry->n_buckets = INITIAL_BUCKETS;
+    registry->size = 0;
+    for (size_t i = 0; i < REGISTRY_STRIPES; i++) {
+        pthread_mutex_init(&registry->locks[i], NULL);
+    }
+    return 0;
+}
+
+void registry_destroy(box_registry_t *registry) {
+    for (size_t i = 0; i < registry->n_buckets; i++) {
+        box_node_t *node = registry->buckets[i];
+        while (node != NULL) {
+            box_node_t *next = node->next;
+            free_node(node);
+            node = next;
+        }
+    }
+    free(registry->buckets);
+    for (size_t i = 0; i < REGISTRY_STRIPES; i++) {
+        pthread_mutex_destroy(&registry->locks[i]);
+    }
+}
+
+int registry_add(box_registry_t *registry, tfs_file const *file) {
+    box_node_t *node = malloc(sizeof(box_node_t));
+    if (node == NULL) {
+        return -1;
+    }
+    node->file = *file;
+    node->hash = hash_name(file->box_name);
+    node->next = NULL;
+    pthread_mutex_init(&node->file.lock, NULL);
+    node->file.ring = NULL;
+    node->file.publisher = NULL;
+    node->file.subscribers = NULL;
+    node->file.removed = false;
+    // the registry's own reference
+    node->file.refs = 1;
+
+    pthread_mutex_t *lock = stripe(registry, node->hash);
+    pthread_mutex_lock(lock);
+    box_node_t **link = find_link(registry, file->box_name, node->hash);
+    if (*link != NULL) {
+        pthread_mutex_unlock(lock);
+        free_node(node);
+        return -1;
+    }
+    *link = node;
+    size_t size = __atomic_add_fetch(&registry->size, 1, __ATOMIC_RELAXED);
+    bool full = size > registry->n_buckets;
+    pthread_mutex_unlock(lock);
+
+    if (full) {
+        grow(registry);
+    }
+    return 0;
+}
+
+box_node_t *registry_acquire(box_registry_t *registry, char const *box_name) {
+    size_t hash = hash_name(box_name);
+    pthread_mutex_t *lock = stripe(registry, hash);
+
+    pthread_mutex_lock(lock);
+    box_node_t *node = *find_link(registry, box_name, hash);
+    if (node != NULL) {
+        node->file.refs++;
+    }
+    pthread_mutex_unlock(lock);
+    return node;
+}
+
+void registry_release(box_registry_t *registry, box_node_t *node) {
+    // The refcount is guarded by the stripe of the node's name, whether or not
+    // it is still in the registry
+    pthread_mutex_t *lock = stripe(registry, node->hash);
+    pthread_mutex_lock(lock);
+    bool last = --node->file.refs == 0;
+    pthread_mutex_unlock(lock);
+
+    if (last) {
+        free_node(node);
+    }
+}
+
+box_node_t *registry_unlink(box_registry_t *registry, char const *box_name) {
+    size_t hash = hash_name(box_name);
+    pthread_mutex_t *lock = stripe(registry, hash);
+
+    pthread_mutex_lock(lock);
+    box_node_t **link = find_link(registry, box_name, hash);
+    box_node_t *node = *link;
+    if (node != NULL) {
+        *link = node->next;
+        node->next = NULL;
+        __atomic_sub_fetch(&registry->size, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(lock);
+    return node;
+}
+
+ssize_t registry_snapshot(box_registry_t *registry, box_node_t ***nodes) {
+    lock_all(registry);
+
+    size_t count = registry->size;
+    *nodes = NULL;
+    if (count > 0) {
+        *nodes = malloc(count * sizeof(box_node_t *));
+        if (*nodes == NULL) {
+            unlock_all(registry);
+            return -1;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < registry->n_buckets; i++) {
+        for (box_node_t *node = registry->buckets[i]; node != NULL;
+             node = node->next) {
+            node->file.refs++;
+            (*nodes)[n++] = node;
+        }
+    }
+
+    unlock_all(registry);
+    return (ssize_t)n;
+}
@@ -0,0 +1,87 @@
+#ifndef __UTILS_REGISTRY_H__
+#define __UTILS_REGISTRY_H__
+
+#include "protocol.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Concurrent hash table of the boxes known to mbroker, keyed by box name.
+ *
+ * Buckets are chained and guarded by a fixed set of striped locks (a name
+ * always maps to the same stripe), so lookups of different boxes rarely
+ * contend. Nodes never move once added: sessions hold references to them,
+ * which keep a node alive after it is removed from the registry.
+ */
+typedef struct box_node {
+    tfs_file file;
+    size_t hash;
+    struct box_node *next;
+} box_node_t;
+
+// Number of locks the buckets are striped over
+#define REGISTRY_STRIPES 64
+
+typedef struct {
+    pthread_mutex_t locks[REGISTRY_STRIPES];
+    // Guarded by every stripe lock (resizing takes all of them)
+    box_node_t **buckets;
+    size_t n_buckets; // power of 2, multiple of REGISTRY_STRIPES
+    size_t size;
+} box_registry_t;
+
+/**
+ * Initializes an empty registry.
+ *
+ * Returns 0 if successful, -1 if out of memory.
+ */
+int registry_init(box_registry_t *registry);
+
+/**
+ * Frees the registry and every node still in it.
+ */
+void registry_destroy(box_registry_t *registry);
+
+/**
+ * Adds a box to the registry (the session fields of file are initialized
+ * here).
+ *
+ * Returns 0 if successful, -1 if a box with that name already exists or out of
+ * memory.
+ */
+int registry_add(box_registry_t *registry, tfs_file const *file);
+
+/**
+ * Searches for the box with a given name and takes a reference to it, so it
+ * stays valid (even if removed from the registry) until registry_release.
+ *
+ * Returns the node, or NULL if there is no such box.
+ */
+box_node_t *registry_acquire(box_registry_t *registry, char const *box_name);
+
+/**
+ * Drops a reference to a node, freeing it if it was the last one.
+ */
+void registry_release(box_registry_t *registry, box_node_t *node);
+
+/**
+ * Removes the box with a given name from the registry, without freeing it.
+ *
+ * Returns the node, whose registry reference now belongs to the caller (to be
+ * dropped with registry_release), or NULL if there is no such box.
+ */
+box_node_t *registry_unlink(box_registry_t *registry, char const *box_name);
+
+/**
+ * Takes a reference to every box in the registry.
+ *
+ * Input:
+ *   - registry: registry to list
+ *   - nodes: where to store a malloc'd array of the nodes (NULL if empty),
+ *     each to be dropped with registry_release before freeing the array
+ *
+ * Returns the number of nodes, or -1 if out of memory.
+ */
+ssize_t registry_snapshot(box_registry_t *registry, box_node_t ***nodes);
+
+#endif // __UTILS_REGISTRY_H__
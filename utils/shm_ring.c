@@ -0,0 +1,304 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS, syscall
+#include "shm_ring.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// "SHMRING1", read as a little-endian integer
+#define SHM_RING_MAGIC (0x31474e49524d4853ULL)
+// How often a client waiting on the futex checks whether mbroker is gone
+#define CHECK_INTERVAL_MS 100
+
+/**
+ * First page of a ring, followed by its data. The positions count the bytes
+ * ever written and read, and each side's fields are on a cache line of their
+ * own.
+ */
+struct shm_ring_shared {
+    uint64_t magic;
+    uint64_t capacity;
+    uint32_t closed;
+
+    // Written by the producer
+    _Alignas(64) uint64_t head;
+    // Set by the producer before sleeping until there is room, cleared by the
+    // consumer when waking it up
+    uint32_t producer_sleeping;
+
+    // Written by the consumer
+    _Alignas(64) uint64_t tail;
+    // Set by the consumer before sleeping until there is data, cleared by the
+    // producer when waking it up
+    uint32_t consumer_sleeping;
+};
+
+static size_t page_size() { return (size_t)sysconf(_SC_PAGESIZE); }
+
+static long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void shm_ring_name(char const *pipe_name, char *name) {
+    // FNV-1a hash of the pipe name (which may be too long, or have slashes)
+    uint64_t hash = 14695981039346656037ULL;
+    for (char const *c = pipe_name; *c != '\0'; c++) {
+        hash ^= (unsigned char)*c;
+        hash *= 1099511628211ULL;
+    }
+    snprintf(name, SHM_RING_NAME_SIZE, "/mbroker.%016" PRIx64, hash);
+}
+
+/**
+ * Maps the ring in fd, with its data twice in a row.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int map_ring(shm_ring_t *ring, int fd, size_t capacity) {
+    size_t page = page_size();
+    size_t size = page + 2 * capacity;
+
+    // Reserve the whole range, then map the file over it
+    char *base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+    if (mmap(base, page + capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + page + capacity, capacity, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, (off_t)page) == MAP_FAILED) {
+        munmap(base, size);
+        return -1;
+    }
+
+    ring->shared = (shm_ring_shared_t *)base;
+    ring->data = base + page;
+    ring->capacity = capacity;
+    ring->map = base;
+    ring->map_size = size;
+    ring->position = 0;
+    ring->doorbell = -1;
+    return 0;
+}
+
+int shm_ring_create(shm_ring_t *ring, char const *name, size_t capacity) {
+    size_t rounded = SHM_RING_MIN_CAPACITY;
+    while (rounded < capacity && rounded < SHM_RING_MAX_CAPACITY) {
+        rounded *= 2;
+    }
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)(page_size() + rounded)) == -1 ||
+        map_ring(ring, fd, rounded) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+
+    ring->shared->capacity = rounded;
+    ring->shared->magic = SHM_RING_MAGIC;
+    return 0;
+}
+
+int shm_ring_attach(shm_ring_t *ring, char const *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // The capacity is read once and checked against the file's size; the
+    // client can't change it afterwards
+    struct shm_ring_shared header;
+    struct stat st;
+    if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        fstat(fd, &st) == -1 || header.magic != SHM_RING_MAGIC ||
+        header.capacity < SHM_RING_MIN_CAPACITY ||
+        header.capacity > SHM_RING_MAX_CAPACITY ||
+        (header.capacity & (header.capacity - 1)) != 0 ||
+        (size_t)st.st_size != page_size() + header.capacity ||
+        header.head != 0) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = map_ring(ring, fd, header.capacity);
+    close(fd);
+    return ret;
+}
+
+/**
+ * Wakes up the other side, which said it is sleeping in word.
+ */
+static void wake(shm_ring_t *ring, uint32_t *word) {
+    if (ring->doorbell != -1) {
+        // mbroker waits in epoll for its pipe to be readable; a full pipe
+        // already is
+        ssize_t written;
+        do {
+            written = write(ring->doorbell, "", 1);
+        } while (written < 0 && errno == EINTR);
+        return;
+    }
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void shm_ring_close(shm_ring_t *ring) {
+    __atomic_store_n(&ring->shared->closed, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ring->shared->producer_sleeping, FUTEX_WAKE, INT_MAX,
+            NULL, NULL, 0);
+    syscall(SYS_futex, &ring->shared->consumer_sleeping, FUTEX_WAKE, INT_MAX,
+            NULL, NULL, 0);
+}
+
+bool shm_ring_closed(shm_ring_t const *ring) {
+    return __atomic_load_n(&ring->shared->closed, __ATOMIC_ACQUIRE) != 0;
+}
+
+void shm_ring_detach(shm_ring_t *ring) {
+    munmap(ring->map, ring->map_size);
+    ring->map = NULL;
+}
+
+int shm_ring_write(shm_ring_t *ring, struct iovec const *iov, size_t count) {
+    shm_ring_shared_t *shared = ring->shared;
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+
+    uint64_t head = ring->position;
+    uint64_t tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->capacity || size > ring->capacity) {
+        return -1;
+    }
+    if (ring->capacity - (head - tail) < size) {
+        // Either the consumer sees the flag, or this sees what it consumed
+        __atomic_store_n(&shared->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&shared->tail, __ATOMIC_SEQ_CST);
+        if (head - tail > ring->capacity) {
+            return -1;
+        }
+        if (ring->capacity - (head - tail) < size) {
+            return 0;
+        }
+        __atomic_store_n(&shared->producer_sleeping, 0, __ATOMIC_RELAXED);
+    }
+
+    char *at = ring->data + head % ring->capacity;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(at, iov[i].iov_base, iov[i].iov_len);
+        at += iov[i].iov_len;
+    }
+    ring->position = head + size;
+    __atomic_store_n(&shared->head, ring->position, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&shared->consumer_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&shared->consumer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        wake(ring, &shared->consumer_sleeping);
+    }
+    return 1;
+}
+
+ssize_t shm_ring_peek(shm_ring_t *ring, char const **data) {
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+    if (head - ring->position > ring->capacity) {
+        return -1;
+    }
+    *data = ring->data + ring->position % ring->capacity;
+    return (ssize_t)(head - ring->position);
+}
+
+void shm_ring_consume(shm_ring_t *ring, size_t size) {
+    shm_ring_shared_t *shared = ring->shared;
+    if (size == 0) {
+        return;
+    }
+
+    ring->position += size;
+    __atomic_store_n(&shared->tail, ring->position, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&shared->producer_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&shared->producer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+        wake(ring, &shared->producer_sleeping);
+    }
+}
+
+bool shm_ring_consumer_sleep(shm_ring_t *ring, size_t available) {
+    shm_ring_shared_t *shared = ring->shared;
+
+    // Either the producer sees the flag, or this sees what it wrote
+    __atomic_store_n(&shared->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+    uint64_t head = __atomic_load_n(&shared->head, __ATOMIC_SEQ_CST);
+    if (head - ring->position > available) {
+        __atomic_store_n(&shared->consumer_sleeping, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Returns whether mbroker closed the ring or its end of the client's pipe.
+ */
+static bool broker_gone(shm_ring_t const *ring) {
+    if (shm_ring_closed(ring)) {
+        return true;
+    }
+    struct pollfd fds = {.fd = ring->doorbell, .events = 0};
+    return ring->doorbell != -1 && poll(&fds, 1, 0) == 1 &&
+           (fds.revents & (POLLERR | POLLHUP)) != 0;
+}
+
+/**
+ * Sleeps on a futex word while it is set, for at most timeout_ms.
+ */
+static void futex_wait(uint32_t *word, long timeout_ms) {
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000,
+    };
+    syscall(SYS_futex, word, FUTEX_WAIT, 1, &timeout, NULL, 0);
+}
+
+int shm_ring_write_all(shm_ring_t *ring, struct iovec const *iov,
+                       size_t count) {
+    int ret;
+    while ((ret = shm_ring_write(ring, iov, count)) == 0) {
+        if (broker_gone(ring)) {
+            return -1;
+        }
+        futex_wait(&ring->shared->producer_sleeping, CHECK_INTERVAL_MS);
+    }
+    return ret == 1 ? 0 : -1;
+}
+
+int shm_ring_wait_data(shm_ring_t *ring, size_t available, int timeout_ms) {
+    long deadline = now_ms() + timeout_ms;
+    while (shm_ring_consumer_sleep(ring, available)) {
+        long left = timeout_ms < 0 ? CHECK_INTERVAL_MS : deadline - now_ms();
+        if (left <= 0 || broker_gone(ring)) {
+            __atomic_store_n(&ring->shared->consumer_sleeping, 0,
+                             __ATOMIC_RELAXED);
+            return left <= 0 ? 0 : -1;
+        }
+        futex_wait(&ring->shared->consumer_sleeping,
+                   left < CHECK_INTERVAL_MS ? left : CHECK_INTERVAL_MS);
+    }
+    return 1;
+}
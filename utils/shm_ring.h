@@ -0,0 +1,154 @@
+#ifndef __UTILS_SHM_RING_H__
+#define __UTILS_SHM_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Single-producer single-consumer ring of frames (see frame.h) in shared
+ * memory, through which a publisher sends its messages to mbroker, or mbroker
+ * sends a subscriber its messages, instead of their pipe.
+ *
+ * The client creates the ring (named after its pipe, see shm_ring_name) before
+ * registering with REGISTER_PUBLISHER_SHM or REGISTER_SUBSCRIBER_SHM, and
+ * mbroker attaches to it before opening the pipe. The pipe still tells each
+ * side when the other one is gone, and is written by the client in both
+ * cases: it carries the wake-ups for mbroker, whose threads wait in epoll.
+ * The client waits on a futex instead.
+ *
+ * Each side sleeps only when the ring is empty (consumer) or full (producer),
+ * after saying so in the ring, and the other side only wakes it up then: a
+ * busy ring costs no system calls.
+ *
+ * The data is mapped twice in a row, so the frames can be written and read in
+ * place even where they wrap around the end.
+ */
+typedef struct shm_ring_shared shm_ring_shared_t;
+
+typedef struct {
+    shm_ring_shared_t *shared;
+    char *data;
+    size_t capacity;
+    void *map;
+    size_t map_size;
+    // This side's own copy of the position it advances (head for the
+    // producer, tail for the consumer), which the other side can't change
+    uint64_t position;
+    // Pipe written to wake up the other side, or -1 to use the futex (the
+    // other side is a client). Clients set it to their pipe once opened
+    int doorbell;
+} shm_ring_t;
+
+// Size of the name of a ring (see shm_ring_name)
+#define SHM_RING_NAME_SIZE 32
+// Capacity of the rings, which is rounded up to a power of two
+#define SHM_RING_MIN_CAPACITY (64 * 1024)
+#define SHM_RING_MAX_CAPACITY (64 * 1024 * 1024)
+
+/**
+ * Writes the name of the ring of the client with the given pipe to name, which
+ * must hold SHM_RING_NAME_SIZE characters.
+ */
+void shm_ring_name(char const *pipe_name, char *name);
+
+/**
+ * Creates a ring (replacing any left over with the same name).
+ *
+ * Input:
+ *   - ring: the ring to initialize
+ *   - name: name of the ring
+ *   - capacity: bytes of frames it holds, rounded up to a power of two
+ *     between SHM_RING_MIN_CAPACITY and SHM_RING_MAX_CAPACITY
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int shm_ring_create(shm_ring_t *ring, char const *name, size_t capacity);
+
+/**
+ * Maps a ring created by a client.
+ *
+ * Returns 0 if successful, -1 if it doesn't exist or is not a valid ring.
+ */
+int shm_ring_attach(shm_ring_t *ring, char const *name);
+
+/**
+ * Tells the other side the ring won't be used anymore, waking it up.
+ */
+void shm_ring_close(shm_ring_t *ring);
+
+/**
+ * Returns whether the other side closed the ring.
+ */
+bool shm_ring_closed(shm_ring_t const *ring);
+
+/**
+ * Unmaps a ring.
+ */
+void shm_ring_detach(shm_ring_t *ring);
+
+/**
+ * Copies frames into the ring, as a whole or not at all, waking up the
+ * consumer if it sleeps.
+ *
+ * If there is no room, the producer is marked as sleeping, and will be woken
+ * up once the consumer makes some.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - iov: the frames' bytes
+ *   - count: number of entries in iov
+ *
+ * Returns 1 if the frames were written, 0 if there is no room for them, or -1
+ * if the ring was corrupted by the other side.
+ */
+int shm_ring_write(shm_ring_t *ring, struct iovec const *iov, size_t count);
+
+/**
+ * Finds the bytes ready to be read, which stay in the ring until consumed.
+ *
+ * Returns their number (storing where they are in data), or -1 if the ring
+ * was corrupted by the other side.
+ */
+ssize_t shm_ring_peek(shm_ring_t *ring, char const **data);
+
+/**
+ * Frees the first size bytes of those returned by shm_ring_peek, waking up the
+ * producer if it sleeps.
+ */
+void shm_ring_consume(shm_ring_t *ring, size_t size);
+
+/**
+ * Marks the consumer as sleeping, unless more than available bytes are ready
+ * to be read by now.
+ *
+ * Returns true if the consumer will be woken up once there are, false if
+ * there already are.
+ */
+bool shm_ring_consumer_sleep(shm_ring_t *ring, size_t available);
+
+/**
+ * Like shm_ring_write, waiting for room if there is none. For clients.
+ *
+ * Returns 0 if the frames were written, or -1 if mbroker is gone.
+ */
+int shm_ring_write_all(shm_ring_t *ring, struct iovec const *iov,
+                       size_t count);
+
+/**
+ * Waits until more than available bytes are ready to be read. For clients.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - available: bytes already known to be ready
+ *   - timeout_ms: how long to wait at most, or -1 to wait for as long as it
+ *     takes
+ *
+ * Returns 1 if there are, 0 if the timeout expired, or -1 if mbroker is gone
+ * (closed the ring or the pipe) and there are none.
+ */
+int shm_ring_wait_data(shm_ring_t *ring, size_t available, int timeout_ms);
+
+#endif // __UTILS_SHM_RING_H__
@@ -0,0 +1,103 @@
+#include "sockets.h"
+#include "frame.h"
+#include "logging.h"
+#include "pipes.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Fills in the address of the socket at path.
+ *
+ * Returns 0 if successful, -1 (with errno set) if path is too long.
+ */
+static int socket_address(char const *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+bool socket_is_listener(char const *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+int socket_listen(char const *path) {
+    struct sockaddr_un address;
+    if (socket_address(path, &address) == -1) {
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    // Anyone can connect, like anyone can write to the register pipe
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        chmod(path, 0666) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int socket_connect(char const *path) {
+    struct sockaddr_un address;
+    if (socket_address(path, &address) == -1) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+size_t socket_record_size(char const *frames, size_t size) {
+    size_t record = 0;
+    frame_header_t header;
+    char const *payload;
+    ssize_t frame;
+    while ((frame = frame_parse(frames + record, size - record, &header,
+                                &payload)) > 0 &&
+           record + (size_t)frame <= PIPE_BUF) {
+        record += (size_t)frame;
+    }
+    return record;
+}
+
+int socket_register_client(char *registerName, char *clientPipeName,
+                           packet_t *packet, int mode, int *registerPipe) {
+    if (socket_is_listener(registerName)) {
+        int connection = socket_connect(registerName);
+        if (connection == -1) {
+            PANIC("Failed to connect to %s", registerName);
+        }
+        *registerPipe = -1;
+        pipe_write(connection, packet);
+        return connection;
+    }
+
+    *registerPipe = pipe_open(registerName, O_WRONLY);
+    pipe_create(clientPipeName);
+    pipe_write(*registerPipe, packet);
+    return pipe_open(clientPipeName, mode);
+}
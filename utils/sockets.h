@@ -0,0 +1,66 @@
+#ifndef __UTILS_SOCKETS_H__
+#define __UTILS_SOCKETS_H__
+
+#include "protocol.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * mbroker can also take requests through a Unix socket (SOCK_SEQPACKET), as an
+ * alternative to its register pipe. A client connects, sends its registration
+ * (or manager request) as the first record, and the connection then takes the
+ * place of the client's pipe, in both directions: no pipe is created, and
+ * every client gets its own connection instead of sharing the register pipe.
+ *
+ * Records are never merged or split, and a read() returns at most one, cutting
+ * short whatever doesn't fit. So every record holds whole frames, at most
+ * PIPE_BUF bytes of them (as much as an atomic pipe write), and frame readers
+ * always keep that much room for a read (see FRAME_READ_ROOM).
+ */
+
+/**
+ * Returns whether path is mbroker's socket (rather than its register pipe).
+ */
+bool socket_is_listener(char const *path);
+
+/**
+ * Creates a socket at path (replacing any file already there) and listens on
+ * it for clients.
+ *
+ * Returns the socket's file descriptor (non-blocking), or -1 on error.
+ */
+int socket_listen(char const *path);
+
+/**
+ * Connects to mbroker's socket at path.
+ *
+ * Returns the connection's file descriptor, or -1 on error.
+ */
+int socket_connect(char const *path);
+
+/**
+ * Returns how many bytes of the given frames fit in a single record: the
+ * whole frames at their start, up to PIPE_BUF bytes.
+ */
+size_t socket_record_size(char const *frames, size_t size);
+
+/**
+ * Registers a client with mbroker (or sends it a manager request), through its
+ * socket if registerName is one, or else through its register pipe.
+ *
+ * Input:
+ *   - registerName: mbroker's socket or register pipe
+ *   - clientPipeName: the client's pipe, created before the packet is sent
+ *     through the register pipe (unused with the socket)
+ *   - packet: the registration or request
+ *   - mode: how the client's pipe is opened (O_RDONLY or O_WRONLY)
+ *   - registerPipe: where to store the register pipe, left open for the
+ *     client to close, or -1 if the socket was used
+ *
+ * Returns the connection to mbroker, or the client's pipe (opened once mbroker
+ * opened the other end).
+ */
+int socket_register_client(char *registerName, char *clientPipeName,
+                           packet_t *packet, int mode, int *registerPipe);
+
+#endif // __UTILS_SOCKETS_H__